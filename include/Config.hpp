@@ -6,12 +6,10 @@
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <cmath>
+#include <cstdint>
 
-extern unsigned int  g_uFuncMask;
-extern unsigned int  g_uLineSortingBufSize;
-extern unsigned char g_ucBaseNum;
-extern unsigned char g_ucLocStrFixedLen;
-extern unsigned int  g_ucAddrSearchRange;
+#include <unistd.h>
 
 /* space 32 */
 #define RAW_LOG_DELIMITER	9
@@ -29,11 +27,93 @@ extern unsigned int  g_ucAddrSearchRange;
    A DNS answer section may contain 3 rrsets, such as cnames, addr4s, and addr6s.
  */
 #define MAX_ALLOWED_RRSET_SIZE  82
+/*
+	Number of resource records reserved in the pool for each line of a chunk.
+	The encoder ends a chunk early rather than grow the pool past it, the
+	decoder grows the pool if a chunk needs more.
+*/
+#define RRPOOL_SIZE_PER_LINE    7
+/* Smallest pool, the answers of a few lines. */
+#define RRPOOL_MIN_SIZE         (4 * MAX_ALLOWED_RRSET_SIZE)
 
 #define FIELD_REPLACEMENT_FLAG_CHAR '-'
 
 #define FILED_REPLACED(dlz_s) (1 == dlz_s.len && FIELD_REPLACEMENT_FLAG_CHAR == dlz_s.data[0])
 
+/* Prefix of a negative time delta, for lines slightly out of order. */
+#define TIME_NEGATIVE_FLAG_CHAR '-'
+
+/* Prefix of an address written against the one before it. */
+#define ADDR_DELTA_FLAG_CHAR '^'
+
+/*
+	An IPv4 client or server address is written as its XOR with the one
+	before only if they differ in the low bits, here within a /24: the full
+	addresses repeat through the chunk and the backend compressor gains
+	more from them than from the XOR of two unrelated addresses.
+*/
+#define ADDR_XOR_MAX_BITS		8
+
+/*
+	Learned field hiding: the (qtype, rcode) pairs with a qtype below 256 and
+	an rcode below 16 are counted per chunk. The chunk header lists the ones
+	worth a code, the first one is hidden and the others are written as
+	HIDDEN_PAIR_FLAG_CHAR and their index.
+*/
+#define HIDDEN_PAIR_SLOTS		4096
+#define MAX_HIDDEN_PAIRS		32
+#define HIDDEN_PAIR_NONE		0xFF
+#define HIDDEN_PAIR_FLAG_CHAR	'*'
+
+/* Prefix of the index of an earlier RRSet of the chunk, in place of its size. */
+#define RRSET_REF_FLAG_CHAR		'@'
+
+/*
+	The mask is not written in the stream, so the default stays the one of
+	the first releases. The techniques added since write their own syntax
+	and are only enabled with -M, e.g. FULL_FUNC_MASK. Decompression then
+	takes the same mask.
+*/
+#define DEFAULT_FUNC_MASK				0xFF
+#define FULL_FUNC_MASK					0x37FF
+#define DEFAULT_LINE_SORTING_BUF_SIZE	30000
+#define MAX_LINE_SORTING_BUF_SIZE		(1 << 24)
+#define DEFAULT_BASE_NUM				32
+#define MAX_TIME_PRECISION				9
+
+/* The pool of a run must hold the answers of any line. */
+#define MIN_RUN_LINES					32
+
+/* Entries of the cache of parsed answer sections, a power of 2. */
+#define PARSE_CACHE_SIZE				1024
+
+/* Entries of the cache of parsed client and server addresses, a power of 2. */
+#define ADDR_CACHE_SIZE					256
+
+/*
+	Entries of the caches giving the lines of a chunk with the same qname,
+	or the same server address, the same sort ID. A power of 2.
+*/
+#define SORT_ID_CACHE_SIZE				4096
+
+/*
+	Above this share of distinct qnames in a chunk (e.g. scanner traffic),
+	ranking them costs as much as sorting the records directly.
+*/
+#define SORT_MAX_DISTINCT_RATIO			0.5
+
+/* Block size of the reads and writes of spilled runs. */
+#define SPILL_BLOCK_SIZE				(64 * 1024)
+
+/*
+	Adaptive chunks grow or shrink by this factor, and shrink at once when
+	more than this share of their qnames are distinct. A change of the
+	output bytes per line within the tolerance is taken as noise.
+*/
+#define ADAPT_STEP						1.5
+#define ADAPT_MAX_DISTINCT_RATIO		0.9
+#define ADAPT_TOLERANCE					0.02
+
 /* Function mask */
 #define M_LINE_SORTING			0x01
 #define M_RDADDR_SORTING		0x02
@@ -42,15 +122,127 @@ extern unsigned int  g_ucAddrSearchRange;
 #define M_FIELD_HIDING			0x10
 #define M_FIELD_REPLACEMENT		0x20
 #define M_NUM_ENCODING			0x40
+/* 0x80 is not used: 0xFF has always meant the same as 0x7F. */
+#define M_LOC_DELTA				0x100
+#define M_SORTED_RRSETS			0x200
+#define M_IPV6_PREFIX			0x400
+#define M_ADDR_XOR				0x800
+#define M_LEARNED_HIDING		0x1000
+#define M_RRSET_REFS			0x2000
+
+
+/*
+	The encoder and decoder are templated on the function mask, so that the
+	ENABLE_* tests below fold into constants for the common masks. M_DYNAMIC
+	is the generic instantiation, which reads the mask of the context at runtime.
+	These macros are only valid inside members of DNSLogzipC/DNSLogzipD.
+*/
+#define M_DYNAMIC				0xFFFFFFFF
+#define FUNC_ENABLED(m)			((M_DYNAMIC == Mask ? this->ctx.uFuncMask : Mask) & (m))
+
+#define ENABLE_LINE_SORTING			FUNC_ENABLED(M_LINE_SORTING)
+#define ENABLE_RRADDR_SORTING		FUNC_ENABLED(M_RDADDR_SORTING)
+#define ENABLE_ADDR_DIFFERENCE		FUNC_ENABLED(M_RDADDR_DIFFERENCE)
+#define ENABLE_NUM_ENCODING			FUNC_ENABLED(M_NUM_ENCODING)
+#define ENABLE_TIME_DIFFERENCE		FUNC_ENABLED(M_TIME_DIFFERENCE)
+#define ENABLE_FIELD_HIDDING		FUNC_ENABLED(M_FIELD_HIDING)
+#define ENABLE_FIELD_REPLACEMENT	FUNC_ENABLED(M_FIELD_REPLACEMENT)
+#define ENABLE_LOC_DELTA			FUNC_ENABLED(M_LOC_DELTA)
+#define ENABLE_SORTED_RRSETS		FUNC_ENABLED(M_SORTED_RRSETS)
+#define ENABLE_IPV6_PREFIX			FUNC_ENABLED(M_IPV6_PREFIX)
+#define ENABLE_ADDR_XOR				FUNC_ENABLED(M_ADDR_XOR)
+#define ENABLE_LEARNED_HIDING		FUNC_ENABLED(M_LEARNED_HIDING)
+#define ENABLE_RRSET_REFS			FUNC_ENABLED(M_RRSET_REFS)
+
+
+/*
+	Settings of one encoder/decoder instance. Each DNSLogzipC/DNSLogzipD keeps
+	its own copy, so instances with different settings can run side by side.
+*/
+struct DNSLogzipCtx {
+	unsigned int  uFuncMask;
+	unsigned int  uLineSortingBufSize;
+	unsigned char ucBaseNum;
+	unsigned char ucLocStrFixedLen;
+
+	/* Digits of the fractional seconds of the time column. */
+	unsigned char ucTimePrecision;
+
+	/* Flush a chunk once its raw lines reach this size, 0 for no limit. */
+	size_t uMaxChunkBytes;
+
+	/*
+		Output of every chunk is passed to pfnOutput if set,
+		otherwise it is written to nOutFd.
+	*/
+	void (*pfnOutput)(const char *data, size_t len, void *arg);
+	void *pOutputArg;
+	int nOutFd;
+
+	/* Decoders keep the records of each chunk instead of printing them. */
+	bool bRecordMode;
+
+	/*
+		Encoders sort a chunk of more than uRunLines lines in runs of that
+		many lines, spilled to nSpillFd and merged when the chunk is output.
+		0 keeps the whole chunk in memory.
+	*/
+	unsigned int uRunLines;
+	int nSpillFd;
+
+	/*
+		Adaptive chunks: encoders pick the size of every chunk between
+		uMinLines and uLineSortingBufSize, and start the chunk with it.
+		0 for chunks of uLineSortingBufSize lines.
+	*/
+	unsigned int uMinLines;
+	/* Target time from the first line of a chunk to its output, 0 for none. */
+	unsigned int uChunkLatencyMs;
+
+	/* muls[i] is ucBaseNum to the power of i. */
+	uint64_t muls[64];
+
+	DNSLogzipCtx(unsigned int uFuncMask = DEFAULT_FUNC_MASK,
+					unsigned int uLineSortingBufSize = DEFAULT_LINE_SORTING_BUF_SIZE,
+					unsigned char ucBaseNum = DEFAULT_BASE_NUM) {
+		this->uFuncMask = uFuncMask;
+		this->uLineSortingBufSize = uLineSortingBufSize;
+		this->ucBaseNum = ucBaseNum;
+		this->uMaxChunkBytes = 0;
+		this->ucTimePrecision = 0;
+		this->pfnOutput = NULL;
+		this->pOutputArg = NULL;
+		this->nOutFd = STDOUT_FILENO;
+		this->bRecordMode = false;
+		this->uRunLines = 0;
+		this->nSpillFd = -1;
+		this->uMinLines = 0;
+		this->uChunkLatencyMs = 0;
+
+		this->SetLocStrFixedLen(uLineSortingBufSize);
+
+		this->muls[0] = 1;
+		for (size_t i = 1; i < sizeof(this->muls) / sizeof(this->muls[0]); ++i) {
+			this->muls[i] = this->muls[i - 1] * ucBaseNum;
+		}
+	}
 
+	/* Set the fixed len: the number of digits of the largest line ID. */
+	void SetLocStrFixedLen(uint64_t uLines) {
+		this->ucLocStrFixedLen = 0;
+		for (uint64_t n = uLines; n > 0; n /= this->ucBaseNum) {
+			this->ucLocStrFixedLen++;
+		}
+	}
 
-#define ENABLE_LINE_SORTING			(g_uFuncMask & M_LINE_SORTING)
-#define ENABLE_RRADDR_SORTING		(g_uFuncMask & M_RDADDR_SORTING)
-#define ENABLE_ADDR_DIFFERENCE		(g_uFuncMask & M_RDADDR_DIFFERENCE)
-#define ENABLE_NUM_ENCODING			(g_uFuncMask & M_NUM_ENCODING)
-#define ENABLE_TIME_DIFFERENCE		(g_uFuncMask & M_TIME_DIFFERENCE)
-#define ENABLE_FIELD_HIDDING		(g_uFuncMask & M_FIELD_HIDING)
-#define ENABLE_FIELD_REPLACEMENT	(g_uFuncMask & M_FIELD_REPLACEMENT)
+	/* Number of lines held in memory. */
+	unsigned int MemLines(void) const {
+		if (this->uRunLines > 0 && this->uRunLines < this->uLineSortingBufSize) {
+			return this->uRunLines;
+		}
 
+		return this->uLineSortingBufSize;
+	}
+};
 
 #endif
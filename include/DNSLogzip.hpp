@@ -4,12 +4,13 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include <cstring>
+#include <algorithm>
 #include <list>
 #include <vector>
+#include <unordered_map>
 #include <Config.hpp>
-
-struct RRAddr **PoolGetNAddrRR(size_t n);
-std::string **PoolGetNStrRR(size_t n);
+#include <dnslogzip.h>
 
 static inline bool operator< (const struct sockaddr_storage& lhs, const struct sockaddr_storage& rhs) 
 {	
@@ -53,6 +54,140 @@ static inline bool operator!= (const struct sockaddr_storage& lhs, const struct
 	return !(lhs == rhs);
 }
 
+/* An address in RRSet. */
+struct RRAddr {
+	uint8_t uloc;
+	struct sockaddr_storage addr;
+	std::string sVal;
+};
+
+/*
+	Records of one kind of a RRPool, in blocks of the same size. A block is
+	added when the answers of a chunk need more records than the blocks so
+	far, so the arrays handed out never move.
+*/
+template <typename T>
+class RRBlocks {
+	public:
+		RRBlocks(size_t size) {
+			this->size = size;
+			this->iBlock = 0;
+			this->i = 0;
+			this->AddBlock();
+		}
+
+		~RRBlocks(void) {
+			for (size_t b = 0; b < this->ptrs.size(); ++b) {
+				delete [] this->ptrs[b];
+				delete [] this->elems[b];
+			}
+		}
+
+		inline T **Get(size_t n) {
+			assert(n <= this->size);
+			if (this->i + n > this->size) {
+				if (++this->iBlock == this->ptrs.size()) {
+					this->AddBlock();
+				}
+				this->i = 0;
+			}
+			this->i += n;
+			return this->ptrs[this->iBlock] + this->i - n;
+		}
+
+		/* True if n more records fit in the current block. */
+		inline bool HasRoom(size_t n) const {
+			return this->i + n <= this->size;
+		}
+
+		/* Position of the next records, to give back the ones handed out after it. */
+		inline size_t Tell(void) const {
+			return this->iBlock * (this->size + 1) + this->i;
+		}
+
+		inline void Rewind(size_t pos) {
+			this->iBlock = pos / (this->size + 1);
+			this->i = pos % (this->size + 1);
+		}
+
+		/* Sorting moves the pointers that were handed out, point them back to their records. */
+		void Reset(void) {
+			for (size_t b = 0; b <= this->iBlock; ++b) {
+				size_t n = b < this->iBlock ? this->size : this->i;
+
+				for (size_t k = 0; k < n; ++k) {
+					this->ptrs[b][k] = &this->elems[b][k];
+				}
+			}
+			this->iBlock = 0;
+			this->i = 0;
+		}
+
+	private:
+		size_t size;
+		std::vector<T **> ptrs;
+		std::vector<T *>  elems;
+		/* The current block, and its records handed out. */
+		size_t iBlock;
+		size_t i;
+
+		void AddBlock(void) {
+			T **ptrs = new T* [this->size];
+			T  *elems = new T [this->size];
+
+			for (size_t k = 0; k < this->size; ++k) {
+				ptrs[k] = &elems[k];
+			}
+			this->ptrs.push_back(ptrs);
+			this->elems.push_back(elems);
+		}
+};
+
+/*
+	Simple memory pool for resource records.
+	Each encoder/decoder owns one, and resets it after every chunk. It is
+	sized for the lines of a chunk and grows if their answers need more.
+*/
+class RRPool {
+	public:
+		RRPool(size_t size) : addrRRs(size), strRRs(size) {}
+
+		inline void Reset(void) {
+			this->addrRRs.Reset();
+			this->strRRs.Reset();
+		}
+
+		inline struct RRAddr **GetNAddrRR(size_t n) {
+			assert(n < 128);
+			return this->addrRRs.Get(n);
+		}
+
+		inline std::string **GetNStrRR(size_t n) {
+			assert(n < 128);
+			return this->strRRs.Get(n);
+		}
+
+		/* True if n more records of each kind fit in the pool without growing it. */
+		inline bool HasRoom(size_t n) const {
+			return this->addrRRs.HasRoom(n) && this->strRRs.HasRoom(n);
+		}
+
+		/* Give back the records of a line that failed to parse, see RRBlocks::Tell(). */
+		inline void Tell(size_t *uAddr, size_t *uStr) const {
+			*uAddr = this->addrRRs.Tell();
+			*uStr = this->strRRs.Tell();
+		}
+
+		inline void Rewind(size_t uAddr, size_t uStr) {
+			this->addrRRs.Rewind(uAddr);
+			this->strRRs.Rewind(uStr);
+		}
+
+	private:
+		RRBlocks<struct RRAddr> addrRRs;
+		RRBlocks<std::string>   strRRs;
+};
+
 struct DNSRRSet {
 	uint8_t type;
 	uint8_t size;
@@ -66,6 +201,10 @@ struct StrDNSRRSet : public DNSRRSet {
 		if (size != other.size || type != other.type) {
 			return false;
 		}
+		else if (rrs == other.rrs) {
+			/* Shared by the parse cache. */
+			return true;
+		}
 		else {
 			for (uint8_t i = 0; i < size; ++i) {
 				if (*rrs[i] != *other.rrs[i]) {
@@ -77,27 +216,19 @@ struct StrDNSRRSet : public DNSRRSet {
 		return true;
 	}
 
-	StrDNSRRSet& operator=(const StrDNSRRSet& other) {
+	/* Copy the rrset, the array of records is allocated from the pool. */
+	void CopyFrom(const StrDNSRRSet& other, RRPool &pool) {
 		/* Guard self assignment */
 		if (this == &other)
-			return *this;
+			return;
 
 		type = other.type;
 		size = other.size;
-		rrs  = PoolGetNStrRR(size);
+		rrs  = pool.GetNStrRR(size);
 		std::copy(other.rrs, other.rrs + other.size, rrs);
-		
-		return *this;
 	}
 };
 
-/* An address in RRSet. */
-struct RRAddr {
-	uint8_t uloc;
-	struct sockaddr_storage addr;
-	std::string sVal;
-};
-
 struct AddrDNSRRSet : public DNSRRSet{
 	/* Resource records */
 	struct RRAddr **rrs;
@@ -106,6 +237,10 @@ struct AddrDNSRRSet : public DNSRRSet{
 		if (size != other.size || type != other.type) {
 			return false;
 		}
+		else if (rrs == other.rrs) {
+			/* Shared by the parse cache. */
+			return true;
+		}
 		else {
 			for (uint8_t i = 0; i < size; ++i) {
 				
@@ -118,24 +253,55 @@ struct AddrDNSRRSet : public DNSRRSet{
 		return true;
 	}
 
-	AddrDNSRRSet& operator=(const AddrDNSRRSet& other) {
+	/* Copy the rrset, the array of records is allocated from the pool. */
+	void CopyFrom(const AddrDNSRRSet& other, RRPool &pool) {
 		// Guard self assignment
 		if (this == &other)
-			return *this;
+			return;
 
 		type = other.type;
 		size = other.size;
-		rrs  = PoolGetNAddrRR(size);
+		rrs  = pool.GetNAddrRR(size);
 		
 		std::copy(other.rrs, other.rrs + other.size, rrs);
-		
-		return *this;
 	}
 };
 
+/*
+	An answer section parsed in the chunk, by the hash of its raw text. The
+	RRSets share the pooled arrays of the record it was parsed for, so the
+	entry is only valid until the pool is reset, when uGen moves on.
+*/
+struct ParseCacheEntry {
+	uint64_t		uHash;
+	uint32_t		uGen;
+	std::string		sRaw;
+
+	StrDNSRRSet		cnameRRSet;
+	AddrDNSRRSet	addr4RRSet;
+	AddrDNSRRSet	addr6RRSet;
+};
+
+/* A client or server address by the hash of its text, see ADDR_CACHE_SIZE. */
+struct AddrCacheEntry {
+	uint64_t		uHash;
+	/* 0 for an empty entry. */
+	uint8_t			ucLen;
+	char			sText[INET6_ADDRSTRLEN];
+	struct sockaddr_storage addr;
+};
+
+/* A qname or server address of the chunk by its hash, see SORT_ID_CACHE_SIZE. */
+struct SortIDEntry {
+	uint64_t		uHash;
+	uint32_t		uGen;
+	uint32_t		uID;
+};
+
 struct DNSRecord {
 	int nID;
-	int nTimeSec;
+	/* In units of 10^-ucTimePrecision seconds. */
+	int64_t nTime;
 	
 	std::string sQname;
 	
@@ -145,7 +311,7 @@ struct DNSRecord {
 };
 
 struct DNSRecordC : public DNSRecord {
-	int nTimeSecDiff;
+	int64_t nTimeDiff;
 
 	struct sockaddr_storage caddr;
 	struct sockaddr_storage saddr;
@@ -154,6 +320,40 @@ struct DNSRecordC : public DNSRecord {
 	uint8_t  nRcode;
 };
 
+/*
+	A sorted run of an encoder chunk, spilled to [uOffset, uEnd) of the
+	spill file and read back in blocks when the runs are merged.
+*/
+struct DNSRunC {
+	off_t uOffset;
+	off_t uEnd;
+
+	/* Next position to read and the block read last. */
+	off_t uRead;
+	std::string buf;
+	size_t pos;
+
+	/*
+		The current record of the run and the one before it, which the
+		output may still compare with. Each has its own pool.
+	*/
+	DNSRecordC records[2];
+	RRPool *pools[2];
+	int iCur;
+
+	DNSRunC(off_t uOffset, off_t uEnd) {
+		this->uOffset = uOffset;
+		this->uEnd = uEnd;
+		this->pools[0] = new RRPool(2 * MAX_ALLOWED_RRSET_SIZE + 1);
+		this->pools[1] = new RRPool(2 * MAX_ALLOWED_RRSET_SIZE + 1);
+	}
+
+	~DNSRunC(void) {
+		delete this->pools[0];
+		delete this->pools[1];
+	}
+};
+
 struct DNSRecordD  : public DNSRecord {
 	std::string sQtype;
 	std::string sRcode;
@@ -164,14 +364,107 @@ struct DNSRecordD  : public DNSRecord {
 
 class DNSLogzip {
 	public:
-		virtual void Process(dlz_row_t *row) = 0;
+		virtual ~DNSLogzip(void) {}
+		/* Return DLZ_ERROR if the line is malformed, it is then skipped. */
+		virtual int Process(dlz_row_t *row) = 0;
 		virtual void Finish(void) = 0;
+
+		/*
+			Encode a record parsed by the caller, e.g. from a packet, instead
+			of a raw line. The arrays hold the answers of the record.
+		*/
+		virtual int ProcessRecord(const dlz_record_t *rec, const dlz_view_t *cnames,
+									const struct sockaddr_storage *addr4s,
+									const struct sockaddr_storage *addr6s) { return DLZ_ERROR; }
+
+		/* Output the current chunk even if it is not full. */
+		virtual void Flush(void) { this->Finish(); }
+
+		/* Number of lines in the current chunk. */
+		size_t PendingLines(void) const { return this->uLineID; }
+
+		/* Counters of the parse caches, see dlz_codec_stats(). */
+		virtual void GetStats(dlz_stats_t *stats) const { memset(stats, 0, sizeof(*stats)); }
+
+		/*
+			Decoders in record mode keep a finished chunk until it is released.
+			ReadyRecords() is the number of its records, 0 if none is ready.
+		*/
+		virtual size_t ReadyRecords(void) { return 0; }
+		virtual void GetRecord(size_t i, dlz_record_t *rec) {}
+		virtual void ReleaseRecords(void) {}
 		
 	protected:
-		uint16_t uLineID;
+		DNSLogzipCtx ctx;
+		RRPool pool;
+		uint32_t uLineID;
+		/* Number of lines of the current chunk, see ctx.uMinLines. */
+		uint32_t uChunkLines;
 
-		DNSLogzip(void) {
+		/* Output of the current chunk, and its size so far. */
+		std::string outBuf;
+		size_t uChunkOutBytes;
+
+		/* Text of the records before it is emitted, grown for the longest one. */
+		std::vector<char> textBuf;
+
+		DNSLogzip(const DNSLogzipCtx &ctx) : ctx(ctx), pool(std::max((size_t) ctx.MemLines() * RRPOOL_SIZE_PER_LINE, (size_t) RRPOOL_MIN_SIZE)) {
 			this->uLineID = 0;
+			this->uChunkLines = ctx.uLineSortingBufSize;
+			this->uChunkOutBytes = 0;
+			this->textBuf.resize(CHUCK_SIZE + 1024);
+		}
+
+		inline void emit(const char *data, size_t len) {
+			this->outBuf.append(data, len);
+		}
+
+		/*
+			Make room for n bytes of text at s, in textBuf. The text before s
+			is emitted if they do not fit. Return where to write them.
+		*/
+		inline char *text_room(char *s, size_t n) {
+			char *b = this->textBuf.data();
+
+			if ((size_t) (b + this->textBuf.size() - s) >= n) {
+				return s;
+			}
+
+			this->emit(b, s - b);
+			if (n > this->textBuf.size()) {
+				this->textBuf.resize(n);
+			}
+
+			return this->textBuf.data();
+		}
+
+		/* Hand the output of the chunk over to the handler of the context. */
+		void flush_chunk(void) {
+			const char *p = this->outBuf.data();
+			size_t n = this->outBuf.size();
+			ssize_t rc;
+
+			if (0 == n) {
+				return;
+			}
+
+			this->uChunkOutBytes += n;
+			if (NULL != this->ctx.pfnOutput) {
+				this->ctx.pfnOutput(p, n, this->ctx.pOutputArg);
+			}
+			else {
+				while (n > 0) {
+					rc = write(this->ctx.nOutFd, p, n);
+					if (rc <= 0) {
+						break;
+					}
+
+					p += rc;
+					n -= rc;
+				}
+			}
+
+			this->outBuf.clear();
 		}
 
 		void initialize_record(DNSRecord *r) {
@@ -181,71 +474,232 @@ class DNSLogzip {
 		}
 };
 
+template <unsigned int Mask>
 class DNSLogzipC : public DNSLogzip {
 	private:
 		DNSRecordC **records;
 		DNSRecordC *recordElems;
+
+		/*
+			Columns of the line sorting, by the slot of the record in records:
+			its qtype and the sort IDs of its qname and server address. An ID
+			stands for the first record given it, in qnameIDRecords and
+			saddrIDRecords. The sort only ranks the IDs and then sorts packed
+			keys, so it reads no record for most comparisons. Equal values
+			may get several IDs, which are ranked equal.
+		*/
+		uint16_t *uQtypes;
+		uint32_t *uQnameIDs;
+		uint32_t *uSaddrIDs;
+		std::vector<const DNSRecordC*> qnameIDRecords;
+		std::vector<const DNSRecordC*> saddrIDRecords;
+		SortIDEntry *qnameIDCache;
+		SortIDEntry *saddrIDCache;
+		uint32_t uSortGen;
+
+		/* Ranks of the IDs, and the key and slot of every record, while sorting. */
+		std::vector<uint32_t> sortOrder;
+		std::vector<uint32_t> qnameRanks;
+		std::vector<uint32_t> saddrRanks;
+		std::vector<std::pair<uint64_t, uint32_t> > sortKeys;
+		std::vector<DNSRecordC*> sortedRecords;
+
+		/* Raw bytes of the current chunk. */
+		size_t uChunkBytes;
+
+		/* Time of the last line, for the time differential. */
+		int64_t nLastTime;
+
+		/*
+			Runs of the current chunk spilled to ctx.nSpillFd. The records
+			in memory are the lines after uRunBase.
+		*/
+		std::vector<DNSRunC *> runs;
+		uint32_t uRunBase;
+		off_t uSpillEnd;
+
+		/* Runs ordered by their current record, and the run of the last one. */
+		std::vector<DNSRunC *> mergeHeap;
+		DNSRunC *pMergeRun;
+
+		/*
+			Adaptive chunks: when the first line of the chunk came in, its
+			distinct qnames, and the output bytes per line of the last chunk
+			with the direction its size moved in.
+		*/
+		int64_t nChunkStartUs;
+		uint32_t uDistinctQnames;
+		double dLastBytesPerLine;
+		int nAdaptDir;
+
+		/* Sets in order skipped since the last rraddr locations printed. */
+		uint32_t uSortedRRSets;
+
+		/*
+			Answer sections parsed in the chunk. The last line parsed shares
+			the RRSets of an entry, which are sorted already, if bAnswersCached.
+		*/
+		ParseCacheEntry *parseCache;
+		uint32_t uParseCacheGen;
+		bool bAnswersCached;
+
+		/* Client and server addresses parsed before, valid across chunks. */
+		AddrCacheEntry *addrCache;
+		dlz_stats_t stats;
+
+		/*
+			With ENABLE_LEARNED_HIDING, the count of every (qtype, rcode) slot
+			in the chunk, and the code of the pairs in the chunk header.
+		*/
+		uint32_t uHiddenPairCounts[HIDDEN_PAIR_SLOTS];
+		uint8_t ucHiddenPairCodes[HIDDEN_PAIR_SLOTS];
+		uint16_t uHiddenPairs[MAX_HIDDEN_PAIRS];
+		size_t uHiddenPairsLen;
+
+		/*
+			With ENABLE_RRSET_REFS, the RRSets of the chunk printed in full,
+			and the index of the last one with each hash. The RRSets printed
+			before are not kept for chunks spilled in runs, these have none.
+		*/
+		bool bRRSetRefs;
+		std::vector<const DNSRRSet *> refRRSets;
+		std::unordered_map<uint64_t, uint32_t> refRRSetIndex;
 		
 		/* helper */
 		char* print_cnames(char *s, const StrDNSRRSet &rrset);
-		char* print_rraddrs(char *s, const AddrDNSRRSet &rrset, DNSRecordC *record);
+		char* print_rraddrs(char *s, const AddrDNSRRSet &rrset, const DNSRecordC *record);
 		char* print_rraddr_locs(char *s, const AddrDNSRRSet &rrset);
+		char* print_rraddr_locs(char *s, const DNSRecordC *r);
 		char* print_sockaddr(char *s, const struct sockaddr_storage &addr);
+		char* print_sockaddr(char *s, const struct sockaddr_storage &addr, const struct sockaddr_storage *ref);
 		char* print_hidden_fields(char *s, const DNSRecordC *r);
+		char* print_num(char *s, uint64_t n);
+		char* print_rrset_ref(char *s, const DNSRRSet &rrset, int nRef);
+		template <class RRSet> int find_rrset_ref(const RRSet &rrset);
 
 		/* key steps */
-		void parse_rraddrs(dlz_str_t* cols, AddrDNSRRSet &rrset, uint8_t &i, uint8_t type);
-		void parse(dlz_row_t *row, DNSRecordC *record);
+		bool parse_rraddrs(dlz_str_t* cols, AddrDNSRRSet &rrset, int &i, uint8_t type);
+		bool parse_addr(const dlz_str_t *col, struct sockaddr_storage *addr);
+		bool parse(dlz_row_t *row, DNSRecordC *record);
+		void commit(DNSRecordC *record, size_t uRawBytes);
 
 		int search_caddr(const struct sockaddr_storage &addr, int i);
 		int search_saddr(const struct sockaddr_storage &addr, int i);
 		
+		uint32_t get_sort_id(SortIDEntry *cache, std::vector<const DNSRecordC*> &idRecords, uint64_t uHash,
+								const DNSRecordC *r, bool (*pfnSame)(const DNSRecordC*, const DNSRecordC*));
+		void rank_sort_ids(const std::vector<const DNSRecordC*> &idRecords,
+								bool (*pfnLess)(const DNSRecordC*, const DNSRecordC*), std::vector<uint32_t> &ranks);
+
 		void do_rraddr_sorting(DNSRecordC *record);
 		void do_record_sorting(void);
+		void do_ranked_sorting(size_t n);
 		void do_time_differential(DNSRecordC *r);
 		
+		char* print_record_loc(char *s, const DNSRecordC *r, const DNSRecordC *pr);
+		void output_hidden_pairs(void);
 		void output_record_locs(void);
 		void output_rraddr_locs(void);
+		char* print_record(char *s, const DNSRecordC *r, const DNSRecordC *pr);
 		void output(void);
+		void finish_chunk(bool bTerminate);
+		void adapt_chunk_lines(void);
+
+		/* external sorting */
+		void write_spill(std::string &b);
+		void spill_run(void);
+		bool read_run(DNSRunC *run);
+		void open_runs(void);
+		const DNSRecordC* next_run_record(void);
+		void output_runs(void);
 
 	public:
-		DNSLogzipC(void);
+		DNSLogzipC(const DNSLogzipCtx &ctx);
 		~DNSLogzipC(void);
 		
-		void Process(dlz_row_t *row);		
+		int Process(dlz_row_t *row);
+		int ProcessRecord(const dlz_record_t *rec, const dlz_view_t *cnames,
+							const struct sockaddr_storage *addr4s,
+							const struct sockaddr_storage *addr6s);
 		void Finish(void);
+		void Flush(void);
+		void GetStats(dlz_stats_t *stats) const { *stats = this->stats; }
 };
 
+template <unsigned int Mask>
 class DNSLogzipD : public DNSLogzip {
 	private:
 		DNSRecordD **records;
 		DNSRecordD *recordElems;
-		std::string addrLocs[65536];
+		/* At most one per A and one per AAAA RRSet of the chunk. */
+		std::vector<std::string> addrLocs;
 		size_t addrLocsLen;
+
+		/*
+			With ENABLE_SORTED_RRSETS, the sets in order before the next
+			rraddr locations, and where the locations start in its column.
+			nSortedRRSets is -1 before the column is read.
+		*/
+		int64_t nSortedRRSets;
+		size_t uAddrLocPos;
 		
+		size_t recordLocsLen;
+		/* Record locations with ENABLE_LOC_DELTA, read once the records are. */
+		std::string sRecordLocs;
+
+		/* The (qtype, rcode) pairs of the chunk header with ENABLE_LEARNED_HIDING. */
+		std::string sHiddenQtypes[MAX_HIDDEN_PAIRS];
+		std::string sHiddenRcodes[MAX_HIDDEN_PAIRS];
+		size_t uHiddenPairsLen;
+
+		/* The RRSets of the chunk written in full with ENABLE_RRSET_REFS. */
+		std::vector<const DNSRRSet *> refRRSets;
+
+		bool bReadChunkLinesDone;
+		bool bReadHiddenPairsDone;
 		bool bReadRecordLocDone;
 		bool bReadAddrLocDone;
 
+		/* Number of records of the chunk kept in record mode. */
+		size_t uReadyLines;
+
 		char* print_sockaddr(char *s, const std::string &text);
 		char* print_server_addr(char *s, const std::string &text);
 		char* print_cnames(char *s, const StrDNSRRSet &rrset);
 		char* print_rraddrs(char *s, const AddrDNSRRSet &rrset);
 		
 		void output(void);
+		void parse_chunk_lines(const dlz_row_t *row);
+		void parse_hidden_pairs(const dlz_row_t *row);
 		void parse_record_locs(const dlz_row_t *row);
 		void parse_rraddr_locs(const dlz_row_t *row);
 		void parse(dlz_row_t *row, DNSRecordD *record);
 
 		void restore_hidden_fields(dlz_row_t *row, DNSRecordD *r, int &k);
+		void restore_record_locs(void);
+		void restore_records(void);
+		void restore_sockaddr(const std::string &text, struct sockaddr_storage *addr);
+		void restore_addr_delta(const dlz_str_t &col, const std::string &ref, std::string &text);
+		uint64_t restore_num(const std::string &text);
 		void restore_rraddrs(void);
-		void restore_addr_locs(AddrDNSRRSet &rrset, size_t &locID);		
+		bool restore_addr_locs(AddrDNSRRSet &rrset, size_t &locID);
 		void restore_addr_vals(AddrDNSRRSet &rrset, unsigned short family);
 
 	public:
-		DNSLogzipD(void);
+		DNSLogzipD(const DNSLogzipCtx &ctx);
 		~DNSLogzipD(void);
-		void Process(dlz_row_t *row);	
+		int Process(dlz_row_t *row);
 		void Finish(void);
+
+		size_t ReadyRecords(void);
+		void GetRecord(size_t i, dlz_record_t *rec);
+		void ReleaseRecords(void);
 };
 
+/*
+	Create an encoder (or a decoder) specialized for the function mask of ctx.
+	The dispatch happens once; unknown masks get the generic instantiation.
+*/
+DNSLogzip *CreateDNSLogzip(bool bDecompression, const DNSLogzipCtx &ctx);
+
 #endif
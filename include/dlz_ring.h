@@ -0,0 +1,205 @@
+#ifndef __DLZ_RING_H_
+#define __DLZ_RING_H_
+
+/*
+	Single-producer/single-consumer ring of log lines in POSIX shared memory.
+
+	The producer creates the ring with dlz_ring_create() and appends whole
+	lines with dlz_ring_write(). DNSLogzip --shm <name> attaches to it with
+	dlz_ring_attach() and encodes the lines in place, without copying them.
+	The data area is mapped twice in a row, so a line wrapping around the
+	end of the ring is contiguous in memory.
+
+	head and tail only grow, their position in the ring is taken modulo its
+	size. The producer publishes head after writing the lines, the consumer
+	publishes tail after encoding them.
+
+	This header only depends on libc, producers do not link libdnslogzip.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DLZ_RING_MAGIC      0x444c5a52
+#define DLZ_RING_HDR_SIZE   4096
+#define DLZ_RING_CACHELINE  64
+
+typedef struct {
+	uint32_t magic;
+	/* Set by the producer once it has written its last line. */
+	uint32_t closed;
+	uint64_t size;
+	char     pad0[DLZ_RING_CACHELINE - 16];
+
+	/* Written by the producer only. */
+	uint64_t head;
+	char     pad1[DLZ_RING_CACHELINE - 8];
+
+	/* Written by the consumer only. */
+	uint64_t tail;
+} dlz_ring_hdr_t;
+
+typedef struct {
+	dlz_ring_hdr_t *hdr;
+	char           *data;
+	uint64_t        size;
+	/* Own position, and last known position of the other side. */
+	uint64_t        pos;
+	uint64_t        peer;
+} dlz_ring_t;
+
+/*
+	Map the header and the data area, then the data area again.
+*/
+static inline int dlz_ring_map(dlz_ring_t *r, int fd, uint64_t size)
+{
+	char *base;
+
+	base = (char *) mmap(NULL, DLZ_RING_HDR_SIZE + 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == base) {
+		return -1;
+	}
+
+	if (MAP_FAILED == mmap(base, DLZ_RING_HDR_SIZE + size, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_FIXED, fd, 0)
+			|| MAP_FAILED == mmap(base + DLZ_RING_HDR_SIZE + size, size, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_FIXED, fd, DLZ_RING_HDR_SIZE)) {
+		munmap(base, DLZ_RING_HDR_SIZE + 2 * size);
+		return -1;
+	}
+
+	r->hdr  = (dlz_ring_hdr_t *) base;
+	r->data = base + DLZ_RING_HDR_SIZE;
+	r->size = size;
+
+	return 0;
+}
+
+/*
+	Producer side. size must be a power of 2 and a multiple of the page
+	size. A ring left over by an earlier run is replaced.
+*/
+static inline int dlz_ring_create(dlz_ring_t *r, const char *name, uint64_t size)
+{
+	int fd, rc;
+
+	memset(r, 0, sizeof(*r));
+
+	if (0 == size || (size & (size - 1)) || size % sysconf(_SC_PAGESIZE)) {
+		return -1;
+	}
+
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+
+	rc = ftruncate(fd, DLZ_RING_HDR_SIZE + size);
+	if (0 == rc) {
+		rc = dlz_ring_map(r, fd, size);
+	}
+	close(fd);
+
+	if (rc < 0) {
+		shm_unlink(name);
+		return -1;
+	}
+
+	r->hdr->size = size;
+	r->hdr->head = 0;
+	r->hdr->tail = 0;
+	r->hdr->closed = 0;
+	r->pos = 0;
+	r->peer = 0;
+
+	/* The ring is ready once the consumer sees the magic. */
+	__atomic_store_n(&r->hdr->magic, DLZ_RING_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+	Append one or more complete lines, each ending with LF.
+	Return 0, -1 if the ring has no room for them yet, or -2 if len is
+	larger than the ring: such a write never fits, do not retry it.
+*/
+static inline int dlz_ring_write(dlz_ring_t *r, const char *lines, size_t len)
+{
+	if (len > r->size) {
+		return -2;
+	}
+
+	if (r->pos + len - r->peer > r->size) {
+		r->peer = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+
+		if (r->pos + len - r->peer > r->size) {
+			return -1;
+		}
+	}
+
+	memcpy(r->data + (r->pos & (r->size - 1)), lines, len);
+	r->pos += len;
+
+	__atomic_store_n(&r->hdr->head, r->pos, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+	Producer side: no more lines will be written.
+*/
+static inline void dlz_ring_close(dlz_ring_t *r)
+{
+	__atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+	munmap(r->hdr, DLZ_RING_HDR_SIZE + 2 * r->size);
+}
+
+/*
+	Consumer side. Return -1 if the ring does not exist or is not ready yet.
+*/
+static inline int dlz_ring_attach(dlz_ring_t *r, const char *name)
+{
+	dlz_ring_hdr_t *hdr;
+	struct stat st;
+	int fd, rc = -1;
+
+	memset(r, 0, sizeof(*r));
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (0 == fstat(fd, &st) && st.st_size > DLZ_RING_HDR_SIZE) {
+		hdr = (dlz_ring_hdr_t *) mmap(NULL, DLZ_RING_HDR_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (MAP_FAILED != hdr) {
+			if (DLZ_RING_MAGIC == __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE)
+					&& hdr->size == (uint64_t) st.st_size - DLZ_RING_HDR_SIZE) {
+				rc = dlz_ring_map(r, fd, hdr->size);
+			}
+			munmap(hdr, DLZ_RING_HDR_SIZE);
+		}
+	}
+	close(fd);
+
+	if (0 == rc) {
+		r->pos = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+		r->peer = r->pos;
+	}
+
+	return rc;
+}
+
+static inline void dlz_ring_detach(dlz_ring_t *r)
+{
+	munmap(r->hdr, DLZ_RING_HDR_SIZE + 2 * r->size);
+}
+
+#endif
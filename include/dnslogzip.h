@@ -0,0 +1,210 @@
+#ifndef __DNSLOGZIP_H_
+#define __DNSLOGZIP_H_
+
+/*
+	libdnslogzip: in-memory encoding and decoding of DNS logs.
+
+	Raw log lines (or arbitrary pieces of a log stream) are pushed into an
+	encoder with dlz_codec_feed(). Whenever a chunk is complete, its encoded
+	text is passed to the chunk handler. A decoder works the same way on the
+	encoded text and hands back the original log lines chunk by chunk.
+
+	A codec is not thread safe, but independent codecs share no state and
+	can be used from different threads.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dlz_codec_s dlz_codec_t;
+
+/*
+	Called once per chunk, or several times with consecutive pieces of a
+	chunk whose runs are spilled (see run_lines). The data is only valid
+	during the call.
+*/
+typedef void (*dlz_chunk_handler_pt)(const char *data, size_t len, void *arg);
+
+typedef struct {
+	/* Function mask, see the -M option. */
+	unsigned int  func_mask;
+	/* Number of log lines per chunk, see the -L option. */
+	unsigned int  chunk_lines;
+	/* Base number for encoding numeric fields, see the -E option. */
+	unsigned char base_num;
+	/* Encoders flush a chunk once its raw lines reach this size, 0 for no limit. */
+	size_t        max_chunk_bytes;
+	/*
+		Digits of the fractional seconds of the time column, 0 to 9.
+		Every line must have exactly this many, e.g. 1700000000.123 for 3.
+	*/
+	unsigned char time_precision;
+	/*
+		Encoders hold only this many lines of a larger chunk in memory: the
+		chunk is sorted in runs spilled to an unlinked file in spill_dir
+		(TMPDIR or /tmp if NULL), which are merged when it is output.
+		0 keeps the whole chunk in memory, otherwise at least 32.
+	*/
+	unsigned int  run_lines;
+	const char   *spill_dir;
+	/*
+		Adaptive chunks: encoders pick the size of every chunk between
+		adaptive_min_lines and chunk_lines from the compression and the
+		time of the last ones, and write it at the start of the chunk.
+		Decoders need the same setting. 0 for fixed chunks.
+	*/
+	unsigned int  adaptive_min_lines;
+	/* Target time from the first line of an adaptive chunk to its output, 0 for none. */
+	unsigned int  chunk_latency_ms;
+} dlz_options_t;
+
+/* Fill opts with the default settings. */
+void dlz_options_init(dlz_options_t *opts);
+
+/*
+	Set chunk_lines to the largest chunk an encoder or a decoder holds in
+	about budget bytes. Larger chunks compress better. Return -1 if the
+	budget is too small for a useful chunk.
+*/
+int dlz_options_set_mem_budget(dlz_options_t *opts, size_t budget);
+
+/*
+	Return NULL with errno set to EINVAL if the options are invalid, or to
+	ENOMEM if the memory of the chunk cannot be allocated. opts may be NULL.
+*/
+dlz_codec_t *dlz_encoder_create(const dlz_options_t *opts, dlz_chunk_handler_pt handler, void *arg);
+dlz_codec_t *dlz_decoder_create(const dlz_options_t *opts, dlz_chunk_handler_pt handler, void *arg);
+
+/*
+	Push a piece of the input stream. Lines may span several calls.
+	The data is not modified and is not referenced after the call returns.
+
+	An encoder checks every line (or record): the number of columns, the
+	time, the addresses, the numbers and the answer RRSets. A malformed one
+	is skipped and counted in dlz_stats_t.bad_lines, the others are
+	encoded as usual. The feed/finish functions return 0 if every line they
+	processed was encoded, and -1 if one was skipped or the memory ran out.
+
+	A decoder expects the output of an encoder with the same options and
+	does not check it: a corrupt input aborts on an assertion.
+*/
+int dlz_codec_feed(dlz_codec_t *codec, const char *data, size_t len);
+
+/* Push one complete line, without the LF. */
+int dlz_codec_feed_line(dlz_codec_t *codec, const char *line, size_t len);
+
+/* Process a pending incomplete line and flush the current chunk. */
+int dlz_codec_finish(dlz_codec_t *codec);
+
+/*
+	Drop a pending incomplete line, e.g. one cut by a producer that went
+	away, so that dlz_codec_finish() does not process it. Return its length.
+*/
+size_t dlz_codec_discard(dlz_codec_t *codec);
+
+/*
+	Output the current chunk of an encoder before it is full, e.g. when
+	its lines have waited too long. An incomplete line stays pending.
+*/
+int dlz_codec_flush(dlz_codec_t *codec);
+
+/* Number of complete lines in the current chunk. */
+size_t dlz_codec_pending(const dlz_codec_t *codec);
+
+/*
+	Lookups and hits of the parse caches of an encoder since its creation:
+	the client and server addresses and the answer sections of the lines
+	fed as text, 0 for a decoder.
+*/
+typedef struct {
+	uint64_t addr_lookups;
+	uint64_t addr_hits;
+	uint64_t answer_lookups;
+	uint64_t answer_hits;
+	/* Malformed lines and records skipped since the creation. */
+	uint64_t bad_lines;
+} dlz_stats_t;
+
+void dlz_codec_stats(const dlz_codec_t *codec, dlz_stats_t *stats);
+
+void dlz_codec_destroy(dlz_codec_t *codec);
+
+/*
+	Pull-based access to decoded records, without text formatting.
+
+	A reader decodes the encoded text read from fd one chunk at a time and
+	yields its records in the original order. All the views of a record
+	(qname, cnames, addresses) point into the decoded chunk and stay valid
+	until the reader moves on to the next chunk.
+*/
+typedef struct dlz_reader_s dlz_reader_t;
+
+typedef struct {
+	const char *data;
+	size_t      len;
+} dlz_view_t;
+
+typedef struct {
+	/* Seconds, and nanoseconds down to the time precision. */
+	int64_t  time;
+	uint32_t nsec;
+
+	struct sockaddr_storage client;
+	struct sockaddr_storage server;
+
+	uint16_t qtype;
+	uint8_t  rcode;
+
+	dlz_view_t qname;
+
+	/* Sizes of the answer RRSets, see the accessors below. */
+	uint8_t  ncnames;
+	uint8_t  naddr4s;
+	uint8_t  naddr6s;
+
+	const void *priv;
+} dlz_record_t;
+
+/*
+	Push a record parsed by the caller, e.g. from a packet capture, to an
+	encoder. cnames, addr4s and addr6s hold the rec->ncnames, rec->naddr4s
+	and rec->naddr6s answers, rec->priv is not used. Return -1 and skip the
+	record if it has more than 82 answers of a kind, or an address that is
+	not of its family.
+*/
+int dlz_codec_feed_record(dlz_codec_t *codec, const dlz_record_t *rec, const dlz_view_t *cnames,
+							const struct sockaddr_storage *addr4s, const struct sockaddr_storage *addr6s);
+
+/* Return NULL as dlz_encoder_create() does. */
+dlz_reader_t *dlz_reader_create(const dlz_options_t *opts, int fd);
+
+/*
+	Return 1 if a record was read, 0 at the end of the input, -1 on a read
+	error, a malformed line or when the memory runs out.
+*/
+int dlz_reader_next(dlz_reader_t *reader, dlz_record_t *rec);
+
+/*
+	Read up to n records, all from the same chunk.
+	Return the number of records read, 0 at the end of the input, -1 on a
+	read error, a malformed line or when the memory runs out.
+*/
+ssize_t dlz_reader_next_batch(dlz_reader_t *reader, dlz_record_t *recs, size_t n);
+
+void dlz_reader_destroy(dlz_reader_t *reader);
+
+dlz_view_t dlz_record_cname(const dlz_record_t *rec, unsigned i);
+const struct sockaddr_storage *dlz_record_addr4(const dlz_record_t *rec, unsigned i);
+const struct sockaddr_storage *dlz_record_addr6(const dlz_record_t *rec, unsigned i);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -47,6 +47,7 @@ typedef struct {
 } dlz_row_t;
 
 int dlz_read_line(dlz_row_t *row, dlz_buf_t *b);
+int dlz_split_line(dlz_row_t *row, char *start, char *last);
 
 char *
 dlz_inet6_ntop(u_char *p, char *text, size_t len);
@@ -133,7 +134,7 @@ dlz_inet_ntop(int family, void *addr, char *text, size_t len)
 }
 
 
-static inline int
+static inline int64_t
 dlz_atoi(const char *line, size_t n)
 {
 	long int  value, cutoff, cutlim;
@@ -160,7 +161,7 @@ dlz_atoi(const char *line, size_t n)
 	return value;
 }
 
-static inline int
+static inline int64_t
 dlz_atoi(const dlz_str_t &s)
 {
 	return dlz_atoi(s.data, s.len);
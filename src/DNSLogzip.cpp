@@ -6,6 +6,10 @@
 #include <algorithm>
 #include <cstring>
 #include <cmath>
+#include <cerrno>
+#include <cstdlib>
+
+#include <time.h>
 
 #include <util.h>
 #include <DNSLogzip.hpp>
@@ -14,49 +18,6 @@
 #define HEADER_END_INDICATOR_LF "\n-end-\n"
 
 
-/***************Simple memory pool***************/
-
-#define POOL_SIZE 30000 * 7
-
-static struct RRAddr *pool_addrRRs[POOL_SIZE];
-static struct RRAddr  pool_addrRRElems[POOL_SIZE];
-static size_t pool_iAddrRR = 0;
-
-static std::string   *pool_strRRs[POOL_SIZE];
-static std::string    pool_strRRElems[POOL_SIZE];
-static size_t pool_iStrRR = 0;
-
-inline void PoolInit() {
-	for (unsigned i = 0; i < POOL_SIZE; ++i) {
-		pool_addrRRs[i] = &pool_addrRRElems[i];
-		pool_strRRs[i]= &pool_strRRElems[i];
-	}
-}
-
-inline void PoolReset() {
-	pool_iAddrRR = 0;
-	pool_iStrRR   = 0;
-
-	PoolInit();
-}
-
-inline struct RRAddr **PoolGetNAddrRR(size_t n) {
-	assert(n < 128);
-	assert(pool_iAddrRR + n < POOL_SIZE);
-	pool_iAddrRR += n;
-	return pool_addrRRs + pool_iAddrRR - n;
-}
-
-inline std::string **PoolGetNStrRR(size_t n) {
-	assert(n < 128);
-	assert(pool_iStrRR + n < POOL_SIZE);
-	pool_iStrRR += n;
-	return pool_strRRs + pool_iStrRR - n;
-}
-
-/************************************************/
-
-
 static inline bool CompareRRAddr(const struct RRAddr* lhs, const struct RRAddr* rhs)
 {
 	assert(lhs->addr.ss_family == rhs->addr.ss_family);
@@ -71,28 +32,40 @@ static inline bool CompareRRAddr(const struct RRAddr* lhs, const struct RRAddr*
 	}
 }
 
-/*
-	Return true if first less than second.
-*/
-static inline bool CompareDNSRecord(const DNSRecordC* first, const DNSRecordC* second)
+/* Compare qnames in reverse order, so that the names of a domain are together. */
+static inline int CompareQname(const std::string &first, const std::string &second)
 {
 	int v;
 
-	assert(first->sQname.size() > 0 && second->sQname.size() > 0);
-	/* Compare qnames in reverse order */
-	for (int i = first->sQname.size() - 1, j = second->sQname.size() - 1; 
+	assert(first.size() > 0 && second.size() > 0);
+	for (int i = first.size() - 1, j = second.size() - 1; 
 			i >= 0 && j >= 0; --i, --j) {
 
-		v = first->sQname[i] - second->sQname[j];
+		v = first[i] - second[j];
 		if (0 != v) 
-			return v < 0 ? true : false;
+			return v;
 	}
 
-	v = first->sQname.size() - second->sQname.size();
+	return first.size() - second.size();
+}
+
+/*
+	Return true if first less than second. Records with the same key keep
+	the order of their lines, see ENABLE_LOC_DELTA.
+*/
+static inline bool CompareDNSRecord(const DNSRecordC* first, const DNSRecordC* second)
+{
+	int v;
+
+	v = CompareQname(first->sQname, second->sQname);
 	if (0 == v) {
 		/* The exactly same qname. */
 		v = first->nQtype - second->nQtype;
 		if (0 == v) {
+			if (first->saddr == second->saddr) {
+				return first->nID < second->nID;
+			}
+
 			return first->saddr < second ->saddr;
 		}
 		else {
@@ -106,6 +79,167 @@ static inline bool CompareDNSRecord(const DNSRecordC* first, const DNSRecordC* s
 	assert(0);
 }
 
+/*
+	Heap order of the runs of a chunk: the run with the first record
+	(in the order of the output) is on top.
+*/
+static inline bool CompareRunByRecord(const DNSRunC* a, const DNSRunC* b)
+{
+	return CompareDNSRecord(&b->records[b->iCur], &a->records[a->iCur]);
+}
+
+static inline bool CompareRunByID(const DNSRunC* a, const DNSRunC* b)
+{
+	return a->records[a->iCur].nID > b->records[b->iCur].nID;
+}
+
+/*
+	Records of the spilled runs are stored in host byte order, the
+	addresses as their family and raw bytes.
+*/
+template <typename T>
+static inline void SpillNum(std::string &b, T n)
+{
+	b.append((const char *) &n, sizeof(n));
+}
+
+template <typename T>
+static inline const char* UnspillNum(const char *p, T *n)
+{
+	memcpy(n, p, sizeof(*n));
+	return p + sizeof(*n);
+}
+
+static inline void SpillStr(std::string &b, const std::string &str)
+{
+	assert(str.size() <= UINT16_MAX);
+	SpillNum<uint16_t>(b, str.size());
+	b.append(str);
+}
+
+static inline const char* UnspillStr(const char *p, std::string *str)
+{
+	uint16_t len;
+
+	p = UnspillNum(p, &len);
+	str->assign(p, len);
+
+	return p + len;
+}
+
+static inline void SpillAddr(std::string &b, const struct sockaddr_storage &addr)
+{
+	SpillNum<uint8_t>(b, addr.ss_family);
+
+	if (AF_INET == addr.ss_family) {
+		b.append((const char *) &((struct sockaddr_in const *)&addr)->sin_addr, sizeof(struct in_addr));
+	}
+	else if (AF_INET6 == addr.ss_family) {
+		b.append((const char *) &((struct sockaddr_in6 const *)&addr)->sin6_addr, sizeof(struct in6_addr));
+	}
+}
+
+static inline const char* UnspillAddr(const char *p, struct sockaddr_storage *addr)
+{
+	uint8_t family;
+
+	p = UnspillNum(p, &family);
+	memset(addr, 0, sizeof(*addr));
+	addr->ss_family = family;
+
+	if (AF_INET == family) {
+		memcpy(&((struct sockaddr_in *)addr)->sin_addr, p, sizeof(struct in_addr));
+		p += sizeof(struct in_addr);
+	}
+	else if (AF_INET6 == family) {
+		memcpy(&((struct sockaddr_in6 *)addr)->sin6_addr, p, sizeof(struct in6_addr));
+		p += sizeof(struct in6_addr);
+	}
+
+	return p;
+}
+
+static inline void SpillRRAddrs(std::string &b, const AddrDNSRRSet &rrset)
+{
+	SpillNum<uint8_t>(b, rrset.type);
+	SpillNum<uint8_t>(b, rrset.size);
+
+	for (uint8_t i = 0; i < rrset.size; ++i) {
+		SpillNum<uint8_t>(b, rrset.rrs[i]->uloc);
+		SpillAddr(b, rrset.rrs[i]->addr);
+	}
+}
+
+static inline const char* UnspillRRAddrs(const char *p, AddrDNSRRSet &rrset, RRPool &pool)
+{
+	p = UnspillNum(p, &rrset.type);
+	p = UnspillNum(p, &rrset.size);
+	rrset.rrs = pool.GetNAddrRR(rrset.size);
+
+	for (uint8_t i = 0; i < rrset.size; ++i) {
+		p = UnspillNum(p, &rrset.rrs[i]->uloc);
+		p = UnspillAddr(p, &rrset.rrs[i]->addr);
+	}
+
+	return p;
+}
+
+/*
+	Append a record to b, after its length.
+*/
+static void SpillRecord(std::string &b, const DNSRecordC *r)
+{
+	size_t uStart = b.size();
+
+	SpillNum<uint32_t>(b, 0);
+	SpillNum<int32_t>(b, r->nID);
+	SpillNum(b, r->nTime);
+	SpillNum(b, r->nTimeDiff);
+	SpillAddr(b, r->caddr);
+	SpillAddr(b, r->saddr);
+	SpillNum(b, r->nQtype);
+	SpillNum(b, r->nRcode);
+	SpillStr(b, r->sQname);
+
+	SpillNum<uint8_t>(b, r->cnameRRSet.type);
+	SpillNum<uint8_t>(b, r->cnameRRSet.size);
+	for (uint8_t i = 0; i < r->cnameRRSet.size; ++i) {
+		SpillStr(b, *r->cnameRRSet.rrs[i]);
+	}
+
+	SpillRRAddrs(b, r->addr4RRSet);
+	SpillRRAddrs(b, r->addr6RRSet);
+
+	*(uint32_t *) &b[uStart] = b.size() - uStart - sizeof(uint32_t);
+}
+
+static void UnspillRecord(const char *p, DNSRecordC *r, RRPool &pool)
+{
+	int32_t nID;
+
+	pool.Reset();
+
+	p = UnspillNum(p, &nID);
+	r->nID = nID;
+	p = UnspillNum(p, &r->nTime);
+	p = UnspillNum(p, &r->nTimeDiff);
+	p = UnspillAddr(p, &r->caddr);
+	p = UnspillAddr(p, &r->saddr);
+	p = UnspillNum(p, &r->nQtype);
+	p = UnspillNum(p, &r->nRcode);
+	p = UnspillStr(p, &r->sQname);
+
+	p = UnspillNum(p, &r->cnameRRSet.type);
+	p = UnspillNum(p, &r->cnameRRSet.size);
+	r->cnameRRSet.rrs = pool.GetNStrRR(r->cnameRRSet.size);
+	for (uint8_t i = 0; i < r->cnameRRSet.size; ++i) {
+		p = UnspillStr(p, r->cnameRRSet.rrs[i]);
+	}
+
+	p = UnspillRRAddrs(p, r->addr4RRSet, pool);
+	p = UnspillRRAddrs(p, r->addr6RRSet, pool);
+}
+
 static inline int ConvertTextToAddr(const char *text, size_t len, struct sockaddr_storage *addr, int family)
 {
 	int rc;
@@ -140,17 +274,16 @@ static inline void ConvertTextToAddr(const std::string& text, struct sockaddr_st
 	assert(1 == rc);
 }
 
-static inline void ConvertTextToAddr(dlz_str_t *col, struct sockaddr_storage *addr)
+/* Raw log columns are not trusted: return false if col is not an address. */
+static inline bool ConvertTextToAddr(const dlz_str_t *col, struct sockaddr_storage *addr)
 {
-	col->data[col->len] = '\0';
-
 	int rc = ConvertTextToAddr(col->data, col->len, addr, AF_INET);
 
 	if (0 == rc) {
 		rc = ConvertTextToAddr(col->data, col->len, addr, AF_INET6);
 	}
 
-	assert(1 == rc);
+	return 1 == rc;
 }
 
 static inline char* ConvertAddrToText(const struct sockaddr_storage *addr, char *s, size_t size, int family) 
@@ -165,16 +298,17 @@ static inline char* ConvertAddrToText(const struct sockaddr_storage *addr, char
 	}
 }
 
-static inline char* ConvertBaseNumToText(uint64_t n, char *s, size_t size)
+static inline char* ConvertBaseNumToText(uint64_t n, char *s, size_t size, const DNSLogzipCtx &ctx)
 {
 	size_t j = 0, i = 0;
+	const unsigned char base = ctx.ucBaseNum;
 
-	assert(n >= 0 && g_ucBaseNum > 0 && g_ucBaseNum < 10 + 26 + 26);
+	assert(n >= 0 && base > 0 && base < 10 + 26 + 26);
 
 	if (n == 0) s[i++] = '0';
 	
 	while (n > 0) {
-		j = n % g_ucBaseNum;
+		j = n % base;
 		if (j < 10) {
 			s[i]= j + '0';
 		}
@@ -185,7 +319,7 @@ static inline char* ConvertBaseNumToText(uint64_t n, char *s, size_t size)
 			s[i]= j + 'A' - (10 + 26);
 		}
 
-		n = n / g_ucBaseNum;
+		n = n / base;
 		i++;
 
 		assert(i != size);
@@ -197,22 +331,14 @@ static inline char* ConvertBaseNumToText(uint64_t n, char *s, size_t size)
 	return s + i;
 }
 
-static inline uint64_t ConvertTextToBaseNum(const char *s, size_t size)
+static inline uint64_t ConvertTextToBaseNum(const char *s, size_t size, const DNSLogzipCtx &ctx)
 {
-	static uint64_t muls[20];
+	const uint64_t *muls = ctx.muls;
 	uint64_t rc  = 0, val = 0;
 
-	assert(g_ucBaseNum > 0 && g_ucBaseNum < 10 + 26 + 26);
+	assert(ctx.ucBaseNum > 0 && ctx.ucBaseNum < 10 + 26 + 26);
 	assert(size > 0 && NULL != s);
 	
-	if (0 == muls[0]) {
-		muls[0] = 1;
-		
-		for (size_t i = 1; i < sizeof(muls) / sizeof(muls[0]); ++i) {
-			muls[i] = muls[i - 1] * g_ucBaseNum;
-		}
-	}
-	
 	for (int j = size - 1; j >= 0; j--) {
 		if (s[j] >= '0' && s[j] <= '9') {
 			val = s[j] - '0';
@@ -231,245 +357,767 @@ static inline uint64_t ConvertTextToBaseNum(const char *s, size_t size)
 	return rc;
 }
 
-static inline uint64_t ConvertTextToBaseNum(const std::string &text)
-{
-	return ConvertTextToBaseNum(text.c_str(), text.size());
-}
+/*
+	Self-delimiting numbers: little-endian base 32 digits, the last one
+	from '0'-'9' and 'a'-'v', the others from VAR_TEXT_MORE_DIGITS.
+*/
+#define MAX_VAR_TEXT_LEN		16
+/* Longest text of a field that is not a name, e.g. an IPv6 address. */
+#define MAX_FIELD_TEXT_LEN		64
+#define VAR_TEXT_MORE_DIGITS	"wxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
 
-static inline uint64_t ConvertTextToBaseNum(const dlz_str_t &col)
+static inline char* ConvertNumToVarText(uint64_t n, char *s)
 {
-	return ConvertTextToBaseNum(col.data, col.len);
-}
-
-DNSLogzipC::DNSLogzipC(void) : DNSLogzip() {
-	PoolInit();
+	static const char *sLastDigits = "0123456789abcdefghijklmnopqrstuv";
 
-	this->records = new DNSRecordC* [g_uLineSortingBufSize];
-	DNSRecordC *p = new DNSRecordC  [g_uLineSortingBufSize];
-	
-	for (unsigned i = 0; i < g_uLineSortingBufSize; ++i) {
-		this->records[i] = p++; 
+	while (n >= 32) {
+		*s++ = VAR_TEXT_MORE_DIGITS[n & 0x1f];
+		n >>= 5;
 	}
 
-	this->recordElems = p;
-	
-	return;
+	*s++ = sLastDigits[n];
+	return s;
 }
 
-DNSLogzipC::~DNSLogzipC() {
-	delete[] this->records;
-	delete[] this->recordElems;
-}
+static inline uint64_t ConvertVarTextToNum(const char **p, const char *e)
+{
+	const char *d;
+	uint64_t n = 0;
+	int shift = 0;
 
-/*
-	Parse resource record addresses from raw log file. So don't use BASENum here.
-*/
-void DNSLogzipC::parse_rraddrs(dlz_str_t* cols, AddrDNSRRSet &rrset, uint8_t &i, uint8_t type) {
-	rrset.type = type;
-	rrset.size = dlz_atoi(cols[i]);
-	assert(rrset.size <= MAX_ALLOWED_RRSET_SIZE && DLZ_ERROR != rrset.size);
+	for ( ; *p < e; ++*p, shift += 5) {
+		d = (const char *) memchr(VAR_TEXT_MORE_DIGITS, **p, sizeof(VAR_TEXT_MORE_DIGITS) - 1);
+		if (NULL == d) {
+			break;
+		}
 
-	rrset.rrs = PoolGetNAddrRR(rrset.size);
-	/* Go to next column (field). */
-	++i;
-	
-	for (int j = 0; j < rrset.size; ++j) {
-		ConvertTextToAddr(&cols[i + j], &rrset.rrs[j]->addr);
-		rrset.rrs[j]->uloc = j;
+		n |= (uint64_t) (d - VAR_TEXT_MORE_DIGITS) << shift;
 	}
 
-	/* Go to next field. */
-	i += rrset.size;
+	assert(*p < e);
+	n |= (uint64_t) (**p <= '9' ? **p - '0' : **p - 'a' + 10) << shift;
+	++*p;
+
+	return n;
 }
 
 /*
-	Parse log lines.
+	IPv6 prefix sharing: ADDR_DELTA_FLAG_CHAR, the number of leading nibbles
+	shared with a reference address in var text, then the other nibbles in
+	hex without the leading zeros.
 */
-void DNSLogzipC::parse(dlz_row_t *row, DNSRecordC *record) {
-	int ndata;
-	uint8_t i;
-
-	record->nID = this->uLineID;
-	assert(row->ncols >= 6);
+#define IPV6_NIBBLES	32
 
-	record->nTimeSec = dlz_atoi(row->cols[0]);
-	assert(DLZ_ERROR != record->nTimeSec);	
-
-	/* Client IP */
-	ConvertTextToAddr(&row->cols[1], &record->caddr);
-
-	/* Resolver IP */
-	ConvertTextToAddr(&row->cols[2], &record->saddr);
+static inline int GetAddr6Nibble(const struct in6_addr &a, int i)
+{
+	return i & 1 ? a.s6_addr[i >> 1] & 0x0f : a.s6_addr[i >> 1] >> 4;
+}
 
-	record->nQtype = dlz_atoi(row->cols[3]);
-	assert(DLZ_ERROR != record->nQtype);
+static inline char* ConvertAddr6ToPrefixText(const struct in6_addr &a, const struct in6_addr &ref, char *s)
+{
+	static const char *sHexDigits = "0123456789abcdef";
+	int i, n;
 
-	assert(row->cols[4].len <= 2);
-	record->nRcode = dlz_atoi(row->cols[4]);
-	assert(DLZ_ERROR != record->nRcode);
+	for (n = 0; n < IPV6_NIBBLES && GetAddr6Nibble(a, n) == GetAddr6Nibble(ref, n); ++n);
 
-	/* Domain name */
-	record->sQname.assign(row->cols[5].data, row->cols[5].len);
+	*s++ = ADDR_DELTA_FLAG_CHAR;
+	s = ConvertNumToVarText(n, s);
 
-	if (6 == row->ncols) {
-		/* No answers. */
-		return;
+	for (i = n; i < IPV6_NIBBLES - 1 && 0 == GetAddr6Nibble(a, i); ++i);
+	for ( ; i < IPV6_NIBBLES; ++i) {
+		*s++ = sHexDigits[GetAddr6Nibble(a, i)];
 	}
 
-	i = 6;
-	assert(row->ncols >= i + 3);
-	do {
-		ndata =  dlz_atoi(row->cols[i]);
-		assert(ndata > 0 && ndata < 47);
-		/* Go to next field. */
-		++i;
+	return s;
+}
 
-		if (DNS_TYPE_A == ndata) {
-			parse_rraddrs(row->cols, record->addr4RRSet, i, ndata);
-			//record->rrsets.push_back(&record->addr4RRSet);
+static inline void ConvertPrefixTextToAddr6(const char *p, size_t len, const struct in6_addr &ref, struct in6_addr *a)
+{
+	const char *e = p + len;
+	uint64_t n;
+	int i, d;
+
+	assert(len > 1 && ADDR_DELTA_FLAG_CHAR == *p);
+	++p;
+	n = ConvertVarTextToNum(&p, e);
+	assert(n <= IPV6_NIBBLES && (size_t) (e - p) <= IPV6_NIBBLES - n);
+
+	memset(a->s6_addr, 0, sizeof(a->s6_addr));
+	for (i = 0; i < IPV6_NIBBLES; ++i) {
+		if ((uint64_t) i < n) {
+			d = GetAddr6Nibble(ref, i);
 		}
-		else if (DNS_TYPE_AAAA == ndata) {
-			assert(DNS_TYPE_AAAA == ndata);
-			parse_rraddrs(row->cols, record->addr6RRSet, i, ndata);
-			//record->rrsets.push_back(&record->addr6RRSet);
+		else if (i >= IPV6_NIBBLES - (e - p)) {
+			d = *p <= '9' ? *p - '0' : *p - 'a' + 10;
+			++p;
 		}
 		else {
-			/* cname */
-			record->cnameRRSet.type = ndata;
-			record->cnameRRSet.size =  dlz_atoi(row->cols[i]);
-			assert(record->cnameRRSet.size <= MAX_ALLOWED_RRSET_SIZE && DLZ_ERROR != record->cnameRRSet.size);
-
-			record->cnameRRSet.rrs = PoolGetNStrRR(record->cnameRRSet.size);
-			/* Go to next field. */
-			++i;
-			
-			assert(row->ncols >= i + record->cnameRRSet.size);
-			for (int j = 0; j < record->cnameRRSet.size; ++j) {
-				(*record->cnameRRSet.rrs[j]).assign(row->cols[i + j].data, row->cols[i + j].len);
-			}
-
-			/* Go to next field. */
-			i += record->cnameRRSet.size;
+			continue;
 		}
-	} while(i < row->ncols);
 
-	return;
+		a->s6_addr[i >> 1] |= i & 1 ? d : d << 4;
+	}
 }
 
-inline char* DNSLogzipC::print_sockaddr(char *s, const struct sockaddr_storage &addr)
+static inline uint64_t ConvertTextToBaseNum(const std::string &text, const DNSLogzipCtx &ctx)
 {
-	if (AF_INET == addr.ss_family && ENABLE_NUM_ENCODING) {
-		return ConvertBaseNumToText(((struct sockaddr_in *)&addr)->sin_addr.s_addr, s, INET_ADDRSTRLEN);
-	}
-	else {
-		return ConvertAddrToText(&addr, s, INET6_ADDRSTRLEN, addr.ss_family);
-	}
+	return ConvertTextToBaseNum(text.c_str(), text.size(), ctx);
 }
 
-inline char* DNSLogzipC::print_hidden_fields(char *s, const DNSRecordC *r)
+static inline uint64_t ConvertTextToBaseNum(const dlz_str_t &col, const DNSLogzipCtx &ctx)
 {
-	if (ENABLE_FIELD_HIDDING && r->sQname.size() > sizeof("65535")) {
-		if (0 == r->nRcode && 1 == r->nQtype) {
-			/* Hide all the fields */
-			return s;
-		}
+	return ConvertTextToBaseNum(col.data, col.len, ctx);
+}
 
-		if (0 == r->nRcode) {
-			*s++ = DNSLOGZIP_DELIMITER;
-			if (ENABLE_NUM_ENCODING) {
-				s = ConvertBaseNumToText(r->nQtype, s, 6);
-				assert(NULL != s);
-			}
-			else {
-				s = dlz_itoa(s, r->nQtype);
-			}
-	
-			/* Hide Rcode */
-			return s;
-		}
+/* TIME_SCALES[i] is 10 to the power of i. */
+static const int64_t TIME_SCALES[MAX_TIME_PRECISION + 1] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+/*
+	The time column has exactly ctx.ucTimePrecision fractional digits,
+	e.g. 1700000000.123 is 1700000000123 at precision 3.
+	Return DLZ_ERROR if it has another precision.
+*/
+static inline int64_t ConvertTextToTime(const dlz_str_t &col, const DNSLogzipCtx &ctx)
+{
+	const size_t p = ctx.ucTimePrecision;
+	int64_t sec, frac;
+
+	if (0 == p) {
+		return dlz_atoi(col);
 	}
 
-	*s++ = DNSLOGZIP_DELIMITER;
-	if (ENABLE_NUM_ENCODING) {
-		s = ConvertBaseNumToText(r->nQtype, s, 6);
-		assert(NULL != s);
+	if (col.len < p + 2 || '.' != col.data[col.len - p - 1]) {
+		return DLZ_ERROR;
 	}
-	else {
-		s = dlz_itoa(s, r->nQtype);
+
+	sec  = dlz_atoi(col.data, col.len - p - 1);
+	frac = dlz_atoi(col.data + col.len - p, p);
+	if (DLZ_ERROR == sec || DLZ_ERROR == frac) {
+		return DLZ_ERROR;
 	}
 
-	*s++ = DNSLOGZIP_DELIMITER;
-	if (ENABLE_NUM_ENCODING) {
-		s = ConvertBaseNumToText(r->nRcode, s, 6);
-		assert(NULL != s);
+	return sec * TIME_SCALES[p] + frac;
+}
+
+static inline char* ConvertTimeToText(int64_t t, char *s, const DNSLogzipCtx &ctx)
+{
+	const int p = ctx.ucTimePrecision;
+	int64_t frac;
+
+	if (0 == p) {
+		return dlz_itoa(s, t);
 	}
-	else {
-		s = dlz_itoa(s, r->nRcode);
+
+	frac = t % TIME_SCALES[p];
+	s = dlz_itoa(s, t / TIME_SCALES[p]);
+	*s++ = '.';
+
+	for (int i = p - 1; i >= 0; --i) {
+		s[i] = (frac % 10) + '0';
+		frac /= 10;
 	}
 
-	return s;
+	return s + p;
 }
 
-inline char* DNSLogzipC::print_cnames(char *s, const StrDNSRRSet &rrset)
+static inline int64_t MonotonicUs(void)
 {
-	if (0 == rrset.size) {
-		return s;
-	}
+	struct timespec ts;
 
-	if (ENABLE_NUM_ENCODING) {
-		*s++ = DNSLOGZIP_DELIMITER;
-		s = ConvertBaseNumToText(rrset.type, s, 2);
-		assert(NULL != s);
-		*s++ = DNSLOGZIP_DELIMITER;
-		s = ConvertBaseNumToText(rrset.size, s, 3);
-		assert(NULL != s);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+template <unsigned int Mask>
+DNSLogzipC<Mask>::DNSLogzipC(const DNSLogzipCtx &ctx) : DNSLogzip(ctx) {
+	this->uChunkBytes = 0;
+	this->nLastTime = 0;
+	this->uRunBase = 0;
+	this->uSpillEnd = 0;
+	this->pMergeRun = NULL;
+
+	/* Adaptive chunks start small and grow while they compress better. */
+	this->nChunkStartUs = 0;
+	this->uDistinctQnames = 0;
+	this->dLastBytesPerLine = 0;
+	this->nAdaptDir = 1;
+	if (this->ctx.uMinLines > 0) {
+		this->uChunkLines = this->ctx.uMinLines;
 	}
-	else {
-		*s++ = DNSLOGZIP_DELIMITER;
-		s = dlz_itoa(s, rrset.type);
 
-		*s++ = DNSLOGZIP_DELIMITER;
-		s = dlz_itoa(s, rrset.size);
+	memset(this->uHiddenPairCounts, 0, sizeof(this->uHiddenPairCounts));
+	memset(this->ucHiddenPairCodes, HIDDEN_PAIR_NONE, sizeof(this->ucHiddenPairCodes));
+	this->uHiddenPairsLen = 0;
+	this->bRRSetRefs = false;
+
+	/* The entries start invalid, with generation 0. */
+	this->parseCache = new ParseCacheEntry [PARSE_CACHE_SIZE];
+	for (unsigned i = 0; i < PARSE_CACHE_SIZE; ++i) {
+		this->parseCache[i].uGen = 0;
 	}
+	this->uParseCacheGen = 1;
+	this->bAnswersCached = false;
 
-	for (int j = 0; j < rrset.size; ++j) {
-		*s++ = DNSLOGZIP_DELIMITER;
-		std::strcpy(s, rrset.rrs[j]->c_str());
-		s += rrset.rrs[j]->size();
+	this->addrCache = new AddrCacheEntry [ADDR_CACHE_SIZE];
+	for (unsigned i = 0; i < ADDR_CACHE_SIZE; ++i) {
+		this->addrCache[i].ucLen = 0;
 	}
-	
-	return s;
-}
+	memset(&this->stats, 0, sizeof(this->stats));
 
-inline char* DNSLogzipC::print_rraddrs(char *s, const AddrDNSRRSet &rrset, DNSRecordC *r){
+	this->records = new DNSRecordC* [this->ctx.MemLines()];
+	this->recordElems = new DNSRecordC [this->ctx.MemLines()];
 	
-	/* Print type + size. */
-	if (ENABLE_NUM_ENCODING) {
-		*s++ = DNSLOGZIP_DELIMITER;
-		s = ConvertBaseNumToText(rrset.type, s, 3);
-		assert(NULL != s);
-		*s++ = DNSLOGZIP_DELIMITER;
-		s = ConvertBaseNumToText(rrset.size, s, 3);
-		assert(NULL != s);
+	for (unsigned i = 0; i < this->ctx.MemLines(); ++i) {
+		this->records[i] = &this->recordElems[i]; 
 	}
-	else {
-		*s++ = DNSLOGZIP_DELIMITER;
-		s = dlz_itoa(s, rrset.type);
 
-		*s++ = DNSLOGZIP_DELIMITER;
-		s = dlz_itoa(s, rrset.size);
+	this->uQtypes = new uint16_t [this->ctx.MemLines()];
+	this->uQnameIDs = new uint32_t [this->ctx.MemLines()];
+	this->uSaddrIDs = new uint32_t [this->ctx.MemLines()];
+	this->qnameIDCache = new SortIDEntry [SORT_ID_CACHE_SIZE];
+	this->saddrIDCache = new SortIDEntry [SORT_ID_CACHE_SIZE];
+	for (unsigned i = 0; i < SORT_ID_CACHE_SIZE; ++i) {
+		this->qnameIDCache[i].uGen = 0;
+		this->saddrIDCache[i].uGen = 0;
 	}
+	this->uSortGen = 1;
 	
-	for (int j = 0; j < rrset.size; ++j) {
-		if (DNS_TYPE_A == rrset.type) {
-			const struct sockaddr_in *paddr = (const struct sockaddr_in *)&(rrset.rrs[j - 1]->addr);
-			const struct sockaddr_in *caddr  = (const struct sockaddr_in *)&(rrset.rrs[j]->addr);
+	return;
+}
+
+template <unsigned int Mask>
+DNSLogzipC<Mask>::~DNSLogzipC() {
+	delete[] this->records;
+	delete[] this->recordElems;
+	delete[] this->uQtypes;
+	delete[] this->uQnameIDs;
+	delete[] this->uSaddrIDs;
+	delete[] this->qnameIDCache;
+	delete[] this->saddrIDCache;
+	delete[] this->parseCache;
+	delete[] this->addrCache;
+
+	for (size_t i = 0; i < this->runs.size(); ++i) {
+		delete this->runs[i];
+	}
+}
+
+/* FNV-1a hashes of the answer sections and of the RRSets. */
+#define FNV_OFFSET_BASIS	14695981039346656037ULL
+#define FNV_PRIME			1099511628211ULL
+
+static inline uint64_t HashBytes(uint64_t h, const void *data, size_t len)
+{
+	const u_char *p = (const u_char *) data;
+
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ p[i]) * FNV_PRIME;
+	}
+
+	return h;
+}
+
+static inline uint64_t HashRRSet(const StrDNSRRSet &rrset)
+{
+	uint64_t h = HashBytes(FNV_OFFSET_BASIS, &rrset.type, sizeof(rrset.type));
+
+	for (int i = 0; i < rrset.size; ++i) {
+		/* With the terminating NUL, to tell "ab", "c" from "a", "bc". */
+		h = HashBytes(h, rrset.rrs[i]->c_str(), rrset.rrs[i]->size() + 1);
+	}
+
+	return h;
+}
+
+static inline uint64_t HashAddr(uint64_t h, const struct sockaddr_storage &addr)
+{
+	if (AF_INET == addr.ss_family) {
+		return HashBytes(h, &((const struct sockaddr_in *)&addr)->sin_addr, sizeof(struct in_addr));
+	}
+	else {
+		return HashBytes(h, &((const struct sockaddr_in6 *)&addr)->sin6_addr, sizeof(struct in6_addr));
+	}
+}
+
+static inline uint64_t HashRRSet(const AddrDNSRRSet &rrset)
+{
+	uint64_t h = HashBytes(FNV_OFFSET_BASIS, &rrset.type, sizeof(rrset.type));
+
+	for (int i = 0; i < rrset.size; ++i) {
+		h = HashAddr(h, rrset.rrs[i]->addr);
+	}
+
+	return h;
+}
+
+/* Orders and equality of the sort IDs, see get_sort_id(). */
+static bool SameQname(const DNSRecordC *a, const DNSRecordC *b)
+{
+	return a->sQname == b->sQname;
+}
+
+static bool LessQname(const DNSRecordC *a, const DNSRecordC *b)
+{
+	return CompareQname(a->sQname, b->sQname) < 0;
+}
+
+static bool SameSaddr(const DNSRecordC *a, const DNSRecordC *b)
+{
+	return a->saddr == b->saddr;
+}
+
+static bool LessSaddr(const DNSRecordC *a, const DNSRecordC *b)
+{
+	return a->saddr < b->saddr;
+}
+
+/*
+	Parse resource record addresses from raw log file. So don't use BASENum here.
+	The addresses must be of the family of the type of the RRSet.
+*/
+template <unsigned int Mask>
+bool DNSLogzipC<Mask>::parse_rraddrs(dlz_str_t* cols, AddrDNSRRSet &rrset, int &i, uint8_t type) {
+	int family = DNS_TYPE_A == type ? AF_INET : AF_INET6;
+
+	rrset.type = type;
+	rrset.size = dlz_atoi(cols[i]);
+
+	rrset.rrs = this->pool.GetNAddrRR(rrset.size);
+	/* Go to next column (field). */
+	++i;
+	
+	for (int j = 0; j < rrset.size; ++j) {
+		if (1 != ConvertTextToAddr(cols[i + j].data, cols[i + j].len, &rrset.rrs[j]->addr, family)) {
+			return false;
+		}
+		rrset.rrs[j]->uloc = j;
+	}
+
+	/* Go to next field. */
+	i += rrset.size;
+
+	return true;
+}
+
+/*
+	Parse a client or server address. The clients of a resolver are a
+	bounded population and the servers only a few, so most of them are
+	found in the cache instead of going through inet_pton twice.
+*/
+template <unsigned int Mask>
+inline bool DNSLogzipC<Mask>::parse_addr(const dlz_str_t *col, struct sockaddr_storage *addr) {
+	AddrCacheEntry *entry;
+	uint64_t uHash;
+
+	if (col->len >= sizeof(entry->sText)) {
+		return ConvertTextToAddr(col, addr);
+	}
+
+	uHash = HashBytes(FNV_OFFSET_BASIS, col->data, col->len);
+	entry = &this->addrCache[uHash & (ADDR_CACHE_SIZE - 1)];
+	this->stats.addr_lookups++;
+
+	if (entry->ucLen == col->len && entry->uHash == uHash && 0 == memcmp(entry->sText, col->data, col->len)) {
+		*addr = entry->addr;
+		this->stats.addr_hits++;
+		return true;
+	}
+
+	if (!ConvertTextToAddr(col, addr)) {
+		return false;
+	}
+
+	entry->uHash = uHash;
+	entry->ucLen = col->len;
+	memcpy(entry->sText, col->data, col->len);
+	entry->addr = *addr;
+
+	return true;
+}
+
+/*
+	Check the answer columns of a raw log line, from column 6: RRSets of
+	type, size and records, each of A, AAAA and CNAME at most once.
+*/
+static bool CheckAnswerCols(const dlz_row_t *row)
+{
+	bool bSeen[3] = {false, false, false};
+	int64_t type, size;
+	int i, k;
+
+	for (i = 6; i < row->ncols; i += 2 + size) {
+		if (i + 2 > row->ncols) {
+			return false;
+		}
+
+		type = dlz_atoi(row->cols[i]);
+		size = dlz_atoi(row->cols[i + 1]);
+		k = DNS_TYPE_A == type ? 0 : DNS_TYPE_AAAA == type ? 1 : DNS_TYPE_CNAME == type ? 2 : -1;
+
+		/* The decoder knows no other type. */
+		if (k < 0 || bSeen[k] || size <= 0 || size > MAX_ALLOWED_RRSET_SIZE
+				|| i + 2 + size > row->ncols) {
+			return false;
+		}
+		bSeen[k] = true;
+	}
+
+	return true;
+}
+
+/*
+	Parse log lines. Return false if the line is malformed, the caller
+	then gives back the records taken from the pool.
+*/
+template <unsigned int Mask>
+bool DNSLogzipC<Mask>::parse(dlz_row_t *row, DNSRecordC *record) {
+	int ndata;
+	int i;
+	const char *pRaw;
+	size_t uRawLen;
+	uint64_t uHash;
+	ParseCacheEntry *entry;
+	int64_t n;
+
+	record->nID = this->uLineID;
+	if (row->ncols < 6) {
+		return false;
+	}
+
+	record->nTime = ConvertTextToTime(row->cols[0], this->ctx);
+	if (DLZ_ERROR == record->nTime) {
+		return false;
+	}
+
+	/* Client IP, resolver IP */
+	if (!this->parse_addr(&row->cols[1], &record->caddr) || !this->parse_addr(&row->cols[2], &record->saddr)) {
+		return false;
+	}
+
+	n = dlz_atoi(row->cols[3]);
+	if (DLZ_ERROR == n || n > UINT16_MAX) {
+		return false;
+	}
+	record->nQtype = n;
+
+	n = dlz_atoi(row->cols[4]);
+	if (DLZ_ERROR == n || row->cols[4].len > 2) {
+		return false;
+	}
+	record->nRcode = n;
+
+	/* Domain name, "-" would read as the one of the line before. */
+	if (0 == row->cols[5].len || FILED_REPLACED(row->cols[5])) {
+		return false;
+	}
+	record->sQname.assign(row->cols[5].data, row->cols[5].len);
+
+	if (6 == row->ncols) {
+		/* No answers. */
+		return true;
+	}
+
+	/* An answer section parsed before in the chunk shares its RRSets. */
+	pRaw = row->cols[6].data;
+	uRawLen = row->cols[row->ncols - 1].data + row->cols[row->ncols - 1].len - pRaw;
+	uHash = HashBytes(FNV_OFFSET_BASIS, pRaw, uRawLen);
+	entry = &this->parseCache[uHash & (PARSE_CACHE_SIZE - 1)];
+	this->stats.answer_lookups++;
+
+	if (entry->uGen == this->uParseCacheGen && entry->uHash == uHash
+			&& entry->sRaw.size() == uRawLen && 0 == memcmp(entry->sRaw.data(), pRaw, uRawLen)) {
+		record->cnameRRSet = entry->cnameRRSet;
+		record->addr4RRSet = entry->addr4RRSet;
+		record->addr6RRSet = entry->addr6RRSet;
+		this->bAnswersCached = true;
+		this->stats.answer_hits++;
+		return true;
+	}
+
+	if (!CheckAnswerCols(row)) {
+		return false;
+	}
+
+	i = 6;
+	do {
+		ndata =  dlz_atoi(row->cols[i]);
+		/* Go to next field. */
+		++i;
+
+		if (DNS_TYPE_A == ndata || DNS_TYPE_AAAA == ndata) {
+			if (!this->parse_rraddrs(row->cols, DNS_TYPE_A == ndata ? record->addr4RRSet : record->addr6RRSet, i, ndata)) {
+				return false;
+			}
+		}
+		else {
+			/* cname */
+			record->cnameRRSet.type = ndata;
+			record->cnameRRSet.size =  dlz_atoi(row->cols[i]);
+
+			record->cnameRRSet.rrs = this->pool.GetNStrRR(record->cnameRRSet.size);
+			/* Go to next field. */
+			++i;
+			
+			for (int j = 0; j < record->cnameRRSet.size; ++j) {
+				(*record->cnameRRSet.rrs[j]).assign(row->cols[i + j].data, row->cols[i + j].len);
+			}
+
+			/* Go to next field. */
+			i += record->cnameRRSet.size;
+		}
+	} while(i < row->ncols);
+
+	/* The arrays are sorted in place by commit(). */
+	entry->uHash = uHash;
+	entry->uGen = this->uParseCacheGen;
+	entry->sRaw.assign(pRaw, uRawLen);
+	entry->cnameRRSet = record->cnameRRSet;
+	entry->addr4RRSet = record->addr4RRSet;
+	entry->addr6RRSet = record->addr6RRSet;
+
+	return true;
+}
+
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_sockaddr(char *s, const struct sockaddr_storage &addr)
+{
+	if (AF_INET == addr.ss_family && ENABLE_NUM_ENCODING) {
+		return ConvertBaseNumToText(((struct sockaddr_in *)&addr)->sin_addr.s_addr, s, INET_ADDRSTRLEN, this->ctx);
+	}
+	else {
+		return ConvertAddrToText(&addr, s, INET6_ADDRSTRLEN, addr.ss_family);
+	}
+}
+
+/*
+	Print an address after ref, the address before it, in the shorter of its
+	own form and a form against ref: with ENABLE_IPV6_PREFIX the prefix
+	sharing form of an IPv6 address, with ENABLE_ADDR_XOR the XOR of an IPv4
+	address in the same ADDR_XOR_MAX_BITS subnet as ref with it in var text,
+	both after ADDR_DELTA_FLAG_CHAR.
+*/
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_sockaddr(char *s, const struct sockaddr_storage &addr, const struct sockaddr_storage *ref)
+{
+	char b[IPV6_NIBBLES + MAX_VAR_TEXT_LEN];
+	char *d, *p = b;
+	uint32_t x;
+
+	d = print_sockaddr(s, addr);
+
+	if (NULL == ref || addr.ss_family != ref->ss_family) {
+		return d;
+	}
+
+	if (ENABLE_IPV6_PREFIX && AF_INET6 == addr.ss_family) {
+		p = ConvertAddr6ToPrefixText(((const struct sockaddr_in6 *)&addr)->sin6_addr,
+						((const struct sockaddr_in6 *)ref)->sin6_addr, b);
+	}
+	else if (ENABLE_ADDR_XOR && AF_INET == addr.ss_family) {
+		x = ntohl(((const struct sockaddr_in *)&addr)->sin_addr.s_addr ^ ((const struct sockaddr_in *)ref)->sin_addr.s_addr);
+		if (x < (1u << ADDR_XOR_MAX_BITS)) {
+			*p++ = ADDR_DELTA_FLAG_CHAR;
+			p = ConvertNumToVarText(x, p);
+		}
+	}
+
+	if (p != b && p - b < d - s) {
+		memcpy(s, b, p - b);
+		d = s + (p - b);
+	}
+
+	return d;
+}
+
+/*
+	Slot of the (qtype, rcode) pair of a record for ENABLE_LEARNED_HIDING,
+	-1 if it has none.
+*/
+static inline int HiddenPairSlot(const DNSRecordC *r)
+{
+	return r->nQtype < 256 && r->nRcode < 16 ? r->nQtype << 4 | r->nRcode : -1;
+}
+
+/*
+	Return the index of an earlier RRSet of the chunk equal to rrset, or -1
+	if there is none. Then rrset is printed in full and takes the next index.
+*/
+template <unsigned int Mask>
+template <class RRSet>
+inline int DNSLogzipC<Mask>::find_rrset_ref(const RRSet &rrset)
+{
+	uint64_t h = HashRRSet(rrset);
+	std::unordered_map<uint64_t, uint32_t>::iterator it = this->refRRSetIndex.find(h);
+	const DNSRRSet *ref;
+
+	if (this->refRRSetIndex.end() != it) {
+		ref = this->refRRSets[it->second];
+
+		/* The type tells the kind of the RRSet. */
+		if (ref->type == rrset.type && *(const RRSet *) ref == rrset) {
+			return it->second;
+		}
+	}
+
+	this->refRRSetIndex[h] = this->refRRSets.size();
+	this->refRRSets.push_back(&rrset);
+
+	return -1;
+}
+
+/*
+	Print the type of an RRSet and the index of the earlier one it equals.
+*/
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_rrset_ref(char *s, const DNSRRSet &rrset, int nRef)
+{
+	*s++ = DNSLOGZIP_DELIMITER;
+	s = this->print_num(s, rrset.type);
+
+	*s++ = DNSLOGZIP_DELIMITER;
+	*s++ = RRSET_REF_FLAG_CHAR;
+	return ConvertNumToVarText(nRef, s);
+}
+
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_num(char *s, uint64_t n)
+{
+	if (ENABLE_NUM_ENCODING) {
+		s = ConvertBaseNumToText(n, s, 64, this->ctx);
+		assert(NULL != s);
+		return s;
+	}
+
+	return dlz_itoa(s, n);
+}
+
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_hidden_fields(char *s, const DNSRecordC *r)
+{
+	int nSlot;
+	uint8_t ucCode;
+
+	if (ENABLE_FIELD_HIDDING && r->sQname.size() > sizeof("65535")) {
+		if (ENABLE_LEARNED_HIDING) {
+			nSlot = HiddenPairSlot(r);
+			ucCode = nSlot >= 0 ? this->ucHiddenPairCodes[nSlot] : HIDDEN_PAIR_NONE;
+
+			if (0 == ucCode) {
+				/* The first pair of the chunk header */
+				return s;
+			}
+
+			if (HIDDEN_PAIR_NONE != ucCode) {
+				*s++ = DNSLOGZIP_DELIMITER;
+				*s++ = HIDDEN_PAIR_FLAG_CHAR;
+				return ConvertNumToVarText(ucCode, s);
+			}
+		}
+		else if (0 == r->nRcode && 1 == r->nQtype) {
+			/* Hide all the fields */
+			return s;
+		}
+
+		if (0 == r->nRcode) {
+			*s++ = DNSLOGZIP_DELIMITER;
+			if (ENABLE_NUM_ENCODING) {
+				s = ConvertBaseNumToText(r->nQtype, s, 6, this->ctx);
+				assert(NULL != s);
+			}
+			else {
+				s = dlz_itoa(s, r->nQtype);
+			}
+	
+			/* Hide Rcode */
+			return s;
+		}
+	}
+
+	*s++ = DNSLOGZIP_DELIMITER;
+	if (ENABLE_NUM_ENCODING) {
+		s = ConvertBaseNumToText(r->nQtype, s, 6, this->ctx);
+		assert(NULL != s);
+	}
+	else {
+		s = dlz_itoa(s, r->nQtype);
+	}
+
+	*s++ = DNSLOGZIP_DELIMITER;
+	if (ENABLE_NUM_ENCODING) {
+		s = ConvertBaseNumToText(r->nRcode, s, 6, this->ctx);
+		assert(NULL != s);
+	}
+	else {
+		s = dlz_itoa(s, r->nRcode);
+	}
+
+	return s;
+}
+
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_cnames(char *s, const StrDNSRRSet &rrset)
+{
+	if (0 == rrset.size) {
+		return s;
+	}
+
+	if (ENABLE_NUM_ENCODING) {
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = ConvertBaseNumToText(rrset.type, s, 2, this->ctx);
+		assert(NULL != s);
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = ConvertBaseNumToText(rrset.size, s, 3, this->ctx);
+		assert(NULL != s);
+	}
+	else {
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = dlz_itoa(s, rrset.type);
+
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = dlz_itoa(s, rrset.size);
+	}
+
+	for (int j = 0; j < rrset.size; ++j) {
+		*s++ = DNSLOGZIP_DELIMITER;
+		std::strcpy(s, rrset.rrs[j]->c_str());
+		s += rrset.rrs[j]->size();
+	}
+	
+	return s;
+}
+
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_rraddrs(char *s, const AddrDNSRRSet &rrset, const DNSRecordC *r){
+	
+	/* Print type + size. */
+	if (ENABLE_NUM_ENCODING) {
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = ConvertBaseNumToText(rrset.type, s, 3, this->ctx);
+		assert(NULL != s);
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = ConvertBaseNumToText(rrset.size, s, 3, this->ctx);
+		assert(NULL != s);
+	}
+	else {
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = dlz_itoa(s, rrset.type);
+
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = dlz_itoa(s, rrset.size);
+	}
+	
+	for (int j = 0; j < rrset.size; ++j) {
+		if (DNS_TYPE_A == rrset.type) {
+			const struct sockaddr_in *paddr = (const struct sockaddr_in *)&(rrset.rrs[j - 1]->addr);
+			const struct sockaddr_in *caddr  = (const struct sockaddr_in *)&(rrset.rrs[j]->addr);
 
 			if (ENABLE_ADDR_DIFFERENCE && j > 0) {
 				/* Print addr difference. */
 				if (ENABLE_NUM_ENCODING) {
 					*s++ = DNSLOGZIP_DELIMITER;
-					s = ConvertBaseNumToText(ntohl(caddr->sin_addr.s_addr) - ntohl(paddr->sin_addr.s_addr), s, 12);
+					s = ConvertBaseNumToText(ntohl(caddr->sin_addr.s_addr) - ntohl(paddr->sin_addr.s_addr), s, 12, this->ctx);
 					assert(NULL != s);
 				}
 				else {
@@ -478,457 +1126,1301 @@ inline char* DNSLogzipC::print_rraddrs(char *s, const AddrDNSRRSet &rrset, DNSRe
 				}
 			}
 			else {
-				*s++ = DNSLOGZIP_DELIMITER;
-				/* Print the addr as is. */
-				s = print_sockaddr(s, rrset.rrs[j]->addr);
-				assert(NULL != s);
+				*s++ = DNSLOGZIP_DELIMITER;
+				/* Print the addr as is. */
+				s = print_sockaddr(s, rrset.rrs[j]->addr);
+				assert(NULL != s);
+			}
+		}
+		else {			
+			const struct sockaddr_in6 *paddr = (const struct sockaddr_in6 *)&(rrset.rrs[j - 1]->addr);
+			const struct sockaddr_in6 *caddr  = (const struct sockaddr_in6 *)&(rrset.rrs[j]->addr);			
+
+			assert(DNS_TYPE_AAAA == rrset.type);
+			if (
+				ENABLE_ADDR_DIFFERENCE && j > 0 &&
+				caddr->sin6_addr.s6_addr32[2] == paddr->sin6_addr.s6_addr32[2] &&
+				caddr->sin6_addr.s6_addr32[1] == paddr->sin6_addr.s6_addr32[1] &&
+				caddr->sin6_addr.s6_addr32[0] == paddr->sin6_addr.s6_addr32[0]
+				) {
+				assert(memcmp(&caddr->sin6_addr.s6_addr32[3], &paddr->sin6_addr.s6_addr32[3], 4) > 0);
+				uint32_t diff = ntohl(caddr->sin6_addr.s6_addr32[3]) - ntohl(paddr->sin6_addr.s6_addr32[3]);
+
+				if (ENABLE_NUM_ENCODING) {
+					*s++ = DNSLOGZIP_DELIMITER;
+					s = ConvertBaseNumToText(diff, s, 10, this->ctx);
+					assert(NULL != s);
+				}
+				else {
+					*s++ = DNSLOGZIP_DELIMITER;
+					s = dlz_itoa(s, diff);
+				}
+			}
+			else {
+				*s++ = DNSLOGZIP_DELIMITER;
+				s = print_sockaddr(s, rrset.rrs[j]->addr, j > 0 ? &rrset.rrs[j - 1]->addr : NULL);
+				assert(NULL != s);
+			}
+		}
+	}
+	
+	return s;
+}
+
+/*
+	The number of bits required to store address locations in a resource record set is as follows:
+	
+		If the size of the rrset is ≤ 4, then 2 bits are required for each location and 1 byte is required to record all address locations.
+		If the size of the rrset is ≤ 16, then 4 bits are required for each location. This equates to 4 * 16 = 64 bits, or 8 bytes.
+		For an rrset size of ≤32, 8 bits are required for each location. This equates to 8 * 32 = 32 bytes, which can be stored using base36.
+*/
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_rraddr_locs(char *s, const AddrDNSRRSet &rrset) {
+	int i;
+	uint8_t bitmap[8];
+
+	assert(rrset.size > 1);
+
+	if (rrset.size <= 4) {
+
+		bitmap[0] = 0;
+		for (i = 0; i < rrset.size; ++i) {
+			set_loc_in_bitmap(bitmap, 2, i, rrset.rrs[i]->uloc);
+		}
+		
+		s = ConvertBaseNumToText(bitmap[0], s, 4, this->ctx);
+		assert(NULL != s);
+	}
+	else if (rrset.size <= 16) {
+
+		*(uint64_t *)bitmap = 0;
+		for (i = 0; i < rrset.size; ++i) {
+			set_loc_in_bitmap(bitmap, 4, i, rrset.rrs[i]->uloc);
+		}
+
+		s = ConvertBaseNumToText(*(uint64_t *)bitmap, s, 24, this->ctx);
+		assert(NULL != s);
+	}
+	else {
+		assert(rrset.size <= MAX_ALLOWED_RRSET_SIZE);
+		int nLocLen = (log(rrset.size) / log(this->ctx.ucBaseNum)) + 1;
+		
+		for (i = 0; i < rrset.size; ++i) {
+			char *d = ConvertBaseNumToText(rrset.rrs[i]->uloc, s, nLocLen + 1, this->ctx);
+			assert(d != s);
+			while (d < s + nLocLen) {
+				*d++ = '0';
+			}
+
+			s = d;
+		}
+	}
+
+	*s++ = DNSLOGZIP_DELIMITER;
+	return s;
+}
+
+/*
+	Print the rraddr locations of the A and AAAA sets of a record. With
+	ENABLE_SORTED_RRSETS the sets already in order print nothing, and the
+	next locations printed start with the number of sets skipped.
+*/
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_rraddr_locs(char *s, const DNSRecordC *r) {
+	const AddrDNSRRSet *rrsets[2] = {&r->addr4RRSet, &r->addr6RRSet};
+	const AddrDNSRRSet *rrset;
+	size_t i;
+
+	for (int k = 0; k < 2; ++k) {
+		rrset = rrsets[k];
+		if (rrset->size <= 1) {
+			continue;
+		}
+
+		if (ENABLE_SORTED_RRSETS) {
+			for (i = 0; i < rrset->size && rrset->rrs[i]->uloc == i; ++i);
+
+			if (i == rrset->size) {
+				this->uSortedRRSets++;
+				continue;
+			}
+
+			s = ConvertNumToVarText(this->uSortedRRSets, s);
+			this->uSortedRRSets = 0;
+		}
+
+		s = print_rraddr_locs(s, *rrset);
+	}
+
+	return s;
+}
+
+/*
+	Print the line ID of a record after pr, the one before it in the chunk
+	(NULL for the first), in a fixed number of digits. With ENABLE_LOC_DELTA
+	only the first record of a group with the same key does so: the IDs of
+	the group increase, so the others print the gap from pr.
+*/
+template <unsigned int Mask>
+inline char* DNSLogzipC<Mask>::print_record_loc(char *s, const DNSRecordC *r, const DNSRecordC *pr) {
+	char *d;
+
+	if (ENABLE_LOC_DELTA && NULL != pr && pr->sQname == r->sQname
+			&& pr->nQtype == r->nQtype && pr->saddr == r->saddr) {
+		assert(r->nID > pr->nID);
+		return ConvertNumToVarText(r->nID - pr->nID - 1, s);
+	}
+
+	d = ConvertBaseNumToText(r->nID, s, this->ctx.ucLocStrFixedLen + 1, this->ctx);
+
+	assert(NULL != d);
+	assert(d <= s + this->ctx.ucLocStrFixedLen);
+	while (d < s + this->ctx.ucLocStrFixedLen) {
+		*d++ = '0';
+	}
+
+	return d;
+}
+
+/*
+	Pick the (qtype, rcode) pairs of the chunk worth a code and print them
+	in the chunk header, the number of pairs first. A pair costs its qtype,
+	and its rcode unless 0, on every line. The pair that saves the most is
+	hidden, the others cost the 3 bytes of their code, and are only listed
+	if this saves more than listing them costs.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::output_hidden_pairs(void) {
+	std::vector<std::pair<uint64_t, uint16_t> > candidates;
+	char b[(MAX_HIDDEN_PAIRS + 1) * 32];
+	char t[32], *s;
+	uint64_t uCost, uBest = 0;
+	int nBest = -1;
+
+	for (int i = 0; i < HIDDEN_PAIR_SLOTS; ++i) {
+		if (0 == this->uHiddenPairCounts[i]) {
+			continue;
+		}
+
+		uCost = 1 + (this->print_num(t, i >> 4) - t);
+		if (0 != (i & 0x0f)) {
+			uCost += 1 + (this->print_num(t, i & 0x0f) - t);
+		}
+
+		if (this->uHiddenPairCounts[i] * uCost > uBest) {
+			uBest = this->uHiddenPairCounts[i] * uCost;
+			nBest = i;
+		}
+
+		if (uCost > 3 && this->uHiddenPairCounts[i] * (uCost - 3) > uCost + 1) {
+			candidates.push_back(std::make_pair(this->uHiddenPairCounts[i] * (uCost - 3), (uint16_t) i));
+		}
+
+		this->uHiddenPairCounts[i] = 0;
+	}
+
+	if (nBest >= 0) {
+		this->uHiddenPairs[this->uHiddenPairsLen++] = nBest;
+	}
+
+	std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<uint64_t, uint16_t> >());
+	for (size_t i = 0; i < candidates.size() && this->uHiddenPairsLen < MAX_HIDDEN_PAIRS; ++i) {
+		if (candidates[i].second != nBest) {
+			this->uHiddenPairs[this->uHiddenPairsLen++] = candidates[i].second;
+		}
+	}
+
+	s = dlz_itoa(b, this->uHiddenPairsLen);
+	for (size_t i = 0; i < this->uHiddenPairsLen; ++i) {
+		this->ucHiddenPairCodes[this->uHiddenPairs[i]] = i;
+
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = this->print_num(s, this->uHiddenPairs[i] >> 4);
+		*s++ = DNSLOGZIP_DELIMITER;
+		s = this->print_num(s, this->uHiddenPairs[i] & 0x0f);
+	}
+
+	*s++ = '\n';
+	this->emit(b, s - b);
+}
+
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::output_record_locs(void) {	
+	DNSRecordC *r;
+	char b[4096];
+	char *s;
+	const char *ef = b + sizeof(b) - std::max<size_t>(this->ctx.ucLocStrFixedLen, MAX_VAR_TEXT_LEN);
+
+	if (!ENABLE_LINE_SORTING) {
+		return;
+	}
+
+	assert(this->ctx.ucLocStrFixedLen < sizeof(this->ctx.muls) / sizeof(this->ctx.muls[0]));
+	assert(this->uLineID < this->ctx.muls[this->ctx.ucLocStrFixedLen]);
+
+	b[0] = 0;
+	s = b;
+	for (size_t i = 0; i < this->uLineID; ++i) {
+		r = this->records[i];
+
+		/* Fill the location. */
+		s = this->print_record_loc(s, r, i > 0 ? this->records[i - 1] : NULL);
+
+		/* Flush the line */
+		if (s >= ef) {
+			*s++ = '\n';
+			this->emit(b, s - b);
+			s = b;
+		}
+	}
+
+	std::strcpy(s, HEADER_END_INDICATOR_LF);
+	s += sizeof(HEADER_END_INDICATOR_LF) - 1;
+
+	this->emit(b, s - b);
+	
+}
+
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::output_rraddr_locs(void) {
+	DNSRecordC *r;
+	char b[4096];
+	char *s;
+	const char *ef = b + sizeof(b) - 2 * (MAX_ALLOWED_RRSET_SIZE * 2 + MAX_VAR_TEXT_LEN);
+
+	if (!ENABLE_RRADDR_SORTING) {
+		return;
+	}
+
+	b[0] = 0;
+	s = b;
+	this->uSortedRRSets = 0;
+	for (size_t i = 0; i < this->uLineID; ++i) {
+		r = this->records[i];			
+
+		s = print_rraddr_locs(s, r);
+
+		/* Flush the line. */
+		if (s > ef) {
+			/* The last space should be removed. */
+			s--;
+			*s++ = '\n';
+			this->emit(b, s - b);
+			s = b;
+		}
+	}
+
+	if (s != b) {
+		/* The last space should be removed. */
+		s--;
+	}
+
+	std::strcpy(s, HEADER_END_INDICATOR_LF);
+	s += sizeof(HEADER_END_INDICATOR_LF) - 1;
+
+	this->emit(b, s - b);
+	
+}
+
+/*
+	Print a record after pr, the one before it in the chunk (NULL for the first).
+*/
+template <unsigned int Mask>
+char* DNSLogzipC<Mask>::print_record(char *s, const DNSRecordC *r, const DNSRecordC *pr) {
+	bool bSameQname;
+	int nRef;
+
+	/* Print time, a negative delta is the magnitude after a '-'. */
+	if (r->nTimeDiff < 0) {
+		*s++ = TIME_NEGATIVE_FLAG_CHAR;
+	}
+
+	if (ENABLE_NUM_ENCODING) {
+		s = ConvertBaseNumToText(std::abs(r->nTimeDiff), s, 64, this->ctx);
+		assert(NULL != s);
+	}
+	else {
+		s = dlz_itoa(s, std::abs(r->nTimeDiff));
+	}
+
+	*s++ = DNSLOGZIP_DELIMITER;
+	/* Print client address. */		
+	if (ENABLE_FIELD_REPLACEMENT && NULL != pr
+					&& r->caddr == pr->caddr) {		
+		*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
+	}
+	else {
+		s = this->print_sockaddr(s, r->caddr, NULL != pr ? &pr->caddr : NULL);
+	}	
+	
+	/* Print server address */
+	*s++ = DNSLOGZIP_DELIMITER;
+	if (ENABLE_FIELD_REPLACEMENT && NULL != pr
+					&& r->saddr == pr->saddr) {
+		*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
+	}
+	else {		
+		s = this->print_sockaddr(s, r->saddr, NULL != pr ? &pr->saddr : NULL);
+	}
+
+	/* Print hidden fields */
+	s = this->print_hidden_fields(s, r);
+
+	/* Print qname */
+	bSameQname = NULL != pr && pr->sQname == r->sQname;
+	if (!bSameQname) {
+		this->uDistinctQnames++;
+	}
+
+	if (ENABLE_FIELD_REPLACEMENT && bSameQname) {
+		*s++ = DNSLOGZIP_DELIMITER;
+		*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
+	}
+	else {
+		*s++ = DNSLOGZIP_DELIMITER;
+		std::strcpy(s, r->sQname.c_str());
+		s += r->sQname.size();
+	}
+	
+	/* Print cname. */
+	if (r->cnameRRSet.size > 0) {			
+		if (ENABLE_FIELD_REPLACEMENT && NULL != pr && pr->cnameRRSet == r->cnameRRSet) {
+			*s++ = DNSLOGZIP_DELIMITER;
+			
+			if (ENABLE_NUM_ENCODING) {
+				s = ConvertBaseNumToText(r->cnameRRSet.type, s, 2, this->ctx);
+			}
+			else {
+				s = dlz_itoa(s, r->cnameRRSet.type);
 			}
+
+			*s++ = DNSLOGZIP_DELIMITER;
+			*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
 		}
-		else {			
-			const struct sockaddr_in6 *paddr = (const struct sockaddr_in6 *)&(rrset.rrs[j - 1]->addr);
-			const struct sockaddr_in6 *caddr  = (const struct sockaddr_in6 *)&(rrset.rrs[j]->addr);			
+		else if (this->bRRSetRefs && (nRef = this->find_rrset_ref(r->cnameRRSet)) >= 0) {
+			s = this->print_rrset_ref(s, r->cnameRRSet, nRef);
+		}
+		else {
+			s = this->print_cnames(s, r->cnameRRSet);
+		}
+	}
 
-			assert(DNS_TYPE_AAAA == rrset.type);
-			if (
-				ENABLE_ADDR_DIFFERENCE && j > 0 &&
-				caddr->sin6_addr.s6_addr32[2] == paddr->sin6_addr.s6_addr32[2] &&
-				caddr->sin6_addr.s6_addr32[1] == paddr->sin6_addr.s6_addr32[1] &&
-				caddr->sin6_addr.s6_addr32[0] == paddr->sin6_addr.s6_addr32[0]
-				) {
-				assert(memcmp(&caddr->sin6_addr.s6_addr32[3], &paddr->sin6_addr.s6_addr32[3], 4) > 0);
-				uint32_t diff = ntohl(caddr->sin6_addr.s6_addr32[3]) - ntohl(paddr->sin6_addr.s6_addr32[3]);
+	/* Print rdaddr4s */
+	if (r->addr4RRSet.size > 0) {
+		if (ENABLE_FIELD_REPLACEMENT && NULL != pr && pr->addr4RRSet == r->addr4RRSet) {
+			*s++ = DNSLOGZIP_DELIMITER;
+			
+			if (ENABLE_NUM_ENCODING) {
+				s = ConvertBaseNumToText(r->addr4RRSet.type, s, 2, this->ctx);
+			}
+			else {
+				s = dlz_itoa(s, r->addr4RRSet.type);
+			}
 
-				if (ENABLE_NUM_ENCODING) {
-					*s++ = DNSLOGZIP_DELIMITER;
-					s = ConvertBaseNumToText(diff, s, 10);
-					assert(NULL != s);
-				}
-				else {
-					*s++ = DNSLOGZIP_DELIMITER;
-					s = dlz_itoa(s, diff);
-				}
+			*s++ = DNSLOGZIP_DELIMITER;
+			*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
+		}
+		else if (this->bRRSetRefs && (nRef = this->find_rrset_ref(r->addr4RRSet)) >= 0) {
+			s = this->print_rrset_ref(s, r->addr4RRSet, nRef);
+		}
+		else {	
+			s = this->print_rraddrs(s, r->addr4RRSet, r);
+		}
+	}
+
+	/* Print rdaddr6s */
+	if (r->addr6RRSet.size > 0) {
+		if (ENABLE_FIELD_REPLACEMENT && NULL != pr && pr->addr6RRSet == r->addr6RRSet) {
+			*s++ = DNSLOGZIP_DELIMITER;
+
+			if (ENABLE_NUM_ENCODING) {
+				s = ConvertBaseNumToText(r->addr6RRSet.type, s, 3, this->ctx);					
 			}
 			else {
-				*s++ = DNSLOGZIP_DELIMITER;
-				s = print_sockaddr(s, rrset.rrs[j]->addr);
-				assert(NULL != s);
+				s = dlz_itoa(s, r->addr6RRSet.type);
 			}
+
+			*s++ = DNSLOGZIP_DELIMITER;
+			*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
+		}
+		else if (this->bRRSetRefs && (nRef = this->find_rrset_ref(r->addr6RRSet)) >= 0) {
+			s = this->print_rrset_ref(s, r->addr6RRSet, nRef);
+		}
+		else {
+			s = this->print_rraddrs(s, r->addr6RRSet, r);
+		}
+	}
+
+	*s++ = '\n';
+
+	return s;
+}
+
+/*
+	Upper bound of the text of a record, encoded or decoded: its names, and
+	MAX_FIELD_TEXT_LEN for each of its other fields and answers.
+*/
+static size_t RecordTextBound(const DNSRecord *r)
+{
+	size_t n = r->sQname.size() + (16 + r->cnameRRSet.size + r->addr4RRSet.size + r->addr6RRSet.size) * MAX_FIELD_TEXT_LEN;
+
+	for (int j = 0; j < r->cnameRRSet.size; ++j) {
+		n += r->cnameRRSet.rrs[j]->size();
+	}
+
+	return n;
+}
+
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::output(void) {
+	char *s = this->textBuf.data();
+
+	this->output_record_locs();
+	this->output_rraddr_locs();
+
+	this->bRRSetRefs = ENABLE_RRSET_REFS;
+	for (size_t i = 0; i < this->uLineID; ++i) {
+		s = this->text_room(s, RecordTextBound(this->records[i]));
+		s = this->print_record(s, this->records[i], i > 0 ? this->records[i - 1] : NULL);
+	}
+
+	if (s != this->textBuf.data()) {
+		this->emit(this->textBuf.data(), s - this->textBuf.data());
+	}
+
+	this->bRRSetRefs = false;
+	this->refRRSets.clear();
+	this->refRRSetIndex.clear();
+}
+
+template <unsigned int Mask>
+inline void DNSLogzipC<Mask>::do_rraddr_sorting(DNSRecordC *r) {	
+	if (r->addr4RRSet.size > 1) {
+		if (ENABLE_RRADDR_SORTING || ENABLE_ADDR_DIFFERENCE)
+			std::sort(r->addr4RRSet.rrs, r->addr4RRSet.rrs + r->addr4RRSet.size, CompareRRAddr);
+	}
+	
+	if (r->addr6RRSet.size > 1) {
+		if (ENABLE_RRADDR_SORTING || ENABLE_ADDR_DIFFERENCE)
+			std::sort(r->addr6RRSet.rrs, r->addr6RRSet.rrs + r->addr6RRSet.size, CompareRRAddr);
+	}
+}
+
+/*
+	Return the sort ID of the qname or the server address of r, in the
+	chunk or the run being sorted. A value whose entry was taken by another
+	one gets a new ID.
+*/
+template <unsigned int Mask>
+inline uint32_t DNSLogzipC<Mask>::get_sort_id(SortIDEntry *cache, std::vector<const DNSRecordC*> &idRecords,
+		uint64_t uHash, const DNSRecordC *r, bool (*pfnSame)(const DNSRecordC*, const DNSRecordC*)) {
+	SortIDEntry *entry = &cache[uHash & (SORT_ID_CACHE_SIZE - 1)];
+
+	if (entry->uGen == this->uSortGen && entry->uHash == uHash && pfnSame(idRecords[entry->uID], r)) {
+		return entry->uID;
+	}
+
+	entry->uHash = uHash;
+	entry->uGen = this->uSortGen;
+	entry->uID = idRecords.size();
+	idRecords.push_back(r);
+
+	return entry->uID;
+}
+
+/*
+	Rank the sort IDs by the values they stand for. Equal values have the
+	same rank, less than the number of IDs.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::rank_sort_ids(const std::vector<const DNSRecordC*> &idRecords,
+		bool (*pfnLess)(const DNSRecordC*, const DNSRecordC*), std::vector<uint32_t> &ranks) {
+	std::vector<uint32_t> &order = this->sortOrder;
+
+	order.resize(idRecords.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+
+	std::sort(order.begin(), order.end(),
+			[&idRecords, pfnLess](uint32_t a, uint32_t b) { return pfnLess(idRecords[a], idRecords[b]); });
+
+	ranks.resize(idRecords.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		if (i > 0 && !pfnLess(idRecords[order[i - 1]], idRecords[order[i]])) {
+			ranks[order[i]] = ranks[order[i - 1]];
+		}
+		else {
+			ranks[order[i]] = i;
 		}
 	}
-	
-	return s;
 }
 
 /*
-	The number of bits required to store address locations in a resource record set is as follows:
-	
-		If the size of the rrset is ≤ 4, then 2 bits are required for each location and 1 byte is required to record all address locations.
-		If the size of the rrset is ≤ 16, then 4 bits are required for each location. This equates to 4 * 16 = 64 bits, or 8 bytes.
-		For an rrset size of ≤32, 8 bits are required for each location. This equates to 8 * 32 = 32 bytes, which can be stored using base36.
+	Sort the records of the chunk, or of the run, in the order of
+	CompareDNSRecord().
 */
-inline char* DNSLogzipC:: print_rraddr_locs(char *s, const AddrDNSRRSet &rrset) {
-	int i;
-	uint8_t bitmap[8];
+template <unsigned int Mask>
+inline void DNSLogzipC<Mask>::do_record_sorting(void)
+{
+	size_t n = this->uLineID - this->uRunBase;
 
-	assert(rrset.size > 1);
+	if (!ENABLE_LINE_SORTING) {
+		return;
+	}
 
-	if (rrset.size <= 4) {
+	if (this->qnameIDRecords.size() > SORT_MAX_DISTINCT_RATIO * n) {
+		std::sort(this->records, this->records + n, CompareDNSRecord);
+	}
+	else {
+		this->do_ranked_sorting(n);
+	}
 
-		bitmap[0] = 0;
-		for (i = 0; i < rrset.size; ++i) {
-			set_loc_in_bitmap(bitmap, 2, i, rrset.rrs[i]->uloc);
-		}
-		
-		s = ConvertBaseNumToText(bitmap[0], s, 4);
-		assert(NULL != s);
+	/* The next chunk or run starts with new IDs. */
+	this->qnameIDRecords.clear();
+	this->saddrIDRecords.clear();
+	this->uSortGen++;
+}
+
+/*
+	Sort the records from the sort columns: the ranks of the qname and
+	server address IDs (below 2^24 like the line IDs) and the qtype are
+	packed in a key, and the slots are in the order of the lines.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::do_ranked_sorting(size_t n)
+{
+	this->rank_sort_ids(this->qnameIDRecords, LessQname, this->qnameRanks);
+	this->rank_sort_ids(this->saddrIDRecords, LessSaddr, this->saddrRanks);
+
+	this->sortKeys.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		this->sortKeys[i].first = (uint64_t) this->qnameRanks[this->uQnameIDs[i]] << 40
+									| (uint64_t) this->uQtypes[i] << 24 | this->saddrRanks[this->uSaddrIDs[i]];
+		this->sortKeys[i].second = i;
 	}
-	else if (rrset.size <= 16) {
 
-		*(uint64_t *)bitmap = 0;
-		for (i = 0; i < rrset.size; ++i) {
-			set_loc_in_bitmap(bitmap, 4, i, rrset.rrs[i]->uloc);
-		}
+	std::sort(this->sortKeys.begin(), this->sortKeys.end());
 
-		s = ConvertBaseNumToText(*(uint64_t *)bitmap, s, 24);
-		assert(NULL != s);
+	this->sortedRecords.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		this->sortedRecords[i] = this->records[this->sortKeys[i].second];
+	}
+	std::copy(this->sortedRecords.begin(), this->sortedRecords.end(), this->records);
+}
+
+template <unsigned int Mask>
+inline void DNSLogzipC<Mask>::do_time_differential(DNSRecordC *r)
+{
+	if (ENABLE_TIME_DIFFERENCE && this->uLineID > 1) {
+		/* Lines of worker threads may be slightly out of order, the delta is signed. */
+		r->nTimeDiff  = r->nTime - this->nLastTime;
 	}
 	else {
-		assert(rrset.size <= MAX_ALLOWED_RRSET_SIZE);
-		int nLocLen = (log(rrset.size) / log(g_ucBaseNum)) + 1;
-		
-		for (i = 0; i < rrset.size; ++i) {
-			char *d = ConvertBaseNumToText(rrset.rrs[i]->uloc, s, nLocLen + 1);
-			assert(d != s);
-			while (d < s + nLocLen) {
-				*d++ = '0';
-			}
+		r->nTimeDiff = r->nTime;
+	}
 
-			s = d;
-		}
+	this->nLastTime = r->nTime;
+}
+
+template <unsigned int Mask>
+int DNSLogzipC<Mask>::Process(dlz_row_t *row) {
+	DNSRecordC *record  = this->records[this->uLineID - this->uRunBase];
+	size_t uAddrRRs, uStrRRs;
+
+	if (row->ncols < 3) {
+		return DLZ_OK;
 	}
 
-	*s++ = DNSLOGZIP_DELIMITER;
-	return s;
+	this->uLineID++;
+	this->initialize_record(record);
+
+	this->pool.Tell(&uAddrRRs, &uStrRRs);
+	if (!this->parse(row, record)) {
+		this->pool.Rewind(uAddrRRs, uStrRRs);
+		this->uLineID--;
+		this->stats.bad_lines++;
+		return DLZ_ERROR;
+	}
+
+	/* Size of the raw line, including the LF. */
+	this->commit(record, row->cols[row->ncols - 1].data + row->cols[row->ncols - 1].len 
+							- row->cols[0].data + 1);
+
+	return DLZ_OK;
 }
 
-void DNSLogzipC::output_record_locs(void) {	
-	DNSRecordC *r;
-	char b[4096];
-	char *s, *d;
-	const char *ef = b + sizeof(b) - g_ucLocStrFixedLen;
+static inline bool IsAddrFamily(const struct sockaddr_storage &addr)
+{
+	return AF_INET == addr.ss_family || AF_INET6 == addr.ss_family;
+}
 
-	if (!ENABLE_LINE_SORTING) {
-		return;
+template <unsigned int Mask>
+int DNSLogzipC<Mask>::ProcessRecord(const dlz_record_t *rec, const dlz_view_t *cnames,
+										const struct sockaddr_storage *addr4s,
+										const struct sockaddr_storage *addr6s) {
+	DNSRecordC *record  = this->records[this->uLineID - this->uRunBase];
+	size_t uRawBytes;
+	int j;
+
+	bool bValid = rec->ncnames <= MAX_ALLOWED_RRSET_SIZE && rec->naddr4s <= MAX_ALLOWED_RRSET_SIZE
+					&& rec->naddr6s <= MAX_ALLOWED_RRSET_SIZE && IsAddrFamily(rec->client) && IsAddrFamily(rec->server)
+					&& rec->qname.len > 0 && !FILED_REPLACED(rec->qname);
+
+	for (j = 0; bValid && j < rec->naddr4s; ++j) {
+		bValid = AF_INET == addr4s[j].ss_family;
 	}
 
-	assert(g_uLineSortingBufSize < pow(g_ucBaseNum, g_ucLocStrFixedLen));
+	for (j = 0; bValid && j < rec->naddr6s; ++j) {
+		bValid = AF_INET6 == addr6s[j].ss_family;
+	}
 
-	b[0] = 0;
-	s = b;
-	for (size_t i = 0; i < this->uLineID; ++i) {
-		r = this->records[i];
+	if (!bValid) {
+		this->stats.bad_lines++;
+		return DLZ_ERROR;
+	}
 
-		/* Fill the location. */
-		d = ConvertBaseNumToText(r->nID, s, g_ucLocStrFixedLen + 1);
-		assert(NULL != d);
-		assert(d <= s + g_ucLocStrFixedLen);
-		while (d < s + g_ucLocStrFixedLen) {
-			*d++ = '0';
+	this->uLineID++;
+	this->initialize_record(record);
+
+	record->nID = this->uLineID;
+	record->nTime = rec->time * TIME_SCALES[this->ctx.ucTimePrecision]
+					+ rec->nsec / TIME_SCALES[MAX_TIME_PRECISION - this->ctx.ucTimePrecision];
+	record->caddr = rec->client;
+	record->saddr = rec->server;
+	record->nQtype = rec->qtype;
+	record->nRcode = rec->rcode;
+	record->sQname.assign(rec->qname.data, rec->qname.len);
+
+	/* Roughly the size of the line in a text log. */
+	uRawBytes = 48 + rec->qname.len;
+
+	if (rec->ncnames > 0) {
+		record->cnameRRSet.type = DNS_TYPE_CNAME;
+		record->cnameRRSet.size = rec->ncnames;
+		record->cnameRRSet.rrs = this->pool.GetNStrRR(rec->ncnames);
+
+		for (j = 0; j < rec->ncnames; ++j) {
+			record->cnameRRSet.rrs[j]->assign(cnames[j].data, cnames[j].len);
+			uRawBytes += cnames[j].len + 1;
+		}
+	}
+
+	if (rec->naddr4s > 0) {
+		record->addr4RRSet.type = DNS_TYPE_A;
+		record->addr4RRSet.size = rec->naddr4s;
+		record->addr4RRSet.rrs = this->pool.GetNAddrRR(rec->naddr4s);
+
+		for (j = 0; j < rec->naddr4s; ++j) {
+			record->addr4RRSet.rrs[j]->addr = addr4s[j];
+			record->addr4RRSet.rrs[j]->uloc = j;
 		}
+		uRawBytes += 16 * rec->naddr4s;
+	}
 
-		s = d;
+	if (rec->naddr6s > 0) {
+		record->addr6RRSet.type = DNS_TYPE_AAAA;
+		record->addr6RRSet.size = rec->naddr6s;
+		record->addr6RRSet.rrs = this->pool.GetNAddrRR(rec->naddr6s);
 
-		/* Flush the line */
-		if (s >= ef) {
-			*s++ = '\n';
-			write(STDOUT_FILENO, b, s - b);
-			s = b;
+		for (j = 0; j < rec->naddr6s; ++j) {
+			record->addr6RRSet.rrs[j]->addr = addr6s[j];
+			record->addr6RRSet.rrs[j]->uloc = j;
 		}
+		uRawBytes += 40 * rec->naddr6s;
 	}
 
-	std::strcpy(s, HEADER_END_INDICATOR_LF);
-	s += sizeof(HEADER_END_INDICATOR_LF) - 1;
+	this->commit(record, uRawBytes);
+
+	return DLZ_OK;
+}
+
+/*
+	Add a parsed record to the chunk.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::commit(DNSRecordC *record, size_t uRawBytes) {
+	int nSlot;
+
+	if (!this->bAnswersCached) {
+		this->do_rraddr_sorting(record);
+	}
+	this->bAnswersCached = false;
+	this->do_time_differential(record);
+
+	if (ENABLE_LINE_SORTING) {
+		nSlot = this->uLineID - this->uRunBase - 1;
+		this->uQtypes[nSlot] = record->nQtype;
+		this->uQnameIDs[nSlot] = this->get_sort_id(this->qnameIDCache, this->qnameIDRecords,
+								HashBytes(FNV_OFFSET_BASIS, record->sQname.data(), record->sQname.size()), record, SameQname);
+		this->uSaddrIDs[nSlot] = this->get_sort_id(this->saddrIDCache, this->saddrIDRecords,
+								HashAddr(FNV_OFFSET_BASIS, record->saddr), record, SameSaddr);
+	}
+
+	if (ENABLE_FIELD_HIDDING && ENABLE_LEARNED_HIDING && record->sQname.size() > sizeof("65535")
+			&& (nSlot = HiddenPairSlot(record)) >= 0) {
+		this->uHiddenPairCounts[nSlot]++;
+	}
+
+	this->uChunkBytes += uRawBytes;
 
-	write(STDOUT_FILENO, b, s - b);
+	if (this->ctx.uMinLines > 0 && 1 == this->uLineID) {
+		this->nChunkStartUs = MonotonicUs();
+	}
+
+	assert(this->uLineID <= this->uChunkLines);
+	/* The buffer is full, flush it. */
+	if (this->uLineID == this->uChunkLines) {
+		this->Finish();
+	}
+	else if (this->uLineID - this->uRunBase == this->ctx.MemLines()
+				|| (this->ctx.nSpillFd >= 0 && !this->pool.HasRoom(2 * MAX_ALLOWED_RRSET_SIZE))) {
+		/* Only a run of the chunk fits in memory, or the answers of the next line may not. */
+		this->spill_run();
+	}
+	else if ((this->ctx.uMaxChunkBytes > 0 && this->uChunkBytes >= this->ctx.uMaxChunkBytes)
+				|| !this->pool.HasRoom(2 * MAX_ALLOWED_RRSET_SIZE)) {
+		/* The chunk is large enough, or the answers of the next line may not fit in the pool. */
+		this->Flush();
+	}
 	
+	return;
 }
 
-void DNSLogzipC::output_rraddr_locs(void) {
-	DNSRecordC *r;
-	char b[4096];
-	char *s;
-	const char *ef = b + sizeof(b) - MAX_ALLOWED_RRSET_SIZE * 2;
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::Finish(void) {
+	this->finish_chunk(false);
+}
 
-	if (!ENABLE_RRADDR_SORTING) {
+/*
+	Flush the chunk before it is full. The decoder would expect more lines,
+	so such a chunk ends with an indicator line.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::Flush(void) {
+	this->finish_chunk(true);
+}
+
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::finish_chunk(bool bTerminate) {
+	char b[32], *s;
+
+	if (0 == this->uLineID) {
 		return;
 	}
 
-	b[0] = 0;
-	s = b;
-	for (size_t i = 0; i < this->uLineID; ++i) {
-		r = this->records[i];			
+	/* An adaptive chunk starts with its number of lines, instead of ending with an indicator. */
+	if (this->ctx.uMinLines > 0) {
+		this->ctx.SetLocStrFixedLen(this->uLineID);
 
-		if (r->addr4RRSet.size > 1)
-			s = print_rraddr_locs(s, r->addr4RRSet);
+		s = dlz_itoa(b, this->uLineID);
+		*s++ = '\n';
+		this->emit(b, s - b);
+	}
 
-		if (r->addr6RRSet.size > 1)
-			s = print_rraddr_locs(s, r->addr6RRSet);
+	if (ENABLE_FIELD_HIDDING && ENABLE_LEARNED_HIDING) {
+		this->output_hidden_pairs();
+	}
 
-		/* Flush the line. */
-		if (s > ef) {
-			/* The last space should be removed. */
-			s--;
-			*s++ = '\n';
-			write(STDOUT_FILENO, b, s - b);
-			s = b;
-		}
+	if (this->runs.empty()) {
+		this->do_record_sorting();
+		/* Output compressed data */
+		this->output();
+	}
+	else {
+		this->spill_run();
+		this->output_runs();
 	}
 
-	if (s != b) {
-		/* The last space should be removed. */
-		s--;
+	if (bTerminate && 0 == this->ctx.uMinLines && this->uLineID < this->uChunkLines) {
+		this->emit(HEADER_END_INDICATOR "\n", sizeof(HEADER_END_INDICATOR));
 	}
 
-	std::strcpy(s, HEADER_END_INDICATOR_LF);
-	s += sizeof(HEADER_END_INDICATOR_LF) - 1;
+	this->flush_chunk();
 
-	write(STDOUT_FILENO, b, s - b);
-	
+	/* Chunks flushed early say little about the best size. */
+	if (this->ctx.uMinLines > 0 && this->uLineID == this->uChunkLines) {
+		this->adapt_chunk_lines();
+	}
+
+	for (size_t i = 0; i < this->uHiddenPairsLen; ++i) {
+		this->ucHiddenPairCodes[this->uHiddenPairs[i]] = HIDDEN_PAIR_NONE;
+	}
+	this->uHiddenPairsLen = 0;
+
+	/* Next time, process the first element in the buffer. */
+	this->uLineID = 0;
+	this->uChunkBytes = 0;
+	this->uChunkOutBytes = 0;
+	this->uDistinctQnames = 0;
+
+	this->pool.Reset();
+	this->uParseCacheGen++;
 }
 
-void DNSLogzipC::output(void) {
-	DNSRecordC *r, *pr;
-	char b[CHUCK_SIZE + 1024];
-	char *s = b;
-	const char *e = b + sizeof(b);
-	const char *ef = e - 1024;
+/*
+	Pick the size of the next chunk from the last one. It shrinks when the
+	last one took longer than the latency target or had mostly distinct
+	qnames, which sorting gains little from. Otherwise it keeps moving in
+	its direction, and turns back once the output bytes per line grow by
+	more than the noise between chunks of the same traffic.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::adapt_chunk_lines(void) {
+	double n = this->uLineID, dNext;
+	double dBytesPerLine = this->uChunkOutBytes / n;
+	double dElapsedMs = (MonotonicUs() - this->nChunkStartUs) / 1000.0;
+	double dCap = this->ctx.uLineSortingBufSize;
 
-	this->output_record_locs();
-	this->output_rraddr_locs();
+	if (this->ctx.uChunkLatencyMs > 0 && dElapsedMs > 0) {
+		/* The time of a chunk grows about linearly with its lines. */
+		dCap = std::min(dCap, n * this->ctx.uChunkLatencyMs / dElapsedMs);
+	}
 
-	for (size_t i = 0; i < this->uLineID; ++i) {
-		/* Reset vars */
-		r  = this->records[i];
-		pr = i > 0 ? this->records[i - 1] : NULL;
+	if (this->uDistinctQnames > ADAPT_MAX_DISTINCT_RATIO * n) {
+		this->nAdaptDir = -1;
+	}
+	else if (this->dLastBytesPerLine > 0 && dBytesPerLine > this->dLastBytesPerLine * (1 + ADAPT_TOLERANCE)) {
+		this->nAdaptDir = -this->nAdaptDir;
+	}
 
-		/* Print time */
-		if (ENABLE_NUM_ENCODING) {
-			s = ConvertBaseNumToText(r->nTimeSecDiff, s, 12);
-			assert(NULL != s);
-		}
-		else {
-			s = dlz_itoa(s, r->nTimeSecDiff);
-		}
+	dNext = this->nAdaptDir > 0 ? n * ADAPT_STEP : n / ADAPT_STEP;
+	dNext = std::min(dNext, dCap);
+	dNext = std::max(dNext, (double) this->ctx.uMinLines);
+	dNext = std::min(dNext, (double) this->ctx.uLineSortingBufSize);
 
-		*s++ = DNSLOGZIP_DELIMITER;
-		/* Print client address. */		
-		if (ENABLE_FIELD_REPLACEMENT && i > 0 
-						&& r->caddr == pr->caddr) {		
-			*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
+	this->dLastBytesPerLine = dBytesPerLine;
+	this->uChunkLines = dNext;
+}
+
+/*
+	Append b to the spill file.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::write_spill(std::string &b) {
+	const char *p = b.data();
+	size_t n = b.size();
+	ssize_t rc;
+
+	while (n > 0) {
+		rc = pwrite(this->ctx.nSpillFd, p, n, this->uSpillEnd);
+		if (rc <= 0) {
+			/* The chunk cannot be output without its runs. */
+			std::cerr << "error: failed to write the spill file: " << strerror(errno) << std::endl;
+			exit(1);
 		}
-		else {
-			s = this->print_sockaddr(s, r->caddr);
-		}	
-		
-		/* Print server address */
-		*s++ = DNSLOGZIP_DELIMITER;
-		if (ENABLE_FIELD_REPLACEMENT && i > 0 
-						&& r->saddr == pr->saddr) {
-			*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
+
+		p += rc;
+		n -= rc;
+		this->uSpillEnd += rc;
+	}
+
+	b.clear();
+}
+
+/*
+	Sort the records in memory and spill them as a run of the chunk.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::spill_run(void) {
+	uint32_t n = this->uLineID - this->uRunBase;
+	DNSRunC *run;
+	std::string b;
+
+	if (0 == n) {
+		return;
+	}
+
+	assert(this->ctx.nSpillFd >= 0);
+	run = new DNSRunC(this->uSpillEnd, this->uSpillEnd);
+
+	this->do_record_sorting();
+
+	b.reserve(SPILL_BLOCK_SIZE + PRINT_BUFFER_SIZE);
+	for (uint32_t i = 0; i < n; ++i) {
+		SpillRecord(b, this->records[i]);
+
+		if (b.size() >= SPILL_BLOCK_SIZE) {
+			this->write_spill(b);
 		}
-		else {		
-			s = this->print_sockaddr(s, r->saddr);
+	}
+
+	this->write_spill(b);
+	run->uEnd = this->uSpillEnd;
+	this->runs.push_back(run);
+
+	this->uRunBase = this->uLineID;
+	this->pool.Reset();
+	this->uParseCacheGen++;
+}
+
+/*
+	Read the next record of the run into its other slot.
+	Return false at the end of the run.
+*/
+template <unsigned int Mask>
+bool DNSLogzipC<Mask>::read_run(DNSRunC *run) {
+	uint32_t len = 0;
+	size_t uNeed = sizeof(len), uOld;
+	ssize_t rc;
+
+	for ( ;; ) {
+		if (run->buf.size() - run->pos >= uNeed) {
+			if (sizeof(len) == uNeed) {
+				memcpy(&len, run->buf.data() + run->pos, sizeof(len));
+				uNeed += len;
+				continue;
+			}
+
+			break;
 		}
-		
-		assert(s < e);
-	
-		/* Print hidden fields */
-		s = this->print_hidden_fields(s, r);
 
-		/* Print qname */
-		if (ENABLE_FIELD_REPLACEMENT && i > 0 && pr->sQname == r->sQname) {
-			*s++ = DNSLOGZIP_DELIMITER;
-			*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
+		if (run->uRead == run->uEnd) {
+			assert(run->pos == run->buf.size());
+			return false;
 		}
-		else {
-			*s++ = DNSLOGZIP_DELIMITER;
-			std::strcpy(s, r->sQname.c_str());
-			s += r->sQname.size();
+
+		/* Keep the partial record and read the next block. */
+		run->buf.erase(0, run->pos);
+		run->pos = 0;
+
+		uOld = run->buf.size();
+		run->buf.resize(uOld + std::max<size_t>(uNeed, SPILL_BLOCK_SIZE));
+		rc = pread(this->ctx.nSpillFd, &run->buf[uOld], std::min<off_t>(run->buf.size() - uOld, run->uEnd - run->uRead), run->uRead);
+		if (rc <= 0) {
+			std::cerr << "error: failed to read the spill file: " << strerror(errno) << std::endl;
+			exit(1);
 		}
-		
-		assert(s < e);
-		
-		/* Print cname. */
-		if (r->cnameRRSet.size > 0) {			
-			if (ENABLE_FIELD_REPLACEMENT && i > 0 && pr->cnameRRSet == r->cnameRRSet) {
-				*s++ = DNSLOGZIP_DELIMITER;
-				
-				if (ENABLE_NUM_ENCODING) {
-					s = ConvertBaseNumToText(r->cnameRRSet.type, s, 2);
-				}
-				else {
-					s = dlz_itoa(s, r->cnameRRSet.type);
-				}
 
-				*s++ = DNSLOGZIP_DELIMITER;
-				*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
-			}
-			else {
-				s = this->print_cnames(s, r->cnameRRSet);
-			}
+		run->buf.resize(uOld + rc);
+		run->uRead += rc;
+	}
+
+	run->iCur = 1 - run->iCur;
+	UnspillRecord(run->buf.data() + run->pos + sizeof(len), &run->records[run->iCur], *run->pools[run->iCur]);
+	run->pos += uNeed;
+
+	return true;
+}
+
+/*
+	Rewind the runs of the chunk and order them by their first record.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::open_runs(void) {
+	DNSRunC *run;
+
+	this->mergeHeap.clear();
+	this->pMergeRun = NULL;
+
+	for (size_t i = 0; i < this->runs.size(); ++i) {
+		run = this->runs[i];
+		run->uRead = run->uOffset;
+		run->buf.clear();
+		run->pos = 0;
+		run->iCur = 1;
+
+		if (this->read_run(run)) {
+			this->mergeHeap.push_back(run);
 		}
+	}
+
+	std::make_heap(this->mergeHeap.begin(), this->mergeHeap.end(),
+					ENABLE_LINE_SORTING ? CompareRunByRecord : CompareRunByID);
+}
+
+/*
+	Return the next record of the chunk in the order of the output, NULL at
+	its end. The record returned before stays valid until the next call.
+*/
+template <unsigned int Mask>
+const DNSRecordC* DNSLogzipC<Mask>::next_run_record(void) {
+	bool (*pfnCompare)(const DNSRunC*, const DNSRunC*) = ENABLE_LINE_SORTING ? CompareRunByRecord : CompareRunByID;
+	DNSRunC *run = this->pMergeRun;
+
+	/* Only move on the run of the last record now, as it is still in use. */
+	if (NULL != run && this->read_run(run)) {
+		this->mergeHeap.push_back(run);
+		std::push_heap(this->mergeHeap.begin(), this->mergeHeap.end(), pfnCompare);
+	}
 
-		assert(s < e);
+	if (this->mergeHeap.empty()) {
+		this->pMergeRun = NULL;
+		return NULL;
+	}
 
-		/* Print rdaddr4s */
-		if (r->addr4RRSet.size > 0) {
-			if (ENABLE_FIELD_REPLACEMENT && i > 0 && pr->addr4RRSet == r->addr4RRSet) {
-				*s++ = DNSLOGZIP_DELIMITER;
-				
-				if (ENABLE_NUM_ENCODING) {
-					s = ConvertBaseNumToText(r->addr4RRSet.type, s, 2);
-				}
-				else {
-					s = dlz_itoa(s, r->addr4RRSet.type);
-				}
+	std::pop_heap(this->mergeHeap.begin(), this->mergeHeap.end(), pfnCompare);
+	run = this->mergeHeap.back();
+	this->mergeHeap.pop_back();
+	this->pMergeRun = run;
 
-				*s++ = DNSLOGZIP_DELIMITER;
-				*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
-			}
-			else {	
-				s = this->print_rraddrs(s, r->addr4RRSet, r);
+	return &run->records[run->iCur];
+}
+
+/*
+	Output a chunk spilled in runs. The first merge prints the record
+	locations and spills the rraddr locations after the runs, the second
+	one prints the records. The output is handed over in pieces.
+*/
+template <unsigned int Mask>
+void DNSLogzipC<Mask>::output_runs(void) {
+	const DNSRecordC *r, *pr;
+	char lb[4096], ab[4096];
+	char *ls = lb, *as = ab, *s;
+	const char *lef = lb + sizeof(lb) - std::max<size_t>(this->ctx.ucLocStrFixedLen, MAX_VAR_TEXT_LEN);
+	const char *aef = ab + sizeof(ab) - 2 * (MAX_ALLOWED_RRSET_SIZE * 2 + MAX_VAR_TEXT_LEN);
+	off_t uAddrLocs = this->uSpillEnd;
+	std::string sAddrLocs;
+	ssize_t rc;
+
+	if (ENABLE_LINE_SORTING || ENABLE_RRADDR_SORTING) {
+		assert(this->ctx.ucLocStrFixedLen < sizeof(this->ctx.muls) / sizeof(this->ctx.muls[0]));
+		assert(this->uLineID < this->ctx.muls[this->ctx.ucLocStrFixedLen]);
+
+		pr = NULL;
+		this->uSortedRRSets = 0;
+		this->open_runs();
+		while (NULL != (r = this->next_run_record())) {
+			if (ENABLE_LINE_SORTING) {
+				ls = this->print_record_loc(ls, r, pr);
+				if (ls >= lef) {
+					*ls++ = '\n';
+					this->emit(lb, ls - lb);
+					ls = lb;
+				}
 			}
-		}
 
-		assert(s < e);
+			if (ENABLE_RRADDR_SORTING) {
+				as = print_rraddr_locs(as, r);
 
-		/* Print rdaddr6s */
-		if (r->addr6RRSet.size > 0) {
-			if (ENABLE_FIELD_REPLACEMENT && i > 0 && pr->addr6RRSet == r->addr6RRSet) {
-				*s++ = DNSLOGZIP_DELIMITER;
+				if (as > aef) {
+					/* The last space should be removed. */
+					as--;
+					*as++ = '\n';
+					sAddrLocs.append(ab, as - ab);
+					as = ab;
 
-				if (ENABLE_NUM_ENCODING) {
-					s = ConvertBaseNumToText(r->addr6RRSet.type, s, 3);					
+					if (sAddrLocs.size() >= SPILL_BLOCK_SIZE) {
+						this->write_spill(sAddrLocs);
+					}
 				}
-				else {
-					s = dlz_itoa(s, r->addr6RRSet.type);
-				}
-
-				*s++ = DNSLOGZIP_DELIMITER;
-				*s++ = FIELD_REPLACEMENT_FLAG_CHAR;
 			}
-			else {
-				s = this->print_rraddrs(s, r->addr6RRSet, r);
+
+			if (this->outBuf.size() >= SPILL_BLOCK_SIZE) {
+				this->flush_chunk();
 			}
-		}
 
-		*s++ = '\n';
-		assert(s < e);
-		
-		if (s > ef) {
-			write(STDOUT_FILENO, b, s - b);
-			s = b;
+			pr = r;
 		}
-	}
 
-	if (s != b) {
-		write(STDOUT_FILENO, b, s - b);
-	}
-}
+		if (ENABLE_LINE_SORTING) {
+			std::strcpy(ls, HEADER_END_INDICATOR_LF);
+			ls += sizeof(HEADER_END_INDICATOR_LF) - 1;
+			this->emit(lb, ls - lb);
+		}
 
-inline void DNSLogzipC::do_rraddr_sorting(DNSRecordC *r) {	
-	if (r->addr4RRSet.size > 1) {
-		if (ENABLE_RRADDR_SORTING || ENABLE_ADDR_DIFFERENCE)
-			std::sort(r->addr4RRSet.rrs, r->addr4RRSet.rrs + r->addr4RRSet.size, CompareRRAddr);
-	}
-	
-	if (r->addr6RRSet.size > 1) {
-		if (ENABLE_RRADDR_SORTING || ENABLE_ADDR_DIFFERENCE)
-			std::sort(r->addr6RRSet.rrs, r->addr6RRSet.rrs + r->addr6RRSet.size, CompareRRAddr);
-	}
-}
+		if (ENABLE_RRADDR_SORTING) {
+			if (as != ab) {
+				/* The last space should be removed. */
+				as--;
+			}
 
-inline void DNSLogzipC::do_record_sorting(void)
-{
-	if (ENABLE_LINE_SORTING) {
-		std::sort(this->records, this->records + this->uLineID, CompareDNSRecord);
-	}
-}
+			std::strcpy(as, HEADER_END_INDICATOR_LF);
+			as += sizeof(HEADER_END_INDICATOR_LF) - 1;
+			sAddrLocs.append(ab, as - ab);
+			this->write_spill(sAddrLocs);
 
-inline void DNSLogzipC::do_time_differential(DNSRecordC *r)
-{
-	if (ENABLE_TIME_DIFFERENCE && this->uLineID > 1) {
-		r->nTimeSecDiff  = r->nTimeSec - this->records[this->uLineID - 2]->nTimeSec;
-		assert(r->nTimeSecDiff >= 0);
-	}
-	else {
-		r->nTimeSecDiff = r->nTimeSec;
-	}
-}
+			/* Copy the rraddr locations to the output. */
+			sAddrLocs.resize(SPILL_BLOCK_SIZE);
+			for (off_t uOff = uAddrLocs; uOff < this->uSpillEnd; uOff += rc) {
+				this->flush_chunk();
 
-void DNSLogzipC::Process(dlz_row_t *row) {
-	DNSRecordC *record  = this->records[this->uLineID];
+				rc = pread(this->ctx.nSpillFd, &sAddrLocs[0], std::min<off_t>(SPILL_BLOCK_SIZE, this->uSpillEnd - uOff), uOff);
+				if (rc <= 0) {
+					std::cerr << "error: failed to read the spill file: " << strerror(errno) << std::endl;
+					exit(1);
+				}
 
-	if (row->ncols < 3) {
-		return;
+				this->emit(sAddrLocs.data(), rc);
+			}
+		}
 	}
 
-	this->uLineID++;
-	this->initialize_record(record);
-	this->parse(row, record);
-	
-	this->do_rraddr_sorting(record);
-	this->do_time_differential(record);
+	pr = NULL;
+	s = this->textBuf.data();
+	this->open_runs();
+	while (NULL != (r = this->next_run_record())) {
+		s = this->text_room(s, RecordTextBound(r));
+		s = this->print_record(s, r, pr);
+		pr = r;
 
-	assert(this->uLineID <= g_uLineSortingBufSize);
-	/* The buffer is full, flush it. */
-	if (this->uLineID == g_uLineSortingBufSize) {
-		this->Finish();
+		if (this->outBuf.size() >= SPILL_BLOCK_SIZE) {
+			this->flush_chunk();
+		}
 	}
-	
-	return;
-}
 
-void DNSLogzipC::Finish(void) {
-	if (0 == this->uLineID) {
-		return;
+	if (s != this->textBuf.data()) {
+		this->emit(this->textBuf.data(), s - this->textBuf.data());
 	}
 
-	this->do_record_sorting();
-	/* Output compressed data */
-	this->output();
-	/* Next time, process the first element in the buffer. */
-	this->uLineID = 0;
+	/* The spill file is reused by the next chunk. */
+	for (size_t i = 0; i < this->runs.size(); ++i) {
+		delete this->runs[i];
+	}
 
-	PoolReset();
+	this->runs.clear();
+	this->uRunBase = 0;
+	this->uSpillEnd = 0;
 }
 
-DNSLogzipD::DNSLogzipD(void) : DNSLogzip(){
-	PoolInit();
-
-	this->records = new DNSRecordD* [g_uLineSortingBufSize];
-	DNSRecordD *p = new DNSRecordD  [g_uLineSortingBufSize];
+template <unsigned int Mask>
+DNSLogzipD<Mask>::DNSLogzipD(const DNSLogzipCtx &ctx) : DNSLogzip(ctx) {
+	this->records = new DNSRecordD* [this->ctx.uLineSortingBufSize];
+	this->recordElems = new DNSRecordD [this->ctx.uLineSortingBufSize];
 	
-	for (unsigned i = 0; i < g_uLineSortingBufSize; ++i) {
-		this->records[i] = p++; 
+	for (unsigned i = 0; i < this->ctx.uLineSortingBufSize; ++i) {
+		this->records[i] = &this->recordElems[i]; 
 	}
 
-	this->recordElems = p;
+	this->addrLocs.resize(2 * this->ctx.uLineSortingBufSize);
 
+	this->recordLocsLen = 0;
+	this->addrLocsLen = 0;
+	this->uReadyLines = 0;
+	this->uHiddenPairsLen = 0;
+	this->bReadChunkLinesDone = false;
+	this->bReadHiddenPairsDone = false;
 	this->bReadRecordLocDone = false;
 	this->bReadAddrLocDone   = false;
 	
 	return;
 }
 
-DNSLogzipD::~DNSLogzipD() {
+template <unsigned int Mask>
+DNSLogzipD<Mask>::~DNSLogzipD() {
 	delete [] this->recordElems;
 	delete [] this->records;
 }
 
-void DNSLogzipD::Process(dlz_row_t *row) {
+template <unsigned int Mask>
+int DNSLogzipD<Mask>::Process(dlz_row_t *row) {
 	DNSRecordD *record  = this->records[this->uLineID];
+
+	/* The records of the last chunk must be released first. */
+	assert(0 == this->uReadyLines);
+
+	if (this->ctx.uMinLines > 0 && !this->bReadChunkLinesDone) {
+		this->parse_chunk_lines(row);
+		return DLZ_OK;
+	}
+
+	if (ENABLE_FIELD_HIDDING && ENABLE_LEARNED_HIDING && !this->bReadHiddenPairsDone) {
+		this->parse_hidden_pairs(row);
+		return DLZ_OK;
+	}
 	
 	if (ENABLE_LINE_SORTING && !this->bReadRecordLocDone) {
 		this->parse_record_locs(row);
-		return;
+		return DLZ_OK;
 	}
 
 	if ((ENABLE_RRADDR_SORTING || ENABLE_ADDR_DIFFERENCE) && !this->bReadAddrLocDone) {
 		this->parse_rraddr_locs(row);
-		return;
+		return DLZ_OK;
+	}
+
+	/* The chunk was flushed early by the encoder. */
+	if (1 == row->ncols && sizeof(HEADER_END_INDICATOR) - 1 == row->cols[0].len && 
+			0 == std::strncmp(row->cols[0].data, HEADER_END_INDICATOR, sizeof(HEADER_END_INDICATOR) - 1)) {
+		this->Finish();
+		return DLZ_OK;
 	}
 
 	if (row->ncols < 3) {
-		return;
+		return DLZ_OK;
 	}
 
 	/* Parse the row and fill the record. */
 	this->parse(row, record);
 
 	++this->uLineID;
-	assert(this->uLineID <= g_uLineSortingBufSize);
-	if (this->uLineID == g_uLineSortingBufSize) {
+	assert(this->uLineID <= this->uChunkLines);
+	if (this->uLineID == this->uChunkLines) {
 		this->Finish();
 	}
+
+	return DLZ_OK;
 }
 
-void DNSLogzipD::Finish(void) {
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::Finish(void) {
 	if (0 == this->uLineID) {
 		return;
 	}
 
+	/* The chunk is kept until the records are released. */
+	if (this->uReadyLines > 0) {
+		return;
+	}
+
 	this->restore_rraddrs();
+	this->restore_records();
+
+	if (this->ctx.bRecordMode) {
+		this->uReadyLines = this->uLineID;
+		return;
+	}
+
 	this->output();
+	this->flush_chunk();
+	this->ReleaseRecords();
+}
+
+template <unsigned int Mask>
+size_t DNSLogzipD<Mask>::ReadyRecords(void) {
+	return this->uReadyLines;
+}
+
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::ReleaseRecords(void) {
+	this->uReadyLines = 0;
 	this->uLineID = 0;
 	this->addrLocsLen = 0;
+	this->refRRSets.clear();
+	this->bReadChunkLinesDone = 0;
+	this->bReadHiddenPairsDone = 0;
 	this->bReadRecordLocDone = 0;
 	this->bReadAddrLocDone = 0;
 
-	PoolReset();
+	this->pool.Reset();
+}
+
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::GetRecord(size_t i, dlz_record_t *rec) {
+	const DNSRecordD *r;
+
+	assert(i < this->uReadyLines);
+	r = this->records[i];
+
+	rec->time = r->nTime / TIME_SCALES[this->ctx.ucTimePrecision];
+	rec->nsec = r->nTime % TIME_SCALES[this->ctx.ucTimePrecision]
+				* TIME_SCALES[MAX_TIME_PRECISION - this->ctx.ucTimePrecision];
+	this->restore_sockaddr(r->sClientIP, &rec->client);
+	this->restore_sockaddr(r->sServerIP, &rec->server);
+	rec->qtype = this->restore_num(r->sQtype);
+	rec->rcode = this->restore_num(r->sRcode);
+
+	rec->qname.data = r->sQname.data();
+	rec->qname.len  = r->sQname.size();
+
+	rec->ncnames = r->cnameRRSet.size;
+	rec->naddr4s = r->addr4RRSet.size;
+	rec->naddr6s = r->addr6RRSet.size;
+	rec->priv = r;
 }
 
-inline char* DNSLogzipD::print_sockaddr(char *s, const std::string &text)
+template <unsigned int Mask>
+inline char* DNSLogzipD<Mask>::print_sockaddr(char *s, const std::string &text)
 {
 	size_t n = text.size() > 5 ? 5 : text.size();
 	bool isIPv6 = false;
@@ -947,13 +2439,14 @@ inline char* DNSLogzipD::print_sockaddr(char *s, const std::string &text)
 	}
 	else {
 		struct in_addr in;
-		in.s_addr = ConvertTextToBaseNum(text);
+		in.s_addr = ConvertTextToBaseNum(text, this->ctx);
 
 		return dlz_inet_ntop(AF_INET, &in, s, INET_ADDRSTRLEN);
 	}
 }
 
-inline char* DNSLogzipD::print_cnames(char *s, const StrDNSRRSet &rrset)
+template <unsigned int Mask>
+inline char* DNSLogzipD<Mask>::print_cnames(char *s, const StrDNSRRSet &rrset)
 {
 	if (0 == rrset.size) {
 		return s;
@@ -974,7 +2467,8 @@ inline char* DNSLogzipD::print_cnames(char *s, const StrDNSRRSet &rrset)
 	return s;
 }
 
-inline char* DNSLogzipD::print_rraddrs(char *s, const AddrDNSRRSet &rrset) {
+template <unsigned int Mask>
+inline char* DNSLogzipD<Mask>::print_rraddrs(char *s, const AddrDNSRRSet &rrset) {
 
 	if (0 == rrset.size) {
 		return s;
@@ -1007,93 +2501,94 @@ inline char* DNSLogzipD::print_rraddrs(char *s, const AddrDNSRRSet &rrset) {
 	return s;
 }
 
-void DNSLogzipD::output(void) {
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::output(void) {
 	DNSRecordD *r;
-	
-	char b[CHUCK_SIZE + 1024];
-	char *s = b;
-	const char *e = b + sizeof(b);
-
-	/* Sort by ID */
-	if (ENABLE_LINE_SORTING) {
-		std::sort(this->records, this->records + this->uLineID, 
-					[](const DNSRecordD* first, const DNSRecordD* second) { return first->nID < second->nID; });
-	}
+	char *s = this->textBuf.data();
 
 	for (size_t i = 0; i < this->uLineID; ++i) {
 		/* Reset vars */
 		r = this->records[i];
+		s = this->text_room(s, RecordTextBound(r));
 
 		/* Print time */
-		if (ENABLE_TIME_DIFFERENCE && i > 0) {
-			r->nTimeSec  += this->records[i - 1]->nTimeSec;
-		}
-
-		s = dlz_itoa(s, r->nTimeSec);
-		assert(s < e);
+		s = ConvertTimeToText(r->nTime, s, this->ctx);
 
 		*s++ = RAW_LOG_DELIMITER;
 		/* Print client address. */
 		s = this->print_sockaddr(s, r->sClientIP);
-		assert(s < e);
 
 		*s++ = RAW_LOG_DELIMITER;
 		/* Print server address */
 		s = this->print_sockaddr(s, r->sServerIP);
-		assert(s < e);
 
 		/* Print qtype */
 		*s++ = RAW_LOG_DELIMITER;
-		if (ENABLE_NUM_ENCODING) {
-			s = dlz_itoa(s, ConvertTextToBaseNum(r->sQtype));
-		}
-		else {
-			s = dlz_itoa(s, std::stoi(r->sQtype));
-		}
-		assert(s < e);
+		s = dlz_itoa(s, this->restore_num(r->sQtype));
 
 		*s++ = RAW_LOG_DELIMITER;
-		if (ENABLE_NUM_ENCODING) {
-			s = dlz_itoa(s, ConvertTextToBaseNum(r->sRcode));
-		}
-		else {
-			s = dlz_itoa(s, std::stoi(r->sRcode));
-		}
-		assert(s < e);
+		s = dlz_itoa(s, this->restore_num(r->sRcode));
 
 		/* Print qname */
 		*s++ = RAW_LOG_DELIMITER;
 		std::strcpy(s, r->sQname.c_str());
 		s += r->sQname.size();
-		assert(s < e);
 
 		/* Print cname. */
 		s = this->print_cnames(s, r->cnameRRSet);
-		assert(s < e);
 
 		/* Print rdaddr4s */
 		s = this->print_rraddrs(s, r->addr4RRSet);
-		assert(s < e);
 
 		/* Print rdaddr6s */
 		s = this->print_rraddrs(s, r->addr6RRSet);
 
 		*s++ = '\n';
-		assert(s < e);
+	}
 
-		if (e - s < 1024) {
-			write(STDOUT_FILENO, b, s - b);
-			s = b;
-		}
+	if (s != this->textBuf.data()) {
+		this->emit(this->textBuf.data(), s - this->textBuf.data());
 	}
+}
 
-	if (s != b) {
-		write(STDOUT_FILENO, b, s - b);
+/*
+	Parse the number of lines an adaptive chunk starts with.
+*/
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::parse_chunk_lines(const dlz_row_t *row) {
+	int64_t n;
+
+	assert(row->ncols == 1);
+	n = dlz_atoi(row->cols[0]);
+	assert(n > 0 && n <= this->ctx.uLineSortingBufSize);
+
+	this->uChunkLines = n;
+	this->ctx.SetLocStrFixedLen(n);
+	this->bReadChunkLinesDone = true;
+}
+
+/*
+	Parse the (qtype, rcode) pairs of the chunk header, see
+	DNSLogzipC::output_hidden_pairs().
+*/
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::parse_hidden_pairs(const dlz_row_t *row) {
+	int64_t n;
+
+	n = dlz_atoi(row->cols[0]);
+	assert(n >= 0 && n <= MAX_HIDDEN_PAIRS && row->ncols == 1 + 2 * n);
+
+	for (int64_t i = 0; i < n; ++i) {
+		this->sHiddenQtypes[i].assign(row->cols[1 + 2 * i].data, row->cols[1 + 2 * i].len);
+		this->sHiddenRcodes[i].assign(row->cols[2 + 2 * i].data, row->cols[2 + 2 * i].len);
 	}
+
+	this->uHiddenPairsLen = n;
+	this->bReadHiddenPairsDone = true;
 }
 
-void DNSLogzipD::parse_record_locs(const dlz_row_t *row) {
-	static uint64_t snCount = 0;
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::parse_record_locs(const dlz_row_t *row) {
 	size_t i = 0, j = 0;
 
 	assert(row->ncols == 1);
@@ -1102,24 +2597,31 @@ void DNSLogzipD::parse_record_locs(const dlz_row_t *row) {
 	if (sizeof(HEADER_END_INDICATOR) - 1 == row->cols[0].len && 
 			0 == std::strncmp(row->cols[0].data, HEADER_END_INDICATOR, sizeof(HEADER_END_INDICATOR) - 1)) {
 		this->bReadRecordLocDone = true;
-		snCount = 0;
+		this->recordLocsLen = 0;
+		return;
+	}
+
+	/* Gaps can only be told from IDs once the groups of records are known. */
+	if (ENABLE_LOC_DELTA) {
+		this->sRecordLocs.append(row->cols[0].data, row->cols[0].len);
 		return;
 	}
 
-	for (i = 0; i < row->cols[0].len; i += g_ucLocStrFixedLen) {
+	for (i = 0; i < row->cols[0].len; i += this->ctx.ucLocStrFixedLen) {
 
 		// Trim zero.
-		j = i + g_ucLocStrFixedLen - 1;		
+		j = i + this->ctx.ucLocStrFixedLen - 1;		
 		while ('0' == row->cols[0].data[j]) j--;
 
-		assert(snCount <= g_uLineSortingBufSize);
-		this->records[snCount++]->nID = ConvertTextToBaseNum(&row->cols[0].data[i], j + 1 - i);
+		assert(this->recordLocsLen <= this->uChunkLines);
+		this->records[this->recordLocsLen++]->nID = ConvertTextToBaseNum(&row->cols[0].data[i], j + 1 - i, this->ctx);
 	}
 	
 	assert(i == row->cols[0].len);
 }
 
-void DNSLogzipD::parse_rraddr_locs(const dlz_row_t *row) {
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::parse_rraddr_locs(const dlz_row_t *row) {
 
 	assert(false == this->bReadAddrLocDone);	
 	if (sizeof(HEADER_END_INDICATOR) - 1 == row->cols[0].len && 
@@ -1129,14 +2631,18 @@ void DNSLogzipD::parse_rraddr_locs(const dlz_row_t *row) {
 	}
 
 	for (int i = 0; i < row->ncols; ++i) {
-		addrLocs[this->addrLocsLen++].assign(row->cols[i].data, row->cols[i].len);
-		assert(this->addrLocsLen < sizeof(this->addrLocs));
+		assert(this->addrLocsLen < this->addrLocs.size());
+		this->addrLocs[this->addrLocsLen++].assign(row->cols[i].data, row->cols[i].len);
 	}
 }
 
-void DNSLogzipD::parse(dlz_row_t *row, DNSRecordD *record) {
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::parse(dlz_row_t *row, DNSRecordD *record) {
 	int i, k = 0;
 	uint8_t type, size;
+	bool bNegative;
+	const char *p;
+	uint64_t n;
 	DNSRecordD *precord = NULL;
 	
 	assert(row->ncols >= 4);
@@ -1150,17 +2656,31 @@ void DNSLogzipD::parse(dlz_row_t *row, DNSRecordD *record) {
 	record->cnameRRSet.size = 0;
 
 	/* Parse time. */
+	bNegative = row->cols[0].len > 1 && TIME_NEGATIVE_FLAG_CHAR == row->cols[0].data[0];
+	if (bNegative) {
+		row->cols[0].data++;
+		row->cols[0].len--;
+	}
+
 	if (ENABLE_NUM_ENCODING) {
-		record->nTimeSec = ConvertTextToBaseNum(row->cols[0]);	
+		record->nTime = ConvertTextToBaseNum(row->cols[0], this->ctx);	
 	}
 	else {
-		record->nTimeSec = dlz_atoi(row->cols[0]);
+		record->nTime = dlz_atoi(row->cols[0]);
+	}
+
+	if (bNegative) {
+		record->nTime = -record->nTime;
 	}
 
 	/* Client IP Address. Maybe an encoding number. */
 	if (FILED_REPLACED(row->cols[1])) {
 		record->sClientIP = precord->sClientIP;
 	}
+	else if ((ENABLE_IPV6_PREFIX || ENABLE_ADDR_XOR) && row->cols[1].len > 0
+			&& ADDR_DELTA_FLAG_CHAR == row->cols[1].data[0]) {
+		this->restore_addr_delta(row->cols[1], precord->sClientIP, record->sClientIP);
+	}
 	else {
 		record->sClientIP.assign(row->cols[1].data, row->cols[1].len);
 	}
@@ -1169,6 +2689,10 @@ void DNSLogzipD::parse(dlz_row_t *row, DNSRecordD *record) {
 	if (FILED_REPLACED(row->cols[2])) {
 		record->sServerIP = precord->sServerIP;
 	}
+	else if ((ENABLE_IPV6_PREFIX || ENABLE_ADDR_XOR) && row->cols[2].len > 0
+			&& ADDR_DELTA_FLAG_CHAR == row->cols[2].data[0]) {
+		this->restore_addr_delta(row->cols[2], precord->sServerIP, record->sServerIP);
+	}
 	else {
 		record->sServerIP.assign(row->cols[2].data, row->cols[2].len);
 	}
@@ -1192,24 +2716,41 @@ void DNSLogzipD::parse(dlz_row_t *row, DNSRecordD *record) {
 
 		/* Read type. */
 		if (ENABLE_NUM_ENCODING) {
-			type = ConvertTextToBaseNum(row->cols[k++]);
+			type = ConvertTextToBaseNum(row->cols[k++], this->ctx);
 		}
 		else {
 			type = dlz_atoi(row->cols[k++]);
 		}
 		assert(type <= 47);
 
-		if (FILED_REPLACED(row->cols[k])) {
+		if (ENABLE_RRSET_REFS && RRSET_REF_FLAG_CHAR == row->cols[k].data[0]) {
+			p = row->cols[k].data + 1;
+			n = ConvertVarTextToNum(&p, row->cols[k].data + row->cols[k].len);
+			assert(n < this->refRRSets.size() && this->refRRSets[n]->type == type);
+
+			if (DNS_TYPE_A == type) {
+				record->addr4RRSet.CopyFrom(*(const AddrDNSRRSet *) this->refRRSets[n], this->pool);
+			}
+			else if (DNS_TYPE_AAAA == type) {
+				record->addr6RRSet.CopyFrom(*(const AddrDNSRRSet *) this->refRRSets[n], this->pool);
+			}
+			else {
+				record->cnameRRSet.CopyFrom(*(const StrDNSRRSet *) this->refRRSets[n], this->pool);
+			}
+
+			++k;
+		}
+		else if (FILED_REPLACED(row->cols[k])) {
 			if (DNS_TYPE_A == type) {
 				/* IPv4 */
-				record->addr4RRSet = precord->addr4RRSet;
+				record->addr4RRSet.CopyFrom(precord->addr4RRSet, this->pool);
 			}
 			else if (DNS_TYPE_AAAA == type) {
 				/* IPv6 */
-				record->addr6RRSet = precord->addr6RRSet;
+				record->addr6RRSet.CopyFrom(precord->addr6RRSet, this->pool);
 			}
 			else if (DNS_TYPE_CNAME == type) {
-				record->cnameRRSet = precord->cnameRRSet;
+				record->cnameRRSet.CopyFrom(precord->cnameRRSet, this->pool);
 			}
 			else {
 				assert(0);
@@ -1220,44 +2761,56 @@ void DNSLogzipD::parse(dlz_row_t *row, DNSRecordD *record) {
 		else {
 
 			if (ENABLE_NUM_ENCODING) {
-				size = ConvertTextToBaseNum(row->cols[k++]);
+				size = ConvertTextToBaseNum(row->cols[k++], this->ctx);
 			}
 			else {
 				size = dlz_atoi(row->cols[k++]);
 			}
-			assert(size > 0 && size < MAX_ALLOWED_RRSET_SIZE && row->ncols >= k + size);
+			assert(size > 0 && size <= MAX_ALLOWED_RRSET_SIZE && row->ncols >= k + size);
 
 			if (DNS_TYPE_A == type) {
 				/* IPv4 */
 				record->addr4RRSet.type = type;
 				record->addr4RRSet.size = size;
-				record->addr4RRSet.rrs = PoolGetNAddrRR(size);
+				record->addr4RRSet.rrs = this->pool.GetNAddrRR(size);
 
 				for (i = 0; i < size; ++i) {
 					record->addr4RRSet.rrs[i]->sVal.assign(row->cols[k].data, row->cols[k].len);
 					++k;
 				}
+
+				if (ENABLE_RRSET_REFS) {
+					this->refRRSets.push_back(&record->addr4RRSet);
+				}
 			}
 			else if (DNS_TYPE_AAAA == type) {
 				/* IPv6 */
 				record->addr6RRSet.type = type;
 				record->addr6RRSet.size = size;
-				record->addr6RRSet.rrs = PoolGetNAddrRR(size);
+				record->addr6RRSet.rrs = this->pool.GetNAddrRR(size);
 
 				for (i = 0; i < size; ++i) {
 					record->addr6RRSet.rrs[i]->sVal.assign(row->cols[k].data, row->cols[k].len);
 					++k;
 				}
+
+				if (ENABLE_RRSET_REFS) {
+					this->refRRSets.push_back(&record->addr6RRSet);
+				}
 			}
 			else if (DNS_TYPE_CNAME == type) {
 				record->cnameRRSet.type = type;
 				record->cnameRRSet.size = size;
-				record->cnameRRSet.rrs = PoolGetNStrRR(size);
+				record->cnameRRSet.rrs = this->pool.GetNStrRR(size);
 
 				for (i = 0; i < size; ++i) {
 					(*record->cnameRRSet.rrs[i]).assign(row->cols[k].data, row->cols[k].len);
 					++k;
 				}
+
+				if (ENABLE_RRSET_REFS) {
+					this->refRRSets.push_back(&record->cnameRRSet);
+				}
 			}
 			else {
 				assert(0);
@@ -1268,15 +2821,37 @@ void DNSLogzipD::parse(dlz_row_t *row, DNSRecordD *record) {
 	return;
 }
 
-void DNSLogzipD::restore_hidden_fields(dlz_row_t *row, DNSRecordD *r, int &k) 
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::restore_hidden_fields(dlz_row_t *row, DNSRecordD *r, int &k) 
 {
+	const char *p;
+	uint64_t n;
+
 	if (ENABLE_FIELD_HIDDING && 
 			(row->cols[k].len > 5 || FILED_REPLACED(row->cols[k]))) {
+		if (ENABLE_LEARNED_HIDING) {
+			assert(this->uHiddenPairsLen > 0);
+			r->sQtype = this->sHiddenQtypes[0];
+			r->sRcode = this->sHiddenRcodes[0];
+			return;
+		}
+
 		r->sQtype = "1";
 		r->sRcode = "0";
 		return;
 	}
 
+	if (ENABLE_FIELD_HIDDING && ENABLE_LEARNED_HIDING && HIDDEN_PAIR_FLAG_CHAR == row->cols[k].data[0]) {
+		p = row->cols[k].data + 1;
+		n = ConvertVarTextToNum(&p, row->cols[k].data + row->cols[k].len);
+		assert(n < this->uHiddenPairsLen);
+
+		r->sQtype = this->sHiddenQtypes[n];
+		r->sRcode = this->sHiddenRcodes[n];
+		k++;
+		return;
+	}
+
 	r->sQtype.assign(row->cols[k].data, row->cols[k].len);
 	k++;
 
@@ -1290,10 +2865,124 @@ void DNSLogzipD::restore_hidden_fields(dlz_row_t *row, DNSRecordD *r, int &k)
 	k++;
 }
 
-void DNSLogzipD::restore_rraddrs(void) {
+/*
+	Restore the line IDs written by print_record_loc() with ENABLE_LOC_DELTA:
+	a group of records with the same qname, qtype and server starts with its
+	first ID, the others follow as gaps.
+*/
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::restore_record_locs(void) {
+	const char *p = this->sRecordLocs.data(), *e = p + this->sRecordLocs.size();
+	DNSRecordD *r, *pr = NULL;
+	size_t j;
+
+	for (size_t i = 0; i < this->uLineID; ++i) {
+		r = this->records[i];
+
+		if (NULL != pr && pr->sQname == r->sQname && pr->sQtype == r->sQtype && pr->sServerIP == r->sServerIP) {
+			r->nID = pr->nID + 1 + ConvertVarTextToNum(&p, e);
+		}
+		else {
+			assert(p + this->ctx.ucLocStrFixedLen <= e);
+
+			// Trim zero.
+			j = this->ctx.ucLocStrFixedLen - 1;
+			while ('0' == p[j]) j--;
+
+			r->nID = ConvertTextToBaseNum(p, j + 1, this->ctx);
+			p += this->ctx.ucLocStrFixedLen;
+		}
+
+		pr = r;
+	}
+
+	assert(p == e);
+	this->sRecordLocs.clear();
+}
+
+/*
+	Put the records back in the original order and restore the absolute time.
+*/
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::restore_records(void) {
+	if (ENABLE_LINE_SORTING && ENABLE_LOC_DELTA) {
+		this->restore_record_locs();
+	}
+
+	/* Sort by ID */
+	if (ENABLE_LINE_SORTING) {
+		std::sort(this->records, this->records + this->uLineID, 
+					[](const DNSRecordD* first, const DNSRecordD* second) { return first->nID < second->nID; });
+	}
+
+	if (ENABLE_TIME_DIFFERENCE) {
+		for (size_t i = 1; i < this->uLineID; ++i) {
+			this->records[i]->nTime += this->records[i - 1]->nTime;
+		}
+	}
+}
+
+template <unsigned int Mask>
+inline uint64_t DNSLogzipD<Mask>::restore_num(const std::string &text) {
+	if (ENABLE_NUM_ENCODING) {
+		return ConvertTextToBaseNum(text, this->ctx);
+	}
+	else {
+		return std::stoi(text);
+	}
+}
+
+/*
+	Convert a client or server address column to binary, see print_sockaddr().
+*/
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::restore_sockaddr(const std::string &text, struct sockaddr_storage *addr) {
+	if (ENABLE_NUM_ENCODING && std::string::npos == text.find(':')) {
+		addr->ss_family = AF_INET;
+		((struct sockaddr_in *)addr)->sin_addr.s_addr = ConvertTextToBaseNum(text, this->ctx);
+	}
+	else {
+		ConvertTextToAddr(text, addr);
+	}
+}
+
+/*
+	Restore the text of a client or server address written against ref, the
+	address of the record before, see DNSLogzipC::print_sockaddr(). The text
+	is in the form of an address written on its own.
+*/
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::restore_addr_delta(const dlz_str_t &col, const std::string &ref, std::string &text) {
+	struct sockaddr_storage addr, raddr;
+	const char *p = col.data + 1;
+	char b[INET6_ADDRSTRLEN];
+
+	this->restore_sockaddr(ref, &raddr);
+	addr.ss_family = raddr.ss_family;
+
+	if (AF_INET6 == raddr.ss_family) {
+		ConvertPrefixTextToAddr6(col.data, col.len, ((struct sockaddr_in6 *)&raddr)->sin6_addr,
+						&((struct sockaddr_in6 *)&addr)->sin6_addr);
+		text.assign(b, ConvertAddrToText(&addr, b, sizeof(b), AF_INET6) - b);
+		return;
+	}
+
+	((struct sockaddr_in *)&addr)->sin_addr.s_addr = ((struct sockaddr_in *)&raddr)->sin_addr.s_addr
+					^ htonl(ConvertVarTextToNum(&p, col.data + col.len));
+	if (ENABLE_NUM_ENCODING) {
+		text.assign(b, ConvertBaseNumToText(((struct sockaddr_in *)&addr)->sin_addr.s_addr, b, INET_ADDRSTRLEN, this->ctx) - b);
+	}
+	else {
+		text.assign(b, ConvertAddrToText(&addr, b, sizeof(b), AF_INET) - b);
+	}
+}
+
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::restore_rraddrs(void) {
 	DNSRecordD *r;
 	size_t locID = 0;
 
+	this->nSortedRRSets = -1;
 	for (size_t i = 0; i < this->uLineID; ++i) {
 		r = this->records[i];
 
@@ -1301,14 +2990,12 @@ void DNSLogzipD::restore_rraddrs(void) {
 		restore_addr_vals(r->addr6RRSet, AF_INET6);
 
 		if (ENABLE_ADDR_DIFFERENCE || ENABLE_RRADDR_SORTING) {
-			if (r->addr4RRSet.size > 1) {
-				restore_addr_locs(r->addr4RRSet, locID);
+			if (r->addr4RRSet.size > 1 && !restore_addr_locs(r->addr4RRSet, locID)) {
 				std::sort(r->addr4RRSet.rrs, r->addr4RRSet.rrs + r->addr4RRSet.size, 
 					[](const struct RRAddr* first, const struct RRAddr* second) { return first->uloc < second->uloc;});
 			}
 
-			if (r->addr6RRSet.size > 1) {
-				restore_addr_locs(r->addr6RRSet, locID);
+			if (r->addr6RRSet.size > 1 && !restore_addr_locs(r->addr6RRSet, locID)) {
 				std::sort(r->addr6RRSet.rrs, r->addr6RRSet.rrs + r->addr6RRSet.size, 
 					[](const struct RRAddr* first, const struct RRAddr* second) { return first->uloc < second->uloc;});
 			}
@@ -1316,7 +3003,8 @@ void DNSLogzipD::restore_rraddrs(void) {
 	}
 }
 
-void DNSLogzipD::restore_addr_vals(AddrDNSRRSet &rrset, unsigned short family) {
+template <unsigned int Mask>
+void DNSLogzipD<Mask>::restore_addr_vals(AddrDNSRRSet &rrset, unsigned short family) {
 
 	for (size_t i = 0; i < rrset.size; ++i) {
 	
@@ -1328,7 +3016,7 @@ void DNSLogzipD::restore_addr_vals(AddrDNSRRSet &rrset, unsigned short family) {
 				uint64_t n;
 
 				if (ENABLE_NUM_ENCODING) {
-					n = ConvertTextToBaseNum(rrset.rrs[i]->sVal);
+					n = ConvertTextToBaseNum(rrset.rrs[i]->sVal, this->ctx);
 				}
 				else {
 					n = std::stoul(rrset.rrs[i]->sVal);
@@ -1351,6 +3039,12 @@ void DNSLogzipD::restore_addr_vals(AddrDNSRRSet &rrset, unsigned short family) {
 				rrset.rrs[i]->addr.ss_family = family;
 			}
 		}
+		else if (ENABLE_IPV6_PREFIX && i > 0 && ADDR_DELTA_FLAG_CHAR == rrset.rrs[i]->sVal[0]) {
+			ConvertPrefixTextToAddr6(rrset.rrs[i]->sVal.c_str(), rrset.rrs[i]->sVal.size(),
+							((const struct sockaddr_in6 *)&rrset.rrs[i - 1]->addr)->sin6_addr,
+							&((struct sockaddr_in6 *)&rrset.rrs[i]->addr)->sin6_addr);
+			rrset.rrs[i]->addr.ss_family = family;
+		}
 		else {
 		
 			int rc = ConvertTextToAddr(rrset.rrs[i]->sVal, &rrset.rrs[i]->addr, AF_INET6);
@@ -1360,7 +3054,7 @@ void DNSLogzipD::restore_addr_vals(AddrDNSRRSet &rrset, unsigned short family) {
 				uint64_t n;
 
 				if (ENABLE_NUM_ENCODING) {
-					n = ConvertTextToBaseNum(rrset.rrs[i]->sVal);
+					n = ConvertTextToBaseNum(rrset.rrs[i]->sVal, this->ctx);
 				}
 				else {
 					n = std::stoul(rrset.rrs[i]->sVal);
@@ -1376,14 +3070,49 @@ void DNSLogzipD::restore_addr_vals(AddrDNSRRSet &rrset, unsigned short family) {
 	}	
 }
 
-void DNSLogzipD::restore_addr_locs(AddrDNSRRSet &rrset, size_t &locID) {
+/*
+	Restore the rraddr locations of a set. Return true if the set is
+	already in order, so that it needs no sorting.
+*/
+template <unsigned int Mask>
+bool DNSLogzipD<Mask>::restore_addr_locs(AddrDNSRRSet &rrset, size_t &locID) {
+	const char *p, *e;
+	size_t uPos = 0;
 
 	assert(rrset.size > 1);
+
+	if (ENABLE_SORTED_RRSETS) {
+		if (this->nSortedRRSets < 0) {
+			/* No more locations: the sets left are all in order. */
+			this->nSortedRRSets = INT64_MAX;
+			if (locID < this->addrLocsLen && !this->addrLocs[locID].empty()) {
+				p = this->addrLocs[locID].c_str();
+				e = p + this->addrLocs[locID].size();
+				this->nSortedRRSets = ConvertVarTextToNum(&p, e);
+				this->uAddrLocPos = p - this->addrLocs[locID].c_str();
+			}
+		}
+
+		if (this->nSortedRRSets > 0) {
+			this->nSortedRRSets--;
+			for (size_t i = 0; i < rrset.size; ++i) {
+				rrset.rrs[i]->uloc = i;
+			}
+
+			return true;
+		}
+
+		this->nSortedRRSets = -1;
+		uPos = this->uAddrLocPos;
+	}
+
+	p = this->addrLocs[locID].c_str() + uPos;
+	e = this->addrLocs[locID].c_str() + this->addrLocs[locID].size();
 	
 	if (rrset.size <= 4) {
 		uint8_t bitmap;
 		
-		bitmap = ConvertTextToBaseNum(this->addrLocs[locID].c_str(), this->addrLocs[locID].size());
+		bitmap = ConvertTextToBaseNum(p, e - p, this->ctx);
 		++locID; 
 
 		for (size_t i = 0; i < rrset.size; ++i) {
@@ -1394,7 +3123,7 @@ void DNSLogzipD::restore_addr_locs(AddrDNSRRSet &rrset, size_t &locID) {
 		uint8_t *bitmap;
 		uint64_t val;
 		
-		val = ConvertTextToBaseNum(this->addrLocs[locID].c_str(), this->addrLocs[locID].size());
+		val = ConvertTextToBaseNum(p, e - p, this->ctx);
 		++locID;
 
 		bitmap = (uint8_t *)&val;
@@ -1406,13 +3135,57 @@ void DNSLogzipD::restore_addr_locs(AddrDNSRRSet &rrset, size_t &locID) {
 		const char *slocs;
 		int nLocLen;
 
-		slocs = this->addrLocs[locID].c_str();
-		nLocLen = (log(rrset.size) / log(g_ucBaseNum)) + 1;
+		slocs = p;
+		nLocLen = (log(rrset.size) / log(this->ctx.ucBaseNum)) + 1;
 		++locID;
 		
 		for (size_t i = 0; i < rrset.size; i++) {
-			rrset.rrs[i]->uloc = ConvertTextToBaseNum(slocs + i * nLocLen, nLocLen);
+			rrset.rrs[i]->uloc = ConvertTextToBaseNum(slocs + i * nLocLen, nLocLen, this->ctx);
 		}
 	}
+
+	return false;
+}
+
+template class DNSLogzipC<0x00>;
+template class DNSLogzipC<0x03>;
+template class DNSLogzipC<0x7F>;
+template class DNSLogzipC<0xFF>;
+template class DNSLogzipC<FULL_FUNC_MASK>;
+template class DNSLogzipC<M_DYNAMIC>;
+
+template class DNSLogzipD<0x00>;
+template class DNSLogzipD<0x03>;
+template class DNSLogzipD<0x7F>;
+template class DNSLogzipD<0xFF>;
+template class DNSLogzipD<FULL_FUNC_MASK>;
+template class DNSLogzipD<M_DYNAMIC>;
+
+template <template <unsigned int> class T>
+static DNSLogzip *CreateSpecialized(const DNSLogzipCtx &ctx)
+{
+	switch (ctx.uFuncMask) {
+		case 0x00:
+			return new T<0x00>(ctx);
+		case 0x03:
+			return new T<0x03>(ctx);
+		case 0x7F:
+			return new T<0x7F>(ctx);
+		case 0xFF:
+			return new T<0xFF>(ctx);
+		case FULL_FUNC_MASK:
+			return new T<FULL_FUNC_MASK>(ctx);
+		default:
+			return new T<M_DYNAMIC>(ctx);
+	}
 }
 
+DNSLogzip *CreateDNSLogzip(bool bDecompression, const DNSLogzipCtx &ctx)
+{
+	if (bDecompression) {
+		return CreateSpecialized<DNSLogzipD>(ctx);
+	}
+	else {
+		return CreateSpecialized<DNSLogzipC>(ctx);
+	}
+}
@@ -0,0 +1,157 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <util.h>
+#include "cli.h"
+
+#define INPUT_READ_SIZE 65536
+
+volatile sig_atomic_t bStopRequested = 0;
+
+static void on_stop(int sig)
+{
+	bStopRequested = 1;
+}
+
+void catch_stop_signals(sigset_t *origMask)
+{
+	struct sigaction sa;
+	sigset_t mask;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, origMask);
+}
+
+int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void write_chunk(const char *data, size_t len, void *arg)
+{
+	int fd = *(int *) arg;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n <= 0) {
+			std::cerr << "error: failed to write output: " << strerror(errno) << std::endl;
+			exit(1);
+		}
+
+		data += n;
+		len  -= n;
+	}
+}
+
+void input_init(dlz_input_t *in, int fd)
+{
+	in->fd = fd;
+	in->pos = 0;
+	in->last = 0;
+}
+
+/*
+	Return n bytes of the input, NULL at the end of the input.
+*/
+const u_char *input_next(dlz_input_t *in, size_t n)
+{
+	const u_char *p;
+	ssize_t rc;
+
+	while (in->last - in->pos < n) {
+		if (in->pos > 0) {
+			memmove(in->buf.data(), in->buf.data() + in->pos, in->last - in->pos);
+			in->last -= in->pos;
+			in->pos = 0;
+		}
+
+		if (in->buf.size() < n + INPUT_READ_SIZE) {
+			in->buf.resize(n + INPUT_READ_SIZE);
+		}
+
+		rc = read(in->fd, in->buf.data() + in->last, in->buf.size() - in->last);
+		if (rc <= 0) {
+			if (rc < 0) {
+				std::cerr << "error: failed to read input: " << strerror(errno) << std::endl;
+			}
+			return NULL;
+		}
+
+		in->last += rc;
+	}
+
+	p = (const u_char *) in->buf.data() + in->pos;
+	in->pos += n;
+
+	return p;
+}
+
+int open_seq_output(const std::string &sBase, unsigned int *uSeq)
+{
+	std::string sOut;
+	int fd;
+
+	for ( ;; ) {
+		sOut = sBase + "." + std::to_string((*uSeq)++);
+
+		fd = open(sOut.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd >= 0 || EEXIST != errno) {
+			break;
+		}
+	}
+
+	if (fd < 0) {
+		std::cerr << "error: failed to open " << sOut << ": " << strerror(errno) << std::endl;
+	}
+
+	return fd;
+}
+
+void delay_update(dlz_delay_t *d, const dlz_codec_t *codec, int nMaxDelay)
+{
+	size_t pending = dlz_codec_pending(codec);
+
+	/* A new chunk has been started. */
+	if (pending > 0 && (0 == d->pending || pending < d->pending)) {
+		d->deadline = now_ms() + nMaxDelay;
+	}
+
+	d->pending = pending;
+}
+
+int delay_wait(dlz_delay_t *d, dlz_codec_t *codec, int nMaxDelay)
+{
+	int64_t now;
+
+	if (nMaxDelay <= 0 || 0 == dlz_codec_pending(codec)) {
+		return -1;
+	}
+
+	now = now_ms();
+	if (now >= d->deadline) {
+		dlz_codec_flush(codec);
+		d->pending = 0;
+		return -1;
+	}
+
+	return d->deadline - now;
+}
@@ -0,0 +1,160 @@
+#ifndef __CLI_H_
+#define __CLI_H_
+
+/*
+	Input modes of the DNSLogzip command line tool.
+	These are not part of libdnslogzip.
+*/
+
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <dnslogzip.h>
+#include <Config.hpp>
+
+#define DNS_HEADER_SIZE  12
+#define DNS_NAME_MAX     1025
+
+#define NSEC_PER_SEC     1000000000LL
+
+/* Milliseconds from a monotonic clock. */
+int64_t now_ms(void);
+
+/* Chunk handler writing to the file descriptor pointed to by arg. */
+void write_chunk(const char *data, size_t len, void *arg);
+
+/*
+	Buffered reads of a binary input.
+	input_next() returns the next n bytes, NULL at the end of the input.
+	They stay valid until the next call.
+*/
+typedef struct {
+	int                fd;
+	std::vector<char>  buf;
+	size_t             pos;
+	size_t             last;
+} dlz_input_t;
+
+void input_init(dlz_input_t *in, int fd);
+const u_char *input_next(dlz_input_t *in, size_t n);
+
+/*
+	Open the first <sBase>.<seq> that does not exist yet, starting from
+	*uSeq, so that outputs of an earlier run are kept.
+	Return the file descriptor, -1 on error.
+*/
+int open_seq_output(const std::string &sBase, unsigned int *uSeq);
+
+/*
+	Flush a chunk once its first line has waited for nMaxDelay ms.
+	Call delay_update() after feeding the codec, and delay_wait() before
+	waiting for input: it flushes an expired chunk and returns the time
+	left in ms, -1 if there is no deadline.
+*/
+typedef struct {
+	size_t  pending;
+	int64_t deadline;
+} dlz_delay_t;
+
+void delay_update(dlz_delay_t *d, const dlz_codec_t *codec, int nMaxDelay);
+int delay_wait(dlz_delay_t *d, dlz_codec_t *codec, int nMaxDelay);
+
+/*
+	Set on SIGINT and SIGTERM. The signals are blocked, and only delivered
+	inside ppoll() with the mask saved in *origMask.
+*/
+extern volatile sig_atomic_t bStopRequested;
+
+void catch_stop_signals(sigset_t *origMask);
+
+/*
+	Compress the log file at sPath while it is being written, until SIGINT
+	or SIGTERM. The output of every rotation of the file goes to
+	<sPrefix>.<seq>. Return 0 on success, -1 on error.
+*/
+int follow_file(const char *sPath, const char *sPrefix, const dlz_options_t *opts, int nMaxDelay);
+
+/*
+	Listen on the Unix domain socket at sPath and compress the lines of every
+	producer separately, until SIGINT or SIGTERM. The outputs of a source go
+	to <sPrefix>.<source>.<seq>, a new one is started at the first chunk
+	boundary after uRotateBytes (0 for one output per source).
+	Return 0 on success, -1 on error.
+*/
+int serve_socket(const char *sPath, bool bDgram, const char *sPrefix, const dlz_options_t *opts,
+					int nMaxDelay, size_t uRotateBytes);
+
+/*
+	Encode the lines of the shared memory ring sName, see dlz_ring.h, until
+	the producer closes it or SIGINT or SIGTERM. Return 0 on success.
+*/
+int consume_ring(const char *sName, dlz_codec_t *codec, int nMaxDelay);
+
+/*
+	Merge the text logs at vPaths ("-" for the standard input), each sorted
+	by time, into the encoder by time. Return 0 on success, -1 on error.
+*/
+int merge_files(char * const *vPaths, int nPaths, dlz_codec_t *codec);
+
+/*
+	A record parsed from an input other than the text log, with the storage
+	of its answers. Parsers leave the names in sNames or in their input.
+*/
+typedef struct {
+	dlz_record_t  rec;
+	dlz_view_t    cnames[MAX_ALLOWED_RRSET_SIZE];
+	struct sockaddr_storage addr4s[MAX_ALLOWED_RRSET_SIZE];
+	struct sockaddr_storage addr6s[MAX_ALLOWED_RRSET_SIZE];
+	char          sNames[(MAX_ALLOWED_RRSET_SIZE + 1) * DNS_NAME_MAX];
+} dlz_answer_t;
+
+static inline uint16_t get16be(const u_char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+void set_sockaddr(struct sockaddr_storage *ss, int family, const u_char *p);
+
+/*
+	Fill the qname, qtype, rcode and CNAME/A/AAAA answers of a record from
+	a DNS response. Return false if msg is not a response.
+*/
+bool parse_dns_response(const u_char *msg, size_t len, dlz_answer_t *a);
+
+/* Push a parsed record. */
+void feed_answer(dlz_codec_t *codec, dlz_answer_t *a);
+
+/*
+	Encode the DNS transactions of the pcap or pcapng capture read from fd.
+	Return 0 on success, -1 on error.
+*/
+int read_pcap(int fd, dlz_codec_t *codec);
+
+/*
+	Encode the CLIENT_RESPONSE and AUTH_RESPONSE messages of the dnstap
+	Frame Streams read from fd. Return 0 on success, -1 on error.
+*/
+int read_dnstap(int fd, dlz_codec_t *codec);
+
+/*
+	Input formats. A line based format parses one line into a record and
+	returns false to skip it, the others read the whole input. The text
+	log "tsv" has neither, it is fed to the codec as is.
+*/
+typedef bool (*dlz_line_parser_pt)(const char *line, size_t len, dlz_answer_t *a);
+
+typedef struct {
+	const char          *sName;
+	dlz_line_parser_pt   pfnParseLine;
+	int                (*pfnRead)(int fd, dlz_codec_t *codec);
+} dlz_format_t;
+
+/* NULL if sName is not a known format. */
+const dlz_format_t *find_format(const char *sName);
+
+/* Encode the input of fd in the format fmt. Return 0 on success, -1 on error. */
+int read_format(const dlz_format_t *fmt, int fd, dlz_codec_t *codec);
+
+#endif
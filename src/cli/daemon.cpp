@@ -0,0 +1,406 @@
+/*
+	Daemon mode: accept log lines from many local producers on a Unix domain
+	socket and compress them.
+
+	Every source has its own encoder and its own outputs,
+	<prefix>.<source>.<seq>. A source is a connection for a stream socket,
+	named after the pid of the peer, or a sender address for a datagram
+	socket, named after the full path the sender is bound to. The senders
+	that are not bound to a path, unbound or abstract, cannot be told apart
+	and share the "anon" source. Outputs are rotated at chunk boundaries once
+	they reach the rotation size, so every output decompresses on its own.
+
+	A malformed line is skipped by the encoder and counted, the count of a
+	source is reported when it is finished. The incomplete last line of a
+	closed connection is dropped.
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <util.h>
+#include "cli.h"
+
+#define RECV_BUF_SIZE       65536
+
+/* Datagram sources are finished after being idle for this long, in ms. */
+#define DGRAM_IDLE_TIMEOUT  60000
+
+typedef struct {
+	std::string   sName;
+	/* The connection, -1 for a datagram source. */
+	int           fd;
+	int64_t       lastActive;
+
+	dlz_codec_t  *codec;
+	dlz_delay_t   delay;
+
+	std::string   sBase;
+	unsigned int  uSeq;
+	/* The current output, -1 until the next chunk. */
+	int           nOutFd;
+	size_t        uOutBytes;
+	size_t        uRotateBytes;
+} dlz_source_t;
+
+/*
+	Chunk handler of a source, opens and rotates its outputs.
+*/
+static void source_chunk(const char *data, size_t len, void *arg)
+{
+	dlz_source_t *src = (dlz_source_t *) arg;
+
+	if (src->nOutFd < 0) {
+		src->nOutFd = open_seq_output(src->sBase, &src->uSeq);
+		if (src->nOutFd < 0) {
+			exit(1);
+		}
+	}
+
+	write_chunk(data, len, &src->nOutFd);
+	src->uOutBytes += len;
+
+	if (src->uRotateBytes > 0 && src->uOutBytes >= src->uRotateBytes) {
+		close(src->nOutFd);
+		src->nOutFd = -1;
+		src->uOutBytes = 0;
+	}
+}
+
+/*
+	The name of a source in its outputs: the '/' of a sender path is written
+	%2F and the '%' %25, so different paths never share an output.
+*/
+static std::string file_name(const std::string &sName)
+{
+	std::string sFile;
+	size_t i;
+
+	for (i = 0; i < sName.size(); ++i) {
+		if ('/' == sName[i]) {
+			sFile += "%2F";
+		}
+		else if ('%' == sName[i]) {
+			sFile += "%25";
+		}
+		else {
+			sFile += sName[i];
+		}
+	}
+
+	return sFile;
+}
+
+static dlz_source_t *source_create(const std::string &sName, int fd, const char *sPrefix,
+									const dlz_options_t *opts, size_t uRotateBytes)
+{
+	dlz_source_t *src = new dlz_source_t;
+
+	src->sName = sName;
+	src->fd = fd;
+	src->lastActive = now_ms();
+	src->delay.pending = 0;
+	src->delay.deadline = 0;
+	src->sBase = std::string(sPrefix) + "." + file_name(sName);
+	src->uSeq = 0;
+	src->nOutFd = -1;
+	src->uOutBytes = 0;
+	src->uRotateBytes = uRotateBytes;
+
+	src->codec = dlz_encoder_create(opts, source_chunk, src);
+	if (NULL == src->codec) {
+		if (ENOMEM == errno) {
+			std::cerr << "error: failed to allocate" << std::endl;
+		}
+		delete src;
+		return NULL;
+	}
+
+	return src;
+}
+
+static void source_destroy(dlz_source_t *src)
+{
+	dlz_stats_t stats;
+	size_t len;
+
+	/* Cut by a producer that went away, or still pending at the stop. */
+	len = dlz_codec_discard(src->codec);
+	if (len > 0) {
+		std::cerr << "warning: dropped an incomplete line of " << len << " bytes from " << src->sName << std::endl;
+	}
+
+	dlz_codec_finish(src->codec);
+
+	dlz_codec_stats(src->codec, &stats);
+	if (stats.bad_lines > 0) {
+		std::cerr << "warning: skipped " << stats.bad_lines << " malformed lines from " << src->sName << std::endl;
+	}
+
+	dlz_codec_destroy(src->codec);
+
+	if (src->nOutFd >= 0) {
+		close(src->nOutFd);
+	}
+
+	if (src->fd >= 0) {
+		close(src->fd);
+	}
+
+	delete src;
+}
+
+static void source_feed(dlz_source_t *src, const char *data, size_t len, int nMaxDelay)
+{
+	dlz_codec_feed(src->codec, data, len);
+	delay_update(&src->delay, src->codec, nMaxDelay);
+	src->lastActive = now_ms();
+}
+
+static std::string peer_name(int fd, unsigned int uConnID)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (0 == getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		return "pid" + std::to_string(cred.pid);
+	}
+
+	return "conn" + std::to_string(uConnID);
+}
+
+static std::string sender_name(const struct sockaddr_un *addr, socklen_t len)
+{
+	std::string sPath;
+
+	/* Unbound or abstract senders. */
+	if (len <= offsetof(struct sockaddr_un, sun_path) || '\0' == addr->sun_path[0]) {
+		return "anon";
+	}
+
+	/* The full path: senders with the same basename in different directories stay apart. */
+	sPath.assign(addr->sun_path, strnlen(addr->sun_path, len - offsetof(struct sockaddr_un, sun_path)));
+
+	return sPath;
+}
+
+/*
+	Read all the pending datagrams. A datagram holds one or more lines, the
+	last LF is optional. A datagram larger than the receive buffer is dropped
+	whole: its lines cut at the end of the buffer would be corrupted.
+*/
+static int recv_datagrams(int fd, std::vector<dlz_source_t *> &sources, const char *sPrefix,
+							const dlz_options_t *opts, int nMaxDelay, size_t uRotateBytes)
+{
+	char rbuf[RECV_BUF_SIZE];
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	dlz_source_t *src;
+	std::string sName;
+	ssize_t n;
+	size_t i;
+
+	for ( ;; ) {
+		addrlen = sizeof(addr);
+		/* With MSG_TRUNC, n is the length of the whole datagram. */
+		n = recvfrom(fd, rbuf, sizeof(rbuf), MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr *) &addr, &addrlen);
+		if (n < 0) {
+			return EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno ? DLZ_OK : DLZ_ERROR;
+		}
+
+		if (0 == n) {
+			continue;
+		}
+
+		sName = sender_name(&addr, addrlen);
+		if (n > (ssize_t) sizeof(rbuf)) {
+			std::cerr << "warning: dropped a datagram of " << n << " bytes from " << sName
+						<< ", larger than " << sizeof(rbuf) << " bytes" << std::endl;
+			continue;
+		}
+
+		for (i = 0; i < sources.size() && sources[i]->sName != sName; ++i);
+
+		if (i == sources.size()) {
+			src = source_create(sName, -1, sPrefix, opts, uRotateBytes);
+			if (NULL == src) {
+				return DLZ_ERROR;
+			}
+			sources.push_back(src);
+		}
+
+		source_feed(sources[i], rbuf, n, nMaxDelay);
+		if (LF != rbuf[n - 1]) {
+			source_feed(sources[i], "\n", 1, nMaxDelay);
+		}
+	}
+}
+
+static int open_socket(const char *sPath, bool bDgram)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(sPath) >= sizeof(addr.sun_path)) {
+		std::cerr << "error: socket path is too long: " << sPath << std::endl;
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sPath);
+
+	fd = socket(AF_UNIX, (bDgram ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		std::cerr << "error: failed to create socket: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	/* A socket left over by an earlier run. */
+	unlink(sPath);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| (!bDgram && listen(fd, SOMAXCONN) < 0)) {
+		std::cerr << "error: failed to listen on " << sPath << ": " << strerror(errno) << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int serve_socket(const char *sPath, bool bDgram, const char *sPrefix, const dlz_options_t *opts,
+					int nMaxDelay, size_t uRotateBytes)
+{
+	char rbuf[RECV_BUF_SIZE];
+	std::vector<dlz_source_t *> sources;
+	std::vector<struct pollfd> pfds;
+	struct timespec ts, *pts;
+	sigset_t origMask;
+	dlz_source_t *src;
+	unsigned int uConnID = 0;
+	int64_t now, idle;
+	int nListenFd, fd, timeout, rc = DLZ_OK;
+	size_t i, j;
+	ssize_t n;
+
+	nListenFd = open_socket(sPath, bDgram);
+	if (nListenFd < 0) {
+		return DLZ_ERROR;
+	}
+
+	catch_stop_signals(&origMask);
+
+	while (DLZ_OK == rc && !bStopRequested) {
+		pfds.resize(1);
+		pfds[0].fd = nListenFd;
+		pfds[0].events = POLLIN;
+
+		/* Flush the late chunks, finish the idle sources. */
+		timeout = -1;
+		now = now_ms();
+		for (i = 0, j = 0; i < sources.size(); ++i) {
+			src = sources[i];
+
+			if (src->fd < 0) {
+				idle = src->lastActive + DGRAM_IDLE_TIMEOUT - now;
+				if (idle <= 0) {
+					source_destroy(src);
+					continue;
+				}
+
+				timeout = timeout < 0 || idle < timeout ? idle : timeout;
+			}
+
+			n = delay_wait(&src->delay, src->codec, nMaxDelay);
+			if (n >= 0 && (timeout < 0 || n < timeout)) {
+				timeout = n;
+			}
+
+			if (src->fd >= 0) {
+				pfds.push_back({src->fd, POLLIN, 0});
+			}
+
+			sources[j++] = src;
+		}
+		sources.resize(j);
+
+		pts = NULL;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = timeout % 1000 * 1000000;
+			pts = &ts;
+		}
+
+		if (ppoll(pfds.data(), pfds.size(), pts, &origMask) <= 0) {
+			continue;
+		}
+
+		/* The connections, in the same order as in pfds. */
+		for (i = 0, j = 1; i < sources.size(); ++i) {
+			src = sources[i];
+			if (src->fd < 0) {
+				continue;
+			}
+
+			if (0 == pfds[j++].revents) {
+				continue;
+			}
+
+			n = read(src->fd, rbuf, sizeof(rbuf));
+			if (n > 0) {
+				source_feed(src, rbuf, n, nMaxDelay);
+				continue;
+			}
+
+			if (n < 0 && (EAGAIN == errno || EINTR == errno)) {
+				continue;
+			}
+
+			/* Closed by the producer. */
+			source_destroy(src);
+			sources.erase(sources.begin() + i--);
+		}
+
+		if (0 == pfds[0].revents) {
+			continue;
+		}
+
+		if (bDgram) {
+			rc = recv_datagrams(nListenFd, sources, sPrefix, opts, nMaxDelay, uRotateBytes);
+			continue;
+		}
+
+		fd = accept4(nListenFd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+
+		src = source_create(peer_name(fd, uConnID++), fd, sPrefix, opts, uRotateBytes);
+		if (NULL == src) {
+			close(fd);
+			rc = DLZ_ERROR;
+			break;
+		}
+		sources.push_back(src);
+	}
+
+	for (i = 0; i < sources.size(); ++i) {
+		source_destroy(sources[i]);
+	}
+
+	sigprocmask(SIG_SETMASK, &origMask, NULL);
+
+	close(nListenFd);
+	unlink(sPath);
+
+	return rc;
+}
@@ -0,0 +1,235 @@
+/*
+	dnstap input: a Frame Streams file of dnstap protobuf messages, as
+	written by BIND, Unbound, Knot or dnstap tools.
+
+	Only the CLIENT_RESPONSE and AUTH_RESPONSE messages with a response
+	message are encoded. The record takes the query time if present, the
+	response time otherwise. The protobuf fields are read directly, there
+	is no dependency on a protobuf library.
+*/
+#include <iostream>
+#include <cstring>
+
+#include <netinet/in.h>
+
+#include <util.h>
+#include "cli.h"
+
+/* Frame Streams */
+#define FSTRM_CONTROL_STOP       3
+#define FSTRM_MAX_FRAME_SIZE     (16 * 1024 * 1024)
+
+/* Fields of the Dnstap and Message protobuf messages. */
+#define DNSTAP_FIELD_MESSAGE     14
+#define MSG_FIELD_TYPE           1
+#define MSG_FIELD_FAMILY         2
+#define MSG_FIELD_QUERY_ADDR     4
+#define MSG_FIELD_RESPONSE_ADDR  5
+#define MSG_FIELD_QUERY_SEC      8
+#define MSG_FIELD_QUERY_NSEC     9
+#define MSG_FIELD_RESPONSE_SEC   12
+#define MSG_FIELD_RESPONSE_NSEC  13
+#define MSG_FIELD_RESPONSE_MSG   14
+
+#define MSG_TYPE_AUTH_RESPONSE   2
+#define MSG_TYPE_CLIENT_RESPONSE 6
+
+#define PB_VARINT  0
+#define PB_FIXED64 1
+#define PB_BYTES   2
+#define PB_FIXED32 5
+
+/* A protobuf field, value is the integer or the length of data. */
+typedef struct {
+	uint32_t       uField;
+	uint64_t       value;
+	const u_char  *data;
+} dlz_pb_field_t;
+
+static inline uint32_t get32be(const u_char *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static bool pb_varint(const u_char **p, const u_char *end, uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t) (**p & 0x7f) << shift;
+		if (0 == (*(*p)++ & 0x80)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+	Read the next field at *p. Return false at the end or if it is malformed.
+*/
+static bool pb_next(const u_char **p, const u_char *end, dlz_pb_field_t *f)
+{
+	uint64_t key;
+
+	if (*p >= end || !pb_varint(p, end, &key)) {
+		return false;
+	}
+
+	f->uField = key >> 3;
+	f->data = NULL;
+
+	switch (key & 0x07) {
+		case PB_VARINT:
+			return pb_varint(p, end, &f->value);
+
+		case PB_FIXED64:
+			if (end - *p < 8) {
+				return false;
+			}
+			memcpy(&f->value, *p, 8);
+			*p += 8;
+			return true;
+
+		case PB_FIXED32:
+			if (end - *p < 4) {
+				return false;
+			}
+			f->value = 0;
+			memcpy(&f->value, *p, 4);
+			*p += 4;
+			return true;
+
+		case PB_BYTES:
+			if (!pb_varint(p, end, &f->value) || f->value > (uint64_t) (end - *p)) {
+				return false;
+			}
+			f->data = *p;
+			*p += f->value;
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+static void set_pb_addr(struct sockaddr_storage *ss, const dlz_pb_field_t *f)
+{
+	if (4 == f->value) {
+		set_sockaddr(ss, AF_INET, f->data);
+	}
+	else if (16 == f->value) {
+		set_sockaddr(ss, AF_INET6, f->data);
+	}
+}
+
+/*
+	Decode a Message and push its record.
+*/
+static void parse_message(const u_char *p, const u_char *end, dlz_codec_t *codec, dlz_answer_t *a)
+{
+	dlz_pb_field_t f;
+	uint64_t uType = 0, uQuerySec = 0, uQueryNsec = 0, uResponseSec = 0, uResponseNsec = 0;
+	const u_char *msg = NULL;
+	size_t len = 0;
+
+	memset(&a->rec.client, 0, sizeof(a->rec.client));
+	memset(&a->rec.server, 0, sizeof(a->rec.server));
+
+	while (pb_next(&p, end, &f)) {
+		switch (f.uField) {
+			case MSG_FIELD_TYPE:
+				uType = f.value;
+				break;
+			case MSG_FIELD_QUERY_ADDR:
+				set_pb_addr(&a->rec.client, &f);
+				break;
+			case MSG_FIELD_RESPONSE_ADDR:
+				set_pb_addr(&a->rec.server, &f);
+				break;
+			case MSG_FIELD_QUERY_SEC:
+				uQuerySec = f.value;
+				break;
+			case MSG_FIELD_QUERY_NSEC:
+				uQueryNsec = f.value;
+				break;
+			case MSG_FIELD_RESPONSE_SEC:
+				uResponseSec = f.value;
+				break;
+			case MSG_FIELD_RESPONSE_NSEC:
+				uResponseNsec = f.value;
+				break;
+			case MSG_FIELD_RESPONSE_MSG:
+				msg = f.data;
+				len = f.value;
+				break;
+		}
+	}
+
+	if ((MSG_TYPE_CLIENT_RESPONSE != uType && MSG_TYPE_AUTH_RESPONSE != uType) || NULL == msg
+			|| 0 == a->rec.client.ss_family || 0 == a->rec.server.ss_family) {
+		return;
+	}
+
+	if (parse_dns_response(msg, len, a)) {
+		a->rec.time = 0 != uQuerySec ? uQuerySec : uResponseSec;
+		a->rec.nsec = (0 != uQuerySec ? uQueryNsec : uResponseNsec) % NSEC_PER_SEC;
+		feed_answer(codec, a);
+	}
+}
+
+int read_dnstap(int fd, dlz_codec_t *codec)
+{
+	dlz_input_t in;
+	dlz_answer_t *a;
+	dlz_pb_field_t f;
+	const u_char *p, *end;
+	uint32_t uLen;
+	int rc = DLZ_OK;
+
+	input_init(&in, fd);
+	a = new dlz_answer_t;
+
+	while (NULL != (p = input_next(&in, 4))) {
+		uLen = get32be(p);
+
+		/* Control frame: escape, length, type and fields. */
+		if (0 == uLen) {
+			p = input_next(&in, 4);
+			uLen = NULL != p ? get32be(p) : 0;
+			p = NULL != p && uLen >= 4 && uLen <= FSTRM_MAX_FRAME_SIZE ? input_next(&in, uLen) : NULL;
+			if (NULL == p) {
+				rc = DLZ_ERROR;
+				break;
+			}
+
+			if (FSTRM_CONTROL_STOP == get32be(p)) {
+				break;
+			}
+			continue;
+		}
+
+		p = uLen <= FSTRM_MAX_FRAME_SIZE ? input_next(&in, uLen) : NULL;
+		if (NULL == p) {
+			rc = DLZ_ERROR;
+			break;
+		}
+
+		/* Data frame: a Dnstap message. */
+		end = p + uLen;
+		while (pb_next(&p, end, &f)) {
+			if (DNSTAP_FIELD_MESSAGE == f.uField && NULL != f.data) {
+				parse_message(f.data, f.data + f.value, codec, a);
+			}
+		}
+	}
+
+	if (DLZ_OK != rc) {
+		std::cerr << "error: truncated or malformed dnstap input" << std::endl;
+	}
+
+	delete a;
+
+	return rc;
+}
@@ -0,0 +1,181 @@
+/*
+	DNS wire format, for the inputs that carry DNS messages (pcap, dnstap).
+*/
+#include <cstring>
+
+#include <netinet/in.h>
+
+#include <Config.hpp>
+#include <util.h>
+#include "cli.h"
+
+void set_sockaddr(struct sockaddr_storage *ss, int family, const u_char *p)
+{
+	memset(ss, 0, sizeof(*ss));
+	ss->ss_family = family;
+
+	if (AF_INET == family) {
+		memcpy(&((struct sockaddr_in *) ss)->sin_addr, p, 4);
+	}
+	else {
+		memcpy(&((struct sockaddr_in6 *) ss)->sin6_addr, p, 16);
+	}
+}
+
+/*
+	Write a label in presentation format, as dig does: a dot or a backslash
+	of the label is escaped with a backslash, and the bytes that are not
+	printable, the space, TAB and LF included, as \DDD. A raw TAB or LF
+	would break the columns or the lines of the log.
+*/
+static size_t print_dns_label(const u_char *p, uint8_t label, char *s)
+{
+	char *d = s;
+
+	for (uint8_t i = 0; i < label; ++i) {
+		if ('.' == p[i] || '\\' == p[i]) {
+			*d++ = '\\';
+			*d++ = p[i];
+		}
+		else if (p[i] <= ' ' || p[i] >= 0x7f) {
+			*d++ = '\\';
+			*d++ = '0' + p[i] / 100;
+			*d++ = '0' + p[i] / 10 % 10;
+			*d++ = '0' + p[i] % 10;
+		}
+		else {
+			*d++ = p[i];
+		}
+	}
+
+	return d - s;
+}
+
+/*
+	Decode the domain name at off into s, without the trailing dot.
+	Return the offset after the name, 0 if it is malformed.
+*/
+static size_t parse_dns_name(const u_char *msg, size_t len, size_t off, char *s, size_t *slen)
+{
+	size_t end = 0, n = 0, hops = 0;
+	uint8_t label;
+
+	for ( ;; ) {
+		if (off >= len) {
+			return 0;
+		}
+
+		label = msg[off];
+
+		if (0xc0 == (label & 0xc0)) {
+			if (off + 1 >= len || ++hops > 64) {
+				return 0;
+			}
+
+			if (0 == end) {
+				end = off + 2;
+			}
+
+			off = ((label & 0x3f) << 8) | msg[off + 1];
+			continue;
+		}
+
+		if (label & 0xc0) {
+			return 0;
+		}
+
+		if (0 == label) {
+			break;
+		}
+
+		/* Up to 4 characters per byte once escaped. */
+		if (off + 1 + label > len || n + 4 * label + 1 >= DNS_NAME_MAX) {
+			return 0;
+		}
+
+		if (n > 0) {
+			s[n++] = '.';
+		}
+		n += print_dns_label(msg + off + 1, label, s + n);
+		off += 1 + label;
+	}
+
+	/* The root. */
+	if (0 == n) {
+		s[n++] = '.';
+	}
+
+	*slen = n;
+
+	return 0 == end ? off + 1 : end;
+}
+
+bool parse_dns_response(const u_char *msg, size_t len, dlz_answer_t *a)
+{
+	dlz_record_t *rec = &a->rec;
+	size_t off, n, used;
+	uint16_t type, rdlen, ancount;
+	char *s = a->sNames;
+	char sOwner[DNS_NAME_MAX];
+
+	/* A response to a standard query with one question. */
+	if (len < DNS_HEADER_SIZE || 0 == (msg[2] & 0x80) || 0 != (msg[2] & 0x78)
+			|| 1 != get16be(msg + 4)) {
+		return false;
+	}
+
+	off = parse_dns_name(msg, len, DNS_HEADER_SIZE, s, &n);
+	if (0 == off || off + 4 > len) {
+		return false;
+	}
+
+	rec->qname.data = s;
+	rec->qname.len = n;
+	used = n;
+
+	rec->qtype = get16be(msg + off);
+	rec->rcode = msg[3] & 0x0f;
+	rec->ncnames = rec->naddr4s = rec->naddr6s = 0;
+	off += 4;
+
+	ancount = get16be(msg + 6);
+	for (uint16_t i = 0; i < ancount; ++i) {
+		/* The owner names are not kept. */
+		off = parse_dns_name(msg, len, off, sOwner, &n);
+		if (0 == off || off + 10 > len) {
+			break;
+		}
+
+		type = get16be(msg + off);
+		rdlen = get16be(msg + off + 8);
+		off += 10;
+		if (off + rdlen > len) {
+			break;
+		}
+
+		if (DNS_TYPE_CNAME == type && rec->ncnames < MAX_ALLOWED_RRSET_SIZE
+				&& used + DNS_NAME_MAX <= sizeof(a->sNames)) {
+			if (0 != parse_dns_name(msg, len, off, s + used, &n)) {
+				a->cnames[rec->ncnames].data = s + used;
+				a->cnames[rec->ncnames].len = n;
+				rec->ncnames++;
+				used += n;
+			}
+		}
+		else if (DNS_TYPE_A == type && 4 == rdlen && rec->naddr4s < MAX_ALLOWED_RRSET_SIZE) {
+			set_sockaddr(&a->addr4s[rec->naddr4s++], AF_INET, msg + off);
+		}
+		else if (DNS_TYPE_AAAA == type && 16 == rdlen && rec->naddr6s < MAX_ALLOWED_RRSET_SIZE) {
+			set_sockaddr(&a->addr6s[rec->naddr6s++], AF_INET6, msg + off);
+		}
+
+		off += rdlen;
+	}
+
+	return true;
+}
+
+void feed_answer(dlz_codec_t *codec, dlz_answer_t *a)
+{
+	dlz_codec_feed_record(codec, &a->rec, a->cnames, a->addr4s, a->addr6s);
+}
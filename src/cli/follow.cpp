@@ -0,0 +1,319 @@
+/*
+	Follow mode: compress a log file while the resolver is writing it.
+
+	The file and its directory are watched with inotify. Appended data is
+	read in large blocks and fed to the encoder line by line. The file is
+	considered rotated when it is truncated, or when a different file shows
+	up under its name (rename or remove and create). The old file is then
+	drained, its output is finished, and the new file gets a new output.
+*/
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include <util.h>
+#include "cli.h"
+
+#define FOLLOW_BUF_SIZE   (1024 * 1024)
+#define INOTIFY_BUF_SIZE  (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+typedef struct {
+	const char   *sPath;
+	const char   *sPrefix;
+	std::string   sName;
+
+	int           nInotifyFd;
+	int           nDirWd;
+	int           nFileWd;
+
+	/* The file being followed, -1 if it does not exist yet. */
+	int           nFd;
+	ino_t         ino;
+	off_t         offset;
+	dlz_buf_t     buf;
+
+	/* Sequence number of the next output. */
+	unsigned int  uSeq;
+	int           nOutFd;
+	dlz_codec_t  *codec;
+} dlz_follow_t;
+
+static int open_output(dlz_follow_t *f)
+{
+	f->nOutFd = open_seq_output(f->sPrefix, &f->uSeq);
+
+	return f->nOutFd >= 0 ? DLZ_OK : DLZ_ERROR;
+}
+
+/*
+	Feed the complete lines in the buffer and keep the incomplete one.
+	Return false if nothing was read.
+*/
+static bool read_input(dlz_follow_t *f)
+{
+	dlz_buf_t *b = &f->buf;
+	char *p;
+	ssize_t n;
+	bool bRead = false;
+
+	for ( ;; ) {
+		n = read(f->nFd, b->last, b->end - b->last);
+		if (n <= 0) {
+			if (n < 0) {
+				std::cerr << "error: failed to read " << f->sPath << ": " << strerror(errno) << std::endl;
+			}
+			return bRead;
+		}
+
+		bRead = true;
+		f->offset += n;
+		b->last += n;
+
+		p = (char *) memrchr(b->pos, LF, b->last - b->pos);
+		if (NULL != p) {
+			dlz_codec_feed(f->codec, b->pos, p + 1 - b->pos);
+			b->pos = p + 1;
+		}
+		else if (b->last == b->end) {
+			/* A line longer than the buffer, the codec keeps it. */
+			dlz_codec_feed(f->codec, b->pos, b->last - b->pos);
+			b->pos = b->last;
+		}
+
+		/* Move the incomplete line to the start of buffer. */
+		n = b->last - b->pos;
+		memmove(b->start, b->pos, n);
+		b->pos = b->start;
+		b->last = b->start + n;
+	}
+}
+
+static int open_input(dlz_follow_t *f)
+{
+	struct stat st;
+
+	f->nFd = open(f->sPath, O_RDONLY);
+	if (f->nFd < 0) {
+		if (ENOENT == errno) {
+			/* Wait for the file to be created. */
+			return DLZ_OK;
+		}
+
+		std::cerr << "error: failed to open " << f->sPath << ": " << strerror(errno) << std::endl;
+		return DLZ_ERROR;
+	}
+
+	fstat(f->nFd, &st);
+	f->ino = st.st_ino;
+	f->offset = 0;
+	f->buf.fd = f->nFd;
+	f->buf.pos = f->buf.last = f->buf.start;
+
+	f->nFileWd = inotify_add_watch(f->nInotifyFd, f->sPath, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+
+	if (DLZ_OK != open_output(f)) {
+		return DLZ_ERROR;
+	}
+
+	read_input(f);
+
+	return DLZ_OK;
+}
+
+/*
+	Finish the output of the current file. An incomplete last line, still
+	being written at the rotation or at the stop, is dropped with a warning:
+	encoded as it is, it would decode as a cut line.
+*/
+static void finish_output(dlz_follow_t *f)
+{
+	dlz_buf_t *b = &f->buf;
+	size_t len;
+
+	/* A line longer than the buffer is partly kept by the codec. */
+	len = b->last - b->pos + dlz_codec_discard(f->codec);
+	if (len > 0) {
+		std::cerr << "warning: dropped an incomplete line of " << len << " bytes at the end of "
+					<< f->sPath << std::endl;
+	}
+	b->pos = b->last = b->start;
+
+	dlz_codec_finish(f->codec);
+
+	close(f->nOutFd);
+	f->nOutFd = -1;
+}
+
+static void close_input(dlz_follow_t *f)
+{
+	/* Whatever the writer appended before the rotation. */
+	read_input(f);
+	finish_output(f);
+
+	inotify_rm_watch(f->nInotifyFd, f->nFileWd);
+	close(f->nFd);
+	f->nFd = -1;
+}
+
+/*
+	Switch to a new output if the file has been rotated.
+*/
+static int check_rotation(dlz_follow_t *f)
+{
+	struct stat st;
+
+	if (f->nFd < 0) {
+		return open_input(f);
+	}
+
+	/* Truncated in place. */
+	if (0 == fstat(f->nFd, &st) && st.st_size < f->offset) {
+		finish_output(f);
+		lseek(f->nFd, 0, SEEK_SET);
+		f->offset = 0;
+
+		if (DLZ_OK != open_output(f)) {
+			return DLZ_ERROR;
+		}
+		read_input(f);
+
+		return DLZ_OK;
+	}
+
+	/* Renamed or removed, and replaced by a new file. */
+	if (0 == stat(f->sPath, &st) && st.st_ino != f->ino) {
+		close_input(f);
+		return open_input(f);
+	}
+
+	return DLZ_OK;
+}
+
+/*
+	Return true if one of the events may be a rotation.
+*/
+static bool read_events(dlz_follow_t *f)
+{
+	char ebuf[INOTIFY_BUF_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool bRotation = false;
+	ssize_t n;
+	char *p;
+
+	while ((n = read(f->nInotifyFd, ebuf, sizeof(ebuf))) > 0) {
+		for (p = ebuf; p < ebuf + n; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *) p;
+
+			if (ev->wd == f->nFileWd) {
+				bRotation = bRotation || (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF));
+			}
+			else if (ev->wd == f->nDirWd && ev->len > 0 && f->sName == ev->name) {
+				bRotation = true;
+			}
+		}
+	}
+
+	return bRotation;
+}
+
+int follow_file(const char *sPath, const char *sPrefix, const dlz_options_t *opts, int nMaxDelay)
+{
+	dlz_follow_t f;
+	std::string sDir;
+	struct pollfd pfd;
+	sigset_t origMask;
+	struct timespec ts, *pts;
+	dlz_delay_t delay = {0, 0};
+	bool bRotation;
+	int timeout;
+	int rc = DLZ_OK;
+
+	f.sPath = sPath;
+	f.sPrefix = sPrefix;
+	f.sName = sPath;
+	sDir = ".";
+	if (std::string::npos != f.sName.rfind('/')) {
+		sDir = f.sName.substr(0, f.sName.rfind('/') + 1);
+		f.sName = f.sName.substr(f.sName.rfind('/') + 1);
+	}
+
+	f.nFd = -1;
+	f.nOutFd = -1;
+	f.nFileWd = -1;
+	f.uSeq = 0;
+	f.buf.start = new char[FOLLOW_BUF_SIZE];
+	f.buf.end   = f.buf.start + FOLLOW_BUF_SIZE;
+	f.buf.pos   = f.buf.last = f.buf.start;
+
+	f.codec = dlz_encoder_create(opts, write_chunk, &f.nOutFd);
+	if (NULL == f.codec) {
+		if (ENOMEM == errno) {
+			std::cerr << "error: failed to allocate" << std::endl;
+		}
+		delete [] f.buf.start;
+		return DLZ_ERROR;
+	}
+
+	f.nInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	f.nDirWd = inotify_add_watch(f.nInotifyFd, sDir.c_str(), IN_CREATE | IN_MOVED_TO);
+	if (f.nInotifyFd < 0 || f.nDirWd < 0) {
+		std::cerr << "error: failed to watch " << sDir << ": " << strerror(errno) << std::endl;
+		rc = DLZ_ERROR;
+		goto done;
+	}
+
+	catch_stop_signals(&origMask);
+
+	pfd.fd = f.nInotifyFd;
+	pfd.events = POLLIN;
+
+	rc = open_input(&f);
+
+	while (DLZ_OK == rc && !bStopRequested) {
+		delay_update(&delay, f.codec, nMaxDelay);
+
+		pts = NULL;
+		timeout = delay_wait(&delay, f.codec, nMaxDelay);
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = timeout % 1000 * 1000000;
+			pts = &ts;
+		}
+
+		if (ppoll(&pfd, 1, pts, &origMask) <= 0) {
+			continue;
+		}
+
+		bRotation = read_events(&f);
+
+		/* Nothing appended, maybe truncated. */
+		if (f.nFd >= 0 && read_input(&f) && !bRotation) {
+			continue;
+		}
+
+		rc = check_rotation(&f);
+	}
+
+	if (f.nFd >= 0) {
+		close_input(&f);
+	}
+
+	sigprocmask(SIG_SETMASK, &origMask, NULL);
+
+done:
+	if (f.nInotifyFd >= 0) {
+		close(f.nInotifyFd);
+	}
+
+	dlz_codec_destroy(f.codec);
+	delete [] f.buf.start;
+
+	return rc;
+}
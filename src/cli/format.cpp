@@ -0,0 +1,552 @@
+/*
+	Input formats other than the tab-separated log of DNSLogzip.
+
+	Each format fills a dlz_answer_t that is pushed to the encoder with
+	dlz_codec_feed_record(), so the text of the log is parsed only once.
+	Line based formats provide a line parser, the others read the whole
+	input themselves.
+*/
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <util.h>
+#include "cli.h"
+
+#define LINE_BUF_SIZE  (1024 * 1024)
+
+static bool parse_bind_line(const char *line, size_t len, dlz_answer_t *a);
+static bool parse_unbound_line(const char *line, size_t len, dlz_answer_t *a);
+
+static const dlz_format_t formats[] = {
+	{"tsv",     NULL,               NULL},
+	{"bind",    parse_bind_line,    NULL},
+	{"unbound", parse_unbound_line, NULL},
+	{"dnstap",  NULL,               read_dnstap},
+	{"pcap",    NULL,               read_pcap},
+};
+
+static const char *months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/* Mnemonics of the common types, others are written TYPEnnn. */
+static const struct {
+	const char *sName;
+	uint16_t    uType;
+} qtypes[] = {
+	{"A", 1}, {"NS", 2}, {"CNAME", 5}, {"SOA", 6}, {"NULL", 10}, {"PTR", 12}, {"HINFO", 13},
+	{"MX", 15}, {"TXT", 16}, {"AAAA", 28}, {"SRV", 33}, {"NAPTR", 35}, {"DNAME", 39},
+	{"DS", 43}, {"SSHFP", 44}, {"RRSIG", 46}, {"NSEC", 47}, {"DNSKEY", 48}, {"NSEC3", 50},
+	{"NSEC3PARAM", 51}, {"TLSA", 52}, {"CDS", 59}, {"CDNSKEY", 60}, {"SVCB", 64},
+	{"HTTPS", 65}, {"SPF", 99}, {"IXFR", 251}, {"AXFR", 252}, {"ANY", 255}, {"CAA", 257},
+};
+
+static const char *rcodes[] = {
+	"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMPL", "REFUSED",
+	"YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE"
+};
+
+const dlz_format_t *find_format(const char *sName)
+{
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+		if (0 == strcmp(sName, formats[i].sName)) {
+			return &formats[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Days since 1970-01-01 of a date of the proleptic Gregorian calendar. */
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+	int64_t era;
+	unsigned yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (unsigned) (y - era * 400);
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + (int64_t) doe - 719468;
+}
+
+static bool parse_uint(const char **p, const char *end, size_t n, unsigned *v)
+{
+	*v = 0;
+	for (size_t i = 0; i < n; ++i, ++*p) {
+		if (*p >= end || **p < '0' || **p > '9') {
+			return false;
+		}
+		*v = *v * 10 + (**p - '0');
+	}
+
+	return true;
+}
+
+/*
+	Clock of the BIND and syslog timestamps, which are in the local time of
+	the server. mktime() is called once per hour of the log, the other lines
+	of the hour take its offset to UTC. The syslog timestamps have no year:
+	the one of the first line is the current year, or the previous one if
+	the date would be in the future, and the year goes on when the month
+	goes back, from December to January.
+*/
+typedef struct {
+	/* The local hour, in seconds as if it were UTC, -1 if none yet. */
+	int64_t   nHour;
+	int64_t   nOffset;
+
+	unsigned  uYear;
+	/* The last month of uYear, 0 until the first syslog line. */
+	int       nMonth;
+} dlz_log_clock_t;
+
+static dlz_log_clock_t logClock;
+
+static void reset_log_clock()
+{
+	logClock.nHour = -1;
+	logClock.nOffset = 0;
+	logClock.uYear = 0;
+	logClock.nMonth = 0;
+}
+
+static int64_t local_to_utc(unsigned y, unsigned m, unsigned d, unsigned hh, unsigned mm, unsigned ss)
+{
+	int64_t hour = days_from_civil(y, m, d) * 86400 + hh * 3600;
+	struct tm tm;
+	time_t t;
+
+	if (hour != logClock.nHour) {
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = y - 1900;
+		tm.tm_mon = m - 1;
+		tm.tm_mday = d;
+		tm.tm_hour = hh;
+		tm.tm_isdst = -1;
+
+		t = mktime(&tm);
+		logClock.nOffset = (time_t) -1 == t ? 0 : hour - t;
+		logClock.nHour = hour;
+	}
+
+	return hour - logClock.nOffset + mm * 60 + ss;
+}
+
+static unsigned syslog_year(int m, unsigned d)
+{
+	time_t now;
+	struct tm tm;
+
+	if (0 == logClock.nMonth) {
+		now = time(NULL);
+		localtime_r(&now, &tm);
+
+		logClock.uYear = tm.tm_year + 1900;
+		logClock.nMonth = m;
+
+		/* A day of slack for the clocks of other servers. */
+		if (days_from_civil(logClock.uYear, m, d) > days_from_civil(logClock.uYear, tm.tm_mon + 1, tm.tm_mday) + 1) {
+			--logClock.uYear;
+		}
+	}
+	else if (m + 6 < logClock.nMonth) {
+		++logClock.uYear;
+		logClock.nMonth = m;
+	}
+	else if (m > logClock.nMonth + 6) {
+		/* A late line of the previous year. */
+		return logClock.uYear - 1;
+	}
+	else if (m > logClock.nMonth) {
+		logClock.nMonth = m;
+	}
+
+	return logClock.uYear;
+}
+
+static int parse_month(const char *p, const char *end)
+{
+	for (int i = 0; i < 12 && end - p >= 3; ++i) {
+		if (0 == memcmp(p, months[i], 3)) {
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+	Timestamp at the start of a log line, returned in UTC:
+		[1697000000]              Unbound, in UTC
+		19-Oct-2026 10:00:00.123  BIND, in local time
+		Oct 19 10:00:00           syslog, in local time, see syslog_year()
+	*p is moved past it.
+*/
+static bool parse_log_time(const char **p, const char *end, int64_t *t, uint32_t *nsec)
+{
+	const char *s = *p;
+	unsigned d, y, hh, mm, ss, scale;
+	int m;
+
+	if (s < end && '[' == *s) {
+		for (*t = 0, ++s; s < end && *s >= '0' && *s <= '9'; ++s) {
+			*t = *t * 10 + (*s - '0');
+		}
+
+		if (s >= end || ']' != *s) {
+			return false;
+		}
+
+		*nsec = 0;
+		*p = s + 1;
+		return true;
+	}
+
+	if (s < end && *s >= '0' && *s <= '9') {
+		if (!parse_uint(&s, end, 2, &d) || s + 5 > end || '-' != *s
+				|| 0 == (m = parse_month(s + 1, end)) || '-' != s[4]) {
+			return false;
+		}
+
+		s += 5;
+		if (!parse_uint(&s, end, 4, &y) || s >= end || ' ' != *s++) {
+			return false;
+		}
+	}
+	else {
+		if (0 == (m = parse_month(s, end)) || s + 6 > end || ' ' != s[3]) {
+			return false;
+		}
+
+		s += 4;
+		if (' ' == *s) {
+			++s;
+			if (!parse_uint(&s, end, 1, &d)) {
+				return false;
+			}
+		}
+		else if (!parse_uint(&s, end, 2, &d)) {
+			return false;
+		}
+
+		if (s >= end || ' ' != *s++) {
+			return false;
+		}
+
+		y = syslog_year(m, d);
+	}
+
+	if (!parse_uint(&s, end, 2, &hh) || s >= end || ':' != *s++
+			|| !parse_uint(&s, end, 2, &mm) || s >= end || ':' != *s++
+			|| !parse_uint(&s, end, 2, &ss)) {
+		return false;
+	}
+
+	/* Fractions of a second. */
+	*nsec = 0;
+	if (s < end && '.' == *s) {
+		for (++s, scale = NSEC_PER_SEC / 10; s < end && *s >= '0' && *s <= '9'; ++s, scale /= 10) {
+			*nsec += (*s - '0') * scale;
+		}
+	}
+
+	*t = local_to_utc(y, m, d, hh, mm, ss);
+	*p = s;
+
+	return true;
+}
+
+/*
+	The next token ending with a space or the end of the line.
+*/
+static bool next_token(const char **p, const char *end, dlz_view_t *tok)
+{
+	const char *q;
+
+	while (*p < end && ' ' == **p) {
+		++*p;
+	}
+
+	if (*p >= end) {
+		return false;
+	}
+
+	q = (const char *) memchr(*p, ' ', end - *p);
+	q = NULL == q ? end : q;
+
+	tok->data = *p;
+	tok->len = q - *p;
+	*p = q;
+
+	return true;
+}
+
+static bool parse_ip(const char *s, size_t len, struct sockaddr_storage *ss)
+{
+	char buf[INET6_ADDRSTRLEN];
+	u_char addr[16];
+
+	if (0 == len || len >= sizeof(buf)) {
+		return false;
+	}
+
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	if (1 == inet_pton(AF_INET, buf, addr)) {
+		set_sockaddr(ss, AF_INET, addr);
+	}
+	else if (1 == inet_pton(AF_INET6, buf, addr)) {
+		set_sockaddr(ss, AF_INET6, addr);
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+/* The unspecified address of the family of addr. */
+static void set_unspecified(struct sockaddr_storage *ss, const struct sockaddr_storage *addr)
+{
+	static const u_char zeros[16] = {0};
+
+	set_sockaddr(ss, addr->ss_family, zeros);
+}
+
+static bool parse_qtype(const dlz_view_t &tok, uint16_t *uType)
+{
+	unsigned v;
+	const char *p;
+
+	for (size_t i = 0; i < sizeof(qtypes) / sizeof(qtypes[0]); ++i) {
+		if (tok.len == strlen(qtypes[i].sName) && 0 == memcmp(tok.data, qtypes[i].sName, tok.len)) {
+			*uType = qtypes[i].uType;
+			return true;
+		}
+	}
+
+	if (tok.len > 4 && tok.len <= 9 && 0 == memcmp(tok.data, "TYPE", 4)) {
+		p = tok.data + 4;
+		if (parse_uint(&p, tok.data + tok.len, tok.len - 4, &v) && v <= UINT16_MAX) {
+			*uType = v;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool parse_rcode(const dlz_view_t &tok, uint8_t *uRcode)
+{
+	unsigned v;
+	const char *p;
+
+	for (size_t i = 0; i < sizeof(rcodes) / sizeof(rcodes[0]); ++i) {
+		if (tok.len == strlen(rcodes[i]) && 0 == memcmp(tok.data, rcodes[i], tok.len)) {
+			*uRcode = i;
+			return true;
+		}
+	}
+
+	/* Unbound writes unknown rcodes as numbers. */
+	p = tok.data;
+	if (tok.len <= 2 && parse_uint(&p, tok.data + tok.len, tok.len, &v)) {
+		*uRcode = v;
+		return true;
+	}
+
+	return false;
+}
+
+/* Domain names without the trailing dot, like the text log. */
+static void set_qname(dlz_answer_t *a, const dlz_view_t &tok)
+{
+	a->rec.qname = tok;
+	if (a->rec.qname.len > 1 && '.' == a->rec.qname.data[a->rec.qname.len - 1]) {
+		a->rec.qname.len--;
+	}
+}
+
+/*
+	BIND query log:
+	19-Oct-2026 10:00:00.123 queries: info: client @0x7f1c 192.0.2.1#53510 (www.example.com):
+		query: www.example.com IN A +E(0)K (198.51.100.1)
+	The query log has neither the rcode nor the answers.
+*/
+static bool parse_bind_line(const char *line, size_t len, dlz_answer_t *a)
+{
+	const char *p = line, *end = line + len, *q;
+	dlz_view_t tok;
+
+	if (!parse_log_time(&p, end, &a->rec.time, &a->rec.nsec)) {
+		return false;
+	}
+
+	p = (const char *) memmem(p, end - p, "client ", 7);
+	if (NULL == p) {
+		return false;
+	}
+	p += 7;
+
+	if (p < end && '@' == *p && !next_token(&p, end, &tok)) {
+		return false;
+	}
+
+	if (!next_token(&p, end, &tok)) {
+		return false;
+	}
+
+	q = (const char *) memchr(tok.data, '#', tok.len);
+	if (NULL == q || !parse_ip(tok.data, q - tok.data, &a->rec.client)) {
+		return false;
+	}
+
+	p = (const char *) memmem(p, end - p, "query: ", 7);
+	if (NULL == p) {
+		return false;
+	}
+	p += 7;
+
+	if (!next_token(&p, end, &tok)) {
+		return false;
+	}
+	set_qname(a, tok);
+
+	/* Class, then type. */
+	if (!next_token(&p, end, &tok) || !next_token(&p, end, &tok) || !parse_qtype(tok, &a->rec.qtype)) {
+		return false;
+	}
+
+	/* The address the query was received on. */
+	q = (const char *) memrchr(p, '(', end - p);
+	if (NULL == q || end - q < 3 || ')' != end[-1] || !parse_ip(q + 1, end - q - 2, &a->rec.server)) {
+		set_unspecified(&a->rec.server, &a->rec.client);
+	}
+
+	a->rec.rcode = 0;
+	a->rec.ncnames = a->rec.naddr4s = a->rec.naddr6s = 0;
+
+	return true;
+}
+
+/*
+	Unbound reply log (log-replies: yes):
+	[1697000000] unbound[1234:0] info: 192.0.2.1 www.example.com. A IN NOERROR 0.000123 0 52
+	The tag is "reply:" instead of "info:" with log-tag-queryreply: yes.
+	The reply log has neither the server address nor the answers.
+*/
+static bool parse_unbound_line(const char *line, size_t len, dlz_answer_t *a)
+{
+	const char *p = line, *end = line + len, *q;
+	dlz_view_t tok;
+
+	if (!parse_log_time(&p, end, &a->rec.time, &a->rec.nsec)) {
+		return false;
+	}
+
+	/* The first of the two tags, the rest of the line has no ": ". */
+	q = (const char *) memmem(p, end - p, " info: ", 7);
+	p = (const char *) memmem(p, end - p, " reply: ", 8);
+	if (NULL != q && (NULL == p || q < p)) {
+		p = q + 7;
+	}
+	else if (NULL != p) {
+		p += 8;
+	}
+	else {
+		return false;
+	}
+
+	if (!next_token(&p, end, &tok)) {
+		return false;
+	}
+
+	/* Newer versions add the port. */
+	q = (const char *) memchr(tok.data, '@', tok.len);
+	if (!parse_ip(tok.data, NULL == q ? tok.len : q - tok.data, &a->rec.client)) {
+		return false;
+	}
+	set_unspecified(&a->rec.server, &a->rec.client);
+
+	if (!next_token(&p, end, &tok)) {
+		return false;
+	}
+	set_qname(a, tok);
+
+	/* Type, class, then rcode. */
+	if (!next_token(&p, end, &tok) || !parse_qtype(tok, &a->rec.qtype)
+			|| !next_token(&p, end, &tok) || !next_token(&p, end, &tok)
+			|| !parse_rcode(tok, &a->rec.rcode)) {
+		return false;
+	}
+
+	a->rec.ncnames = a->rec.naddr4s = a->rec.naddr6s = 0;
+
+	return true;
+}
+
+/*
+	Feed the lines of fd through the parser of the format. The lines it
+	does not recognize are skipped.
+*/
+static int read_lines(int fd, dlz_codec_t *codec, dlz_line_parser_pt pfnParse)
+{
+	dlz_answer_t *a = new dlz_answer_t;
+	char *buf = new char[LINE_BUF_SIZE], *p, *q, *last;
+	size_t have = 0;
+	ssize_t n;
+
+	reset_log_clock();
+
+	for ( ;; ) {
+		n = read(fd, buf + have, LINE_BUF_SIZE - have);
+		if (n <= 0) {
+			/* The last line may not end with LF. */
+			if (have > 0 && pfnParse(buf, have, a)) {
+				feed_answer(codec, a);
+			}
+			break;
+		}
+
+		have += n;
+		last = buf + have;
+
+		for (p = buf; NULL != (q = (char *) memchr(p, LF, last - p)); p = q + 1) {
+			if (pfnParse(p, q - p, a)) {
+				feed_answer(codec, a);
+			}
+		}
+
+		/* Drop a line longer than the buffer. */
+		have = p == buf && last == buf + LINE_BUF_SIZE ? 0 : last - p;
+		memmove(buf, p, have);
+	}
+
+	if (n < 0) {
+		std::cerr << "error: failed to read input: " << strerror(errno) << std::endl;
+	}
+
+	delete [] buf;
+	delete a;
+
+	return n < 0 ? DLZ_ERROR : DLZ_OK;
+}
+
+int read_format(const dlz_format_t *fmt, int fd, dlz_codec_t *codec)
+{
+	if (NULL != fmt->pfnRead) {
+		return fmt->pfnRead(fd, codec);
+	}
+
+	assert(NULL != fmt->pfnParseLine);
+	return read_lines(fd, codec, fmt->pfnParseLine);
+}
@@ -0,0 +1,161 @@
+/*
+	Merge mode: the logs of several resolvers, each sorted by time, are
+	merged by time into one encoder with a k-way merge on a min-heap, so
+	that the time differential never goes backwards and no external
+	sort -m pass over the data is needed.
+*/
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <util.h>
+#include "cli.h"
+
+#define MERGE_READ_SIZE (256 * 1024)
+
+typedef struct {
+	const char         *sPath;
+	int                 fd;
+	/* Index in the command line, ties go to the first input. */
+	int                 nIndex;
+	std::vector<char>   buf;
+	size_t              pos;
+	size_t              last;
+
+	/* Current line and its time. */
+	const char         *line;
+	size_t              len;
+	int64_t             time;
+} dlz_merge_input_t;
+
+/* Heap order: the input with the earliest line is on top. */
+static bool CompareMergeInput(const dlz_merge_input_t *a, const dlz_merge_input_t *b)
+{
+	return a->time != b->time ? a->time > b->time : a->nIndex > b->nIndex;
+}
+
+/* Fractional seconds have the same number of digits on every line. */
+static int64_t line_time(const char *line, size_t len)
+{
+	int64_t t = 0;
+
+	for (size_t i = 0; i < len && ((line[i] >= '0' && line[i] <= '9') || '.' == line[i]); ++i) {
+		if ('.' != line[i]) {
+			t = t * 10 + (line[i] - '0');
+		}
+	}
+
+	return t;
+}
+
+/*
+	Move to the next line of the input. Return false at its end.
+*/
+static bool merge_next(dlz_merge_input_t *in, int *rc)
+{
+	char *p, *q;
+	ssize_t n;
+
+	for ( ;; ) {
+		p = in->buf.data();
+		q = (char *) memchr(p + in->pos, LF, in->last - in->pos);
+
+		/* The last line may not end with LF. */
+		if (NULL != q || (in->fd < 0 && in->pos < in->last)) {
+			q = NULL != q ? q : p + in->last;
+			in->line = p + in->pos;
+			in->len = q - in->line;
+			in->time = line_time(in->line, in->len);
+			in->pos = q - p + (q < p + in->last);
+			return true;
+		}
+
+		if (in->fd < 0) {
+			return false;
+		}
+
+		/* Keep the partial line, grow the buffer for a long one. */
+		memmove(p, p + in->pos, in->last - in->pos);
+		in->last -= in->pos;
+		in->pos = 0;
+		if (in->last == in->buf.size()) {
+			in->buf.resize(2 * in->buf.size());
+		}
+
+		n = read(in->fd, in->buf.data() + in->last, in->buf.size() - in->last);
+		if (n > 0) {
+			in->last += n;
+			continue;
+		}
+
+		if (n < 0) {
+			std::cerr << "error: failed to read " << in->sPath << ": " << strerror(errno) << std::endl;
+			*rc = DLZ_ERROR;
+		}
+
+		if (STDIN_FILENO != in->fd) {
+			close(in->fd);
+		}
+		in->fd = -1;
+	}
+}
+
+int merge_files(char * const *vPaths, int nPaths, dlz_codec_t *codec)
+{
+	std::vector<dlz_merge_input_t> inputs(nPaths);
+	std::vector<dlz_merge_input_t *> heap;
+	dlz_merge_input_t *in;
+	int rc = DLZ_OK;
+
+	for (int i = 0; i < nPaths; ++i) {
+		in = &inputs[i];
+		in->sPath = vPaths[i];
+		in->nIndex = i;
+		in->fd = strcmp(vPaths[i], "-") ? open(vPaths[i], O_RDONLY) : STDIN_FILENO;
+		in->buf.resize(MERGE_READ_SIZE);
+		in->pos = in->last = 0;
+
+		if (in->fd < 0) {
+			std::cerr << "error: failed to open " << vPaths[i] << ": " << strerror(errno) << std::endl;
+			rc = DLZ_ERROR;
+			break;
+		}
+
+		if (merge_next(in, &rc)) {
+			heap.push_back(in);
+		}
+	}
+
+	if (DLZ_OK != rc) {
+		for (int i = 0; i < nPaths; ++i) {
+			if (inputs[i].fd > STDIN_FILENO) {
+				close(inputs[i].fd);
+			}
+		}
+
+		return rc;
+	}
+
+	std::make_heap(heap.begin(), heap.end(), CompareMergeInput);
+
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), CompareMergeInput);
+		in = heap.back();
+
+		dlz_codec_feed_line(codec, in->line, in->len);
+
+		if (merge_next(in, &rc)) {
+			std::push_heap(heap.begin(), heap.end(), CompareMergeInput);
+		}
+		else {
+			heap.pop_back();
+		}
+	}
+
+	return rc;
+}
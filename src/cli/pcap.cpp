@@ -0,0 +1,475 @@
+/*
+	pcap mode: encode the DNS transactions of a packet capture, classic pcap
+	or pcapng, without going through a text log.
+
+	Only DNS over UDP port 53 is considered. A response is matched to its
+	query by the addresses, the client port and the DNS ID, and the record
+	takes the time of the query. Its question, rcode and CNAME/A/AAAA
+	answers are parsed from the wire format and pushed to the encoder with
+	dlz_codec_feed_record(). A response without a query in the capture
+	is still encoded, with its own time.
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include <Config.hpp>
+#include <util.h>
+#include "cli.h"
+
+#define PCAP_MAGIC_USEC     0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+#define PCAPNG_SHB          0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER   0x1a2b3c4d
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_OPT_TSRESOL  9
+
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LOOP       108
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define DNS_PORT            53
+
+/* Larger records or blocks are taken for a corrupt capture. */
+#define PCAP_MAX_RECORD_SIZE (16 * 1024 * 1024)
+
+/* Queries without a response are dropped after this many seconds. */
+#define QUERY_TIMEOUT       30
+
+/* One packet, down to the UDP payload. Times are in nanoseconds. */
+typedef struct {
+	int64_t                  time;
+	struct sockaddr_storage  src;
+	struct sockaddr_storage  dst;
+	uint16_t                 sport;
+	uint16_t                 dport;
+	const u_char            *data;
+	size_t                   len;
+} dlz_packet_t;
+
+typedef struct {
+	int64_t time;
+} dlz_query_t;
+
+typedef struct {
+	dlz_codec_t  *codec;
+
+	std::unordered_map<std::string, dlz_query_t> queries;
+	int64_t       lastExpire;
+
+	dlz_answer_t  answer;
+} dlz_pcap_t;
+
+static inline uint16_t get16(const u_char *p, bool bSwap)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return bSwap ? __builtin_bswap16(v) : v;
+}
+
+static inline uint32_t get32(const u_char *p, bool bSwap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return bSwap ? __builtin_bswap32(v) : v;
+}
+
+/*
+	Decode the UDP datagram in an IP packet. Return false if it is something else.
+*/
+static bool parse_ip(const u_char *p, size_t len, dlz_packet_t *pkt)
+{
+	size_t hlen;
+	uint8_t next;
+
+	if (len < 1) {
+		return false;
+	}
+
+	if (4 == (p[0] >> 4)) {
+		hlen = (p[0] & 0x0f) * 4;
+		/* Fragments are not reassembled. */
+		if (len < 20 || hlen < 20 || len < hlen || 17 != p[9] || (get16be(p + 6) & 0x3fff)) {
+			return false;
+		}
+
+		len = (size_t) get16be(p + 2) < len ? get16be(p + 2) : len;
+		if (len < hlen) {
+			return false;
+		}
+		set_sockaddr(&pkt->src, AF_INET, p + 12);
+		set_sockaddr(&pkt->dst, AF_INET, p + 16);
+	}
+	else if (6 == (p[0] >> 4)) {
+		if (len < 40) {
+			return false;
+		}
+
+		hlen = 40 + (size_t) get16be(p + 4);
+		len = hlen < len ? hlen : len;
+		set_sockaddr(&pkt->src, AF_INET6, p + 8);
+		set_sockaddr(&pkt->dst, AF_INET6, p + 24);
+
+		/* Skip the hop-by-hop, routing and destination options headers. */
+		next = p[6];
+		hlen = 40;
+		while ((0 == next || 43 == next || 60 == next) && len >= hlen + 8) {
+			next = p[hlen];
+			hlen += (p[hlen + 1] + 1) * 8;
+		}
+
+		if (17 != next || len < hlen) {
+			return false;
+		}
+	}
+	else {
+		return false;
+	}
+
+	p += hlen;
+	len -= hlen;
+	if (len < 8) {
+		return false;
+	}
+
+	hlen = get16be(p + 4);
+	if (hlen < 8) {
+		return false;
+	}
+
+	pkt->sport = get16be(p);
+	pkt->dport = get16be(p + 2);
+	pkt->data = p + 8;
+	pkt->len = (hlen < len ? hlen : len) - 8;
+
+	return true;
+}
+
+/*
+	Strip the link layer header.
+*/
+static bool parse_link(uint32_t uLinkType, const u_char *p, size_t len, dlz_packet_t *pkt)
+{
+	uint16_t proto;
+	size_t off;
+
+	switch (uLinkType) {
+		case LINKTYPE_ETHERNET:
+			off = 12;
+			if (len < off + 2) {
+				return false;
+			}
+
+			proto = get16be(p + off);
+			/* VLAN tags */
+			while ((0x8100 == proto || 0x88a8 == proto) && len >= off + 6) {
+				off += 4;
+				proto = get16be(p + off);
+			}
+
+			off += 2;
+			break;
+
+		case LINKTYPE_LINUX_SLL:
+			off = 16;
+			if (len < off) {
+				return false;
+			}
+			proto = get16be(p + 14);
+			break;
+
+		case LINKTYPE_LINUX_SLL2:
+			off = 20;
+			if (len < off) {
+				return false;
+			}
+			proto = get16be(p);
+			break;
+
+		case LINKTYPE_NULL:
+		case LINKTYPE_LOOP:
+			/* Address family in host or network byte order, IP version is enough. */
+			off = 4;
+			proto = 0x0800;
+			break;
+
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			off = 0;
+			proto = 0x0800;
+			break;
+
+		default:
+			return false;
+	}
+
+	if (len < off || (0x0800 != proto && 0x86dd != proto)) {
+		return false;
+	}
+
+	return parse_ip(p + off, len - off, pkt);
+}
+
+/*
+	Key of a transaction: client address and port, server address, DNS ID.
+*/
+static std::string query_key(const struct sockaddr_storage &client, uint16_t port,
+								const struct sockaddr_storage &server, uint16_t id)
+{
+	size_t alen = AF_INET == client.ss_family ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+	std::string key((const char *) &client, alen);
+
+	key.append((const char *) &server, alen);
+	key.append((const char *) &port, sizeof(port));
+	key.append((const char *) &id, sizeof(id));
+
+	return key;
+}
+
+static void expire_queries(dlz_pcap_t *pc, int64_t now)
+{
+	if (now - pc->lastExpire < QUERY_TIMEOUT * NSEC_PER_SEC) {
+		return;
+	}
+
+	for (auto it = pc->queries.begin(); it != pc->queries.end(); ) {
+		if (now - it->second.time > QUERY_TIMEOUT * NSEC_PER_SEC) {
+			it = pc->queries.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	pc->lastExpire = now;
+}
+
+static void parse_dns(dlz_pcap_t *pc, const dlz_packet_t *pkt)
+{
+	const u_char *msg = pkt->data;
+	uint16_t id;
+	int64_t time;
+
+	/* One question, standard query. */
+	if (pkt->len < DNS_HEADER_SIZE || 1 != get16be(msg + 4) || 0 != (msg[2] & 0x78)) {
+		return;
+	}
+
+	id = get16be(msg);
+
+	if (0 == (msg[2] & 0x80)) {
+		if (DNS_PORT == pkt->dport) {
+			pc->queries[query_key(pkt->src, pkt->sport, pkt->dst, id)].time = pkt->time;
+		}
+		return;
+	}
+
+	if (DNS_PORT != pkt->sport) {
+		return;
+	}
+
+	time = pkt->time;
+	auto it = pc->queries.find(query_key(pkt->dst, pkt->dport, pkt->src, id));
+	if (it != pc->queries.end()) {
+		time = it->second.time;
+		pc->queries.erase(it);
+	}
+
+	if (parse_dns_response(msg, pkt->len, &pc->answer)) {
+		pc->answer.rec.time = time / NSEC_PER_SEC;
+		pc->answer.rec.nsec = time % NSEC_PER_SEC;
+		pc->answer.rec.client = pkt->dst;
+		pc->answer.rec.server = pkt->src;
+		feed_answer(pc->codec, &pc->answer);
+	}
+
+	expire_queries(pc, pkt->time);
+}
+
+static void parse_packet(dlz_pcap_t *pc, uint32_t uLinkType, int64_t time, const u_char *p, size_t len)
+{
+	dlz_packet_t pkt;
+
+	if (!parse_link(uLinkType, p, len, &pkt)) {
+		return;
+	}
+
+	if (DNS_PORT != pkt.sport && DNS_PORT != pkt.dport) {
+		return;
+	}
+
+	pkt.time = time;
+	parse_dns(pc, &pkt);
+}
+
+static int read_classic(dlz_pcap_t *pc, dlz_input_t *in, const u_char *hdr)
+{
+	const u_char *p;
+	uint32_t uMagic, uLinkType, uCapLen, uFracNsec;
+	int64_t time;
+	bool bSwap;
+
+	uMagic = get32(hdr, false);
+	bSwap = PCAP_MAGIC_USEC != uMagic && PCAP_MAGIC_NSEC != uMagic;
+
+	p = input_next(in, 20);
+	if (NULL == p) {
+		return DLZ_ERROR;
+	}
+	uLinkType = get32(p + 16, bSwap) & 0xffff;
+	uFracNsec = PCAP_MAGIC_NSEC == uMagic || PCAP_MAGIC_NSEC == __builtin_bswap32(uMagic) ? 1 : 1000;
+
+	while (NULL != (p = input_next(in, 16))) {
+		uCapLen = get32(p + 8, bSwap);
+		time = get32(p, bSwap) * NSEC_PER_SEC + (int64_t) get32(p + 4, bSwap) * uFracNsec;
+
+		if (uCapLen > PCAP_MAX_RECORD_SIZE) {
+			std::cerr << "error: malformed pcap file" << std::endl;
+			return DLZ_ERROR;
+		}
+
+		p = input_next(in, uCapLen);
+		if (NULL == p) {
+			std::cerr << "error: truncated pcap file" << std::endl;
+			return DLZ_ERROR;
+		}
+
+		parse_packet(pc, uLinkType, time, p, uCapLen);
+	}
+
+	return DLZ_OK;
+}
+
+static int read_pcapng(dlz_pcap_t *pc, dlz_input_t *in, const u_char *hdr)
+{
+	/* Link type and timestamp units per second of the interfaces. */
+	std::vector<std::pair<uint32_t, uint64_t> > ifaces;
+	const u_char *p, *opt, *end;
+	uint32_t uType, uLen, uIface, uCapLen;
+	uint64_t ts, units;
+	bool bSwap = false;
+
+	uType = get32(hdr, false);
+
+	for ( ;; ) {
+		if (PCAPNG_SHB == uType) {
+			/* The byte order of the section. */
+			p = input_next(in, 8);
+			if (NULL == p) {
+				return DLZ_ERROR;
+			}
+
+			bSwap = PCAPNG_BYTE_ORDER != get32(p + 4, false);
+			uLen = get32(p, bSwap);
+			if (uLen < 12 || uLen > PCAP_MAX_RECORD_SIZE || NULL == input_next(in, uLen - 12)) {
+				return DLZ_ERROR;
+			}
+			ifaces.clear();
+		}
+		else {
+			p = input_next(in, 4);
+			if (NULL == p) {
+				return DLZ_ERROR;
+			}
+
+			uLen = get32(p, bSwap);
+			if (uLen > PCAP_MAX_RECORD_SIZE) {
+				std::cerr << "error: malformed pcapng file" << std::endl;
+				return DLZ_ERROR;
+			}
+
+			p = uLen >= 12 ? input_next(in, uLen - 8) : NULL;
+			if (NULL == p) {
+				std::cerr << "error: truncated pcapng file" << std::endl;
+				return DLZ_ERROR;
+			}
+			end = p + uLen - 12;
+
+			if (PCAPNG_IDB == uType && uLen >= 20) {
+				units = 1000000;
+
+				for (opt = p + 8; opt + 4 <= end && 0 != get16(opt, bSwap); ) {
+					if (PCAPNG_OPT_TSRESOL == get16(opt, bSwap) && opt + 5 <= end) {
+						units = (opt[4] & 0x80) ? (1ULL << (opt[4] & 0x7f)) : 1;
+						for (int i = 0; !(opt[4] & 0x80) && i < opt[4]; ++i) {
+							units *= 10;
+						}
+					}
+					opt += 4 + ((get16(opt + 2, bSwap) + 3) & ~3);
+				}
+
+				ifaces.push_back(std::make_pair(get16(p, bSwap), units));
+			}
+			else if (PCAPNG_EPB == uType && uLen >= 32) {
+				uIface = get32(p, bSwap);
+				uCapLen = get32(p + 12, bSwap);
+
+				if (uIface < ifaces.size() && p + 20 + uCapLen <= end) {
+					ts = ((uint64_t) get32(p + 4, bSwap) << 32) | get32(p + 8, bSwap);
+					units = ifaces[uIface].second;
+					parse_packet(pc, ifaces[uIface].first,
+									ts / units * NSEC_PER_SEC + ts % units * NSEC_PER_SEC / units,
+									p + 20, uCapLen);
+				}
+			}
+		}
+
+		p = input_next(in, 4);
+		if (NULL == p) {
+			return DLZ_OK;
+		}
+		uType = get32(p, bSwap);
+	}
+}
+
+int read_pcap(int fd, dlz_codec_t *codec)
+{
+	dlz_input_t in;
+	dlz_pcap_t *pc;
+	const u_char *hdr;
+	uint32_t uMagic;
+	int rc;
+
+	input_init(&in, fd);
+
+	hdr = input_next(&in, 4);
+	if (NULL == hdr) {
+		return DLZ_OK;
+	}
+
+	pc = new dlz_pcap_t;
+	pc->codec = codec;
+	pc->lastExpire = 0;
+
+	uMagic = get32(hdr, false);
+	if (PCAPNG_SHB == uMagic) {
+		rc = read_pcapng(pc, &in, hdr);
+	}
+	else if (PCAP_MAGIC_USEC == uMagic || PCAP_MAGIC_NSEC == uMagic
+			|| PCAP_MAGIC_USEC == __builtin_bswap32(uMagic) || PCAP_MAGIC_NSEC == __builtin_bswap32(uMagic)) {
+		rc = read_classic(pc, &in, hdr);
+	}
+	else {
+		std::cerr << "error: not a pcap or pcapng file" << std::endl;
+		rc = DLZ_ERROR;
+	}
+
+	delete pc;
+
+	return rc;
+}
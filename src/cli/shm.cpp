@@ -0,0 +1,124 @@
+/*
+	Shared memory mode: encode the lines of a co-located producer straight
+	from a dlz_ring_t, see dlz_ring.h.
+*/
+#include <cstring>
+
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <util.h>
+#include <dlz_ring.h>
+#include "cli.h"
+
+/* Give the room back to the producer after this many bytes. */
+#define RING_RELEASE_BYTES  (256 * 1024)
+
+/* Idle waits: yield a few times, then sleep up to the max. */
+#define RING_IDLE_YIELDS    64
+#define RING_IDLE_SLEEP_MAX 1000000
+
+static void ring_idle(unsigned int uIdle, int timeout)
+{
+	struct timespec ts;
+	long ns;
+
+	if (uIdle < RING_IDLE_YIELDS) {
+		sched_yield();
+		return;
+	}
+
+	ns = 1000L << (uIdle - RING_IDLE_YIELDS < 10 ? uIdle - RING_IDLE_YIELDS : 10);
+	ns = ns > RING_IDLE_SLEEP_MAX ? RING_IDLE_SLEEP_MAX : ns;
+	if (timeout >= 0 && ns > timeout * 1000000L) {
+		ns = timeout * 1000000L;
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = ns;
+	nanosleep(&ts, NULL);
+}
+
+/*
+	Tokenize the lines in the ring memory, up to head.
+*/
+static void ring_consume(dlz_ring_t *r, dlz_codec_t *codec, uint64_t head)
+{
+	char *p, *q, *last;
+
+	while (r->pos < head) {
+		p = r->data + (r->pos & (r->size - 1));
+		last = p + (head - r->pos > RING_RELEASE_BYTES ? RING_RELEASE_BYTES : head - r->pos);
+
+		for ( ;; ) {
+			q = (char *) memchr(p, LF, last - p);
+			if (NULL == q) {
+				break;
+			}
+
+			dlz_codec_feed_line(codec, p, q - p);
+			p = q + 1;
+		}
+
+		/* A line longer than RING_RELEASE_BYTES. */
+		if (p == r->data + (r->pos & (r->size - 1))) {
+			q = (char *) memchr(p, LF, head - r->pos);
+			assert(NULL != q);
+
+			dlz_codec_feed_line(codec, p, q - p);
+			p = q + 1;
+		}
+
+		r->pos += p - (r->data + (r->pos & (r->size - 1)));
+		__atomic_store_n(&r->hdr->tail, r->pos, __ATOMIC_RELEASE);
+	}
+}
+
+int consume_ring(const char *sName, dlz_codec_t *codec, int nMaxDelay)
+{
+	dlz_ring_t r;
+	dlz_delay_t delay = {0, 0};
+	sigset_t origMask;
+	unsigned int uIdle = 0;
+	uint64_t head;
+	int timeout;
+
+	/* Signals only set bStopRequested, the waits below are short. */
+	catch_stop_signals(&origMask);
+	sigprocmask(SIG_SETMASK, &origMask, NULL);
+
+	/* Wait for the producer. */
+	while (0 != dlz_ring_attach(&r, sName)) {
+		if (bStopRequested) {
+			return DLZ_OK;
+		}
+
+		ring_idle(RING_IDLE_YIELDS + 10, -1);
+	}
+
+	while (!bStopRequested) {
+		head = __atomic_load_n(&r.hdr->head, __ATOMIC_ACQUIRE);
+
+		if (head != r.pos) {
+			ring_consume(&r, codec, head);
+			delay_update(&delay, codec, nMaxDelay);
+			uIdle = 0;
+			continue;
+		}
+
+		/* head is published before closed. */
+		if (__atomic_load_n(&r.hdr->closed, __ATOMIC_ACQUIRE)
+				&& __atomic_load_n(&r.hdr->head, __ATOMIC_ACQUIRE) == r.pos) {
+			shm_unlink(sName);
+			break;
+		}
+
+		timeout = delay_wait(&delay, codec, nMaxDelay);
+		ring_idle(uIdle++, timeout);
+	}
+
+	dlz_ring_detach(&r);
+
+	return DLZ_OK;
+}
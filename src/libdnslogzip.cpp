@@ -0,0 +1,530 @@
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+
+#include <util.h>
+#include <DNSLogzip.hpp>
+#include <dnslogzip.h>
+
+/* Names and chunk output on the heap, per line. */
+#define LINE_HEAP_BYTES       256
+/* A smaller chunk would compress poorly. */
+#define MIN_MEM_BUDGET_LINES  1000
+
+struct dlz_codec_s {
+	DNSLogzip *reducer;
+	int nSpillFd;
+
+	/* The incomplete line of the last feed. */
+	std::string carry;
+	dlz_row_t row;
+	/* Lines with too many columns to be split, see dlz_stats_t. */
+	uint64_t uBadLines;
+};
+
+void dlz_options_init(dlz_options_t *opts)
+{
+	opts->func_mask = DEFAULT_FUNC_MASK;
+	opts->chunk_lines = DEFAULT_LINE_SORTING_BUF_SIZE;
+	opts->base_num = DEFAULT_BASE_NUM;
+	opts->max_chunk_bytes = 0;
+	opts->time_precision = 0;
+	opts->run_lines = 0;
+	opts->spill_dir = NULL;
+	opts->adaptive_min_lines = 0;
+	opts->chunk_latency_ms = 0;
+}
+
+/*
+	Memory of a chunk line: the record and its pointer, its share of the
+	RR pool, plus the heap of its names and of the chunk output. An encoder
+	also has the sort columns of the line and its share of the sort buffers.
+	The encoder ends a chunk early when its answers take more than that
+	share of the pool, so the budget holds for answer-heavy logs too.
+*/
+static size_t dlz_line_bytes(void)
+{
+	size_t uPool = RRPOOL_SIZE_PER_LINE * (sizeof(RRAddr) + sizeof(std::string) + 2 * sizeof(void *));
+	size_t uSort = sizeof(uint16_t) + 5 * sizeof(uint32_t) + sizeof(std::pair<uint64_t, uint32_t>) + 3 * sizeof(void *);
+	size_t uEncoder = sizeof(DNSRecordC) + sizeof(DNSRecordC *) + uSort;
+	size_t uDecoder = sizeof(DNSRecordD) + sizeof(DNSRecordD *) + 2 * sizeof(std::string);
+
+	return std::max(uEncoder, uDecoder) + uPool + LINE_HEAP_BYTES;
+}
+
+int dlz_options_set_mem_budget(dlz_options_t *opts, size_t budget)
+{
+	size_t n = budget / dlz_line_bytes();
+
+	if (n < MIN_MEM_BUDGET_LINES) {
+		return DLZ_ERROR;
+	}
+
+	opts->chunk_lines = n < MAX_LINE_SORTING_BUF_SIZE ? n : MAX_LINE_SORTING_BUF_SIZE;
+
+	return DLZ_OK;
+}
+
+/*
+	Return the options to use, NULL if they are invalid.
+*/
+static const dlz_options_t *dlz_options_check(const dlz_options_t *opts, dlz_options_t *defaults)
+{
+	if (NULL == opts) {
+		dlz_options_init(defaults);
+		return defaults;
+	}
+
+	if (0 == opts->chunk_lines || opts->chunk_lines > MAX_LINE_SORTING_BUF_SIZE
+			|| opts->base_num < 2 || opts->base_num > 10 + 26 + 26
+			|| opts->time_precision > MAX_TIME_PRECISION
+			|| (opts->run_lines > 0 && opts->run_lines < MIN_RUN_LINES)
+			|| opts->adaptive_min_lines > opts->chunk_lines) {
+		return NULL;
+	}
+
+	return opts;
+}
+
+/*
+	Create the file the runs of an encoder are spilled to, unlinked at once
+	so that it goes away with the codec. Return -1 on error.
+*/
+static int dlz_spill_open(const char *sDir)
+{
+	std::string sPath;
+	int fd;
+
+	if (NULL == sDir) {
+		sDir = getenv("TMPDIR");
+	}
+
+	sPath = NULL != sDir && '\0' != sDir[0] ? sDir : "/tmp";
+	sPath += "/dnslogzip.XXXXXX";
+
+	fd = mkstemp(&sPath[0]);
+	if (fd >= 0) {
+		unlink(sPath.c_str());
+	}
+
+	return fd;
+}
+
+static dlz_codec_t *dlz_codec_create(bool bDecompression, const dlz_options_t *opts,
+										dlz_chunk_handler_pt handler, void *arg)
+{
+	dlz_options_t defaults;
+	dlz_codec_t *codec;
+
+	opts = dlz_options_check(opts, &defaults);
+	if (NULL == opts) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	DNSLogzipCtx ctx(opts->func_mask, opts->chunk_lines, opts->base_num);
+	ctx.uMaxChunkBytes = opts->max_chunk_bytes;
+	ctx.ucTimePrecision = opts->time_precision;
+	ctx.uMinLines = opts->adaptive_min_lines;
+	ctx.uChunkLatencyMs = opts->chunk_latency_ms;
+	ctx.pfnOutput = handler;
+	ctx.pOutputArg = arg;
+
+	if (!bDecompression && opts->run_lines > 0 && opts->run_lines < opts->chunk_lines) {
+		ctx.uRunLines = opts->run_lines;
+		ctx.nSpillFd = dlz_spill_open(opts->spill_dir);
+		if (ctx.nSpillFd < 0) {
+			return NULL;
+		}
+	}
+
+	/* A C caller cannot catch std::bad_alloc. */
+	codec = new (std::nothrow) dlz_codec_t;
+	try {
+		if (NULL == codec) {
+			throw std::bad_alloc();
+		}
+		codec->reducer = CreateDNSLogzip(bDecompression, ctx);
+	}
+	catch (const std::bad_alloc &) {
+		delete codec;
+		if (ctx.nSpillFd >= 0) {
+			close(ctx.nSpillFd);
+		}
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	codec->nSpillFd = ctx.nSpillFd;
+	codec->uBadLines = 0;
+
+	return codec;
+}
+
+dlz_codec_t *dlz_encoder_create(const dlz_options_t *opts, dlz_chunk_handler_pt handler, void *arg)
+{
+	return dlz_codec_create(false, opts, handler, arg);
+}
+
+dlz_codec_t *dlz_decoder_create(const dlz_options_t *opts, dlz_chunk_handler_pt handler, void *arg)
+{
+	return dlz_codec_create(true, opts, handler, arg);
+}
+
+static int dlz_codec_process(dlz_codec_t *codec, const char *line, size_t len)
+{
+	/* The codec only reads the columns. */
+	if (READ_LINE_OK != dlz_split_line(&codec->row, (char *) line, (char *) line + len)) {
+		codec->uBadLines++;
+		return DLZ_ERROR;
+	}
+
+	return codec->reducer->Process(&codec->row);
+}
+
+int dlz_codec_feed_line(dlz_codec_t *codec, const char *line, size_t len)
+{
+	try {
+		return dlz_codec_process(codec, line, len);
+	}
+	catch (const std::bad_alloc &) {
+		return DLZ_ERROR;
+	}
+}
+
+static int dlz_codec_process_data(dlz_codec_t *codec, const char *data, size_t len)
+{
+	const char *p, *last = data + len;
+	int rc = DLZ_OK;
+
+	/* Complete the line left over by the last feed. */
+	if (!codec->carry.empty()) {
+		p = (const char *) memchr(data, LF, len);
+		if (NULL == p) {
+			codec->carry.append(data, len);
+			return DLZ_OK;
+		}
+
+		codec->carry.append(data, p - data);
+		if (DLZ_OK != dlz_codec_process(codec, codec->carry.data(), codec->carry.size())) {
+			rc = DLZ_ERROR;
+		}
+		codec->carry.clear();
+		data = p + 1;
+	}
+
+	/* Tokenize the complete lines in place. */
+	while (data < last) {
+		p = (const char *) memchr(data, LF, last - data);
+		if (NULL == p) {
+			codec->carry.assign(data, last - data);
+			break;
+		}
+
+		if (DLZ_OK != dlz_codec_process(codec, data, p - data)) {
+			rc = DLZ_ERROR;
+		}
+		data = p + 1;
+	}
+
+	return rc;
+}
+
+int dlz_codec_feed(dlz_codec_t *codec, const char *data, size_t len)
+{
+	try {
+		return dlz_codec_process_data(codec, data, len);
+	}
+	catch (const std::bad_alloc &) {
+		return DLZ_ERROR;
+	}
+}
+
+int dlz_codec_feed_record(dlz_codec_t *codec, const dlz_record_t *rec, const dlz_view_t *cnames,
+							const struct sockaddr_storage *addr4s, const struct sockaddr_storage *addr6s)
+{
+	try {
+		return codec->reducer->ProcessRecord(rec, cnames, addr4s, addr6s);
+	}
+	catch (const std::bad_alloc &) {
+		return DLZ_ERROR;
+	}
+}
+
+int dlz_codec_finish(dlz_codec_t *codec)
+{
+	int rc = DLZ_OK;
+
+	try {
+		if (!codec->carry.empty()) {
+			rc = dlz_codec_process(codec, codec->carry.data(), codec->carry.size());
+			codec->carry.clear();
+		}
+
+		codec->reducer->Finish();
+	}
+	catch (const std::bad_alloc &) {
+		return DLZ_ERROR;
+	}
+
+	return rc;
+}
+
+size_t dlz_codec_discard(dlz_codec_t *codec)
+{
+	size_t len = codec->carry.size();
+
+	codec->carry.clear();
+
+	return len;
+}
+
+int dlz_codec_flush(dlz_codec_t *codec)
+{
+	try {
+		codec->reducer->Flush();
+	}
+	catch (const std::bad_alloc &) {
+		return DLZ_ERROR;
+	}
+
+	return DLZ_OK;
+}
+
+size_t dlz_codec_pending(const dlz_codec_t *codec)
+{
+	return codec->reducer->PendingLines();
+}
+
+void dlz_codec_stats(const dlz_codec_t *codec, dlz_stats_t *stats)
+{
+	codec->reducer->GetStats(stats);
+	stats->bad_lines += codec->uBadLines;
+}
+
+void dlz_codec_destroy(dlz_codec_t *codec)
+{
+	delete codec->reducer;
+
+	if (codec->nSpillFd >= 0) {
+		close(codec->nSpillFd);
+	}
+
+	delete codec;
+}
+
+struct dlz_reader_s {
+	DNSLogzip *reducer;
+	int fd;
+
+	/* The lines read, the unread ones from off on. */
+	std::string buf;
+	size_t off;
+	dlz_row_t row;
+
+	/* Position in the ready chunk. */
+	size_t pos;
+	bool   eof;
+	bool   error;
+};
+
+dlz_reader_t *dlz_reader_create(const dlz_options_t *opts, int fd)
+{
+	dlz_options_t defaults;
+	dlz_reader_t *reader;
+
+	opts = dlz_options_check(opts, &defaults);
+	if (NULL == opts) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	DNSLogzipCtx ctx(opts->func_mask, opts->chunk_lines, opts->base_num);
+	ctx.ucTimePrecision = opts->time_precision;
+	ctx.uMinLines = opts->adaptive_min_lines;
+	ctx.bRecordMode = true;
+
+	reader = new (std::nothrow) dlz_reader_t;
+	try {
+		if (NULL == reader) {
+			throw std::bad_alloc();
+		}
+		reader->reducer = CreateDNSLogzip(true, ctx);
+	}
+	catch (const std::bad_alloc &) {
+		delete reader;
+		errno = ENOMEM;
+		return NULL;
+	}
+	reader->fd = fd;
+	reader->off = 0;
+	reader->pos = 0;
+	reader->eof = false;
+	reader->error = false;
+
+	return reader;
+}
+
+/*
+	Decode the line [start, last). Return false if it has too many columns.
+*/
+static bool dlz_reader_line(dlz_reader_t *reader, const char *start, const char *last)
+{
+	if (READ_LINE_OK != dlz_split_line(&reader->row, (char *) start, (char *) last)) {
+		return false;
+	}
+
+	reader->reducer->Process(&reader->row);
+
+	return true;
+}
+
+/* Decode lines until a chunk is complete, see dlz_reader_fill(). */
+static int dlz_reader_decode(dlz_reader_t *reader)
+{
+	DNSLogzip *reducer = reader->reducer;
+	std::string &buf = reader->buf;
+	const char *p;
+	size_t len;
+	ssize_t n;
+
+	if (reader->pos < reducer->ReadyRecords()) {
+		return 1;
+	}
+
+	if (reducer->ReadyRecords() > 0) {
+		reducer->ReleaseRecords();
+		reader->pos = 0;
+	}
+
+	if (reader->error) {
+		return DLZ_ERROR;
+	}
+
+	/* Decode lines until a chunk is complete. */
+	while (!reader->eof && 0 == reducer->ReadyRecords()) {
+		p = (const char *) memchr(buf.data() + reader->off, LF, buf.size() - reader->off);
+		if (NULL != p) {
+			if (!dlz_reader_line(reader, buf.data() + reader->off, p)) {
+				reader->error = true;
+				return DLZ_ERROR;
+			}
+
+			reader->off = p + 1 - buf.data();
+			continue;
+		}
+
+		/* Keep the incomplete line and read more. */
+		buf.erase(0, reader->off);
+		reader->off = 0;
+
+		len = buf.size();
+		buf.resize(len + CHUCK_SIZE);
+		n = read(reader->fd, &buf[len], CHUCK_SIZE);
+		buf.resize(n > 0 ? len + n : len);
+
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+
+			reader->error = true;
+			return DLZ_ERROR;
+		}
+
+		if (0 == n) {
+			/* A last line without LF. */
+			if (!buf.empty() && !dlz_reader_line(reader, buf.data(), buf.data() + buf.size())) {
+				reader->error = true;
+				return DLZ_ERROR;
+			}
+
+			buf.clear();
+			reader->eof = true;
+			reducer->Finish();
+		}
+	}
+
+	return reducer->ReadyRecords() > 0 ? 1 : 0;
+}
+
+/*
+	Make sure a chunk with unread records is ready. Return 1 if it is,
+	0 at the end of the input, -1 on a read error, a malformed line or
+	when the memory runs out.
+*/
+static int dlz_reader_fill(dlz_reader_t *reader)
+{
+	try {
+		return dlz_reader_decode(reader);
+	}
+	catch (const std::bad_alloc &) {
+		reader->error = true;
+		return DLZ_ERROR;
+	}
+}
+
+int dlz_reader_next(dlz_reader_t *reader, dlz_record_t *rec)
+{
+	int rc = dlz_reader_fill(reader);
+
+	if (1 != rc) {
+		return rc;
+	}
+
+	reader->reducer->GetRecord(reader->pos++, rec);
+	return 1;
+}
+
+ssize_t dlz_reader_next_batch(dlz_reader_t *reader, dlz_record_t *recs, size_t n)
+{
+	size_t i;
+	int rc = dlz_reader_fill(reader);
+
+	if (1 != rc) {
+		return rc;
+	}
+
+	for (i = 0; i < n && reader->pos < reader->reducer->ReadyRecords(); ++i) {
+		reader->reducer->GetRecord(reader->pos++, &recs[i]);
+	}
+
+	return i;
+}
+
+void dlz_reader_destroy(dlz_reader_t *reader)
+{
+	delete reader->reducer;
+	delete reader;
+}
+
+dlz_view_t dlz_record_cname(const dlz_record_t *rec, unsigned i)
+{
+	const DNSRecordD *r = (const DNSRecordD *) rec->priv;
+	dlz_view_t v;
+
+	assert(i < r->cnameRRSet.size);
+	v.data = r->cnameRRSet.rrs[i]->data();
+	v.len  = r->cnameRRSet.rrs[i]->size();
+
+	return v;
+}
+
+const struct sockaddr_storage *dlz_record_addr4(const dlz_record_t *rec, unsigned i)
+{
+	const DNSRecordD *r = (const DNSRecordD *) rec->priv;
+
+	assert(i < r->addr4RRSet.size);
+	return &r->addr4RRSet.rrs[i]->addr;
+}
+
+const struct sockaddr_storage *dlz_record_addr6(const dlz_record_t *rec, unsigned i)
+{
+	const DNSRecordD *r = (const DNSRecordD *) rec->priv;
+
+	assert(i < r->addr6RRSet.size);
+	return &r->addr6RRSet.rrs[i]->addr;
+}
@@ -1,25 +1,46 @@
 #include <iostream>
+#include <iomanip>
+#include <string>
 #include <cstring>
 #include <cassert>
 #include <cmath>
+#include <cerrno>
 
 #include <unistd.h>
-#include <util.h>
-#include <DNSLogzip.hpp>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <dnslogzip.h>
+#include "cli/cli.h"
 
-unsigned int  g_uFuncMask = 0xFF;
-unsigned int  g_uLineSortingBufSize = 30000;
-unsigned char g_ucBaseNum = 32;
-unsigned char g_ucLocStrFixedLen  = 5;
+#define READ_BLOCK_SIZE 65536
+
+/* Long options without a short equivalent. */
+#define OPT_MAX_DELAY 256
+#define OPT_MAX_BYTES 257
+#define OPT_LISTEN    258
+#define OPT_DGRAM     259
+#define OPT_ROTATE    260
+#define OPT_SHM       261
+#define OPT_FORMAT    262
+#define OPT_TIME_PRECISION 263
+#define OPT_MEM_BUDGET 264
+#define OPT_RUN_LINES  265
+#define OPT_TMP_DIR    266
+#define OPT_ADAPTIVE   267
+#define OPT_CHUNK_LATENCY 268
+#define OPT_STATS      269
 
 
 void usage() {
     printf("DNSLogzip (Version 1.0.1)\n");
     printf("A tool for compressing or decompressing raw DNS log data.\n");
-    printf("Reads from standard input and writes the result to standard output.\n\n");
+    printf("Reads from standard input and writes the result to standard output.\n");
+    printf("Several log files, each sorted by time, are merged by time into one compressed stream.\n\n");
 
     printf("USAGE:\n");
-    printf("    cat DNS_log_raw_file | DNSLogzip [OPTIONS] > Result_file\n\n");
+    printf("    cat DNS_log_raw_file | DNSLogzip [OPTIONS] > Result_file\n");
+    printf("    DNSLogzip [OPTIONS] DNS_log_raw_file... > Result_file\n\n");
 
     printf("OPTIONS:\n");
     printf("    -D                  Decompress the input data stream.\n");
@@ -30,6 +51,16 @@ void usage() {
     printf("                            0x00 – No compression techniques applied\n");
     printf("                            0x03 – Use only the Data Transformer\n");
     printf("                            0x7F or 0xFF – Use full DNSLogzip (Data Transformer + Data Reducer)\n");
+    printf("                            0x1FF – Also delta-code the line IDs of the chunk header\n");
+    printf("                            0x3FF – Also skip the rraddr locations of answer sets already in order\n");
+    printf("                            0x7FF – Also write IPv6 addresses as the prefix shared with the one before\n");
+    printf("                            0xFFF – Also write IPv4 client and server addresses as the XOR with those\n");
+    printf("                                    of the line before when in the same /24. Smaller before the backend\n");
+    printf("                                    compressor, but not always after it.\n");
+    printf("                            0x17FF – 0x7FF, and also hide the most frequent qtype and rcode pairs of\n");
+    printf("                                    each chunk instead of only qtype 1 with rcode 0\n");
+    printf("                            0x37FF – Also refer to an earlier equal answer RRSet of the chunk by its index\n");
+    printf("                        The mask is not stored in the output: decompress with the same mask.\n");
     printf("                        Default: 0xFF\n\n");
 
     printf("    -E                  Base number for encoding numeric fields used by the Data Reducer module.\n");
@@ -38,37 +69,265 @@ void usage() {
     printf("    -L                  Number of log entries per chunk during compression or decompression used by the Data Transformer module.\n");
     printf("                        Default: 30,000\n\n");
 
+    printf("    --mem-budget <size> Pick the number of log entries per chunk (-L) that fits in <size> bytes of memory,\n");
+    printf("                        with an optional K, M or G suffix. Use the same value to decompress.\n\n");
+
+    printf("    --adaptive <min>    Adaptive chunks: pick the number of log entries of every chunk between <min> and -L\n");
+    printf("                        from the compression of the last chunks. Use the same value to decompress.\n\n");
+
+    printf("    --chunk-latency <ms>\n");
+    printf("                        Adaptive chunks: keep the time from the first line of a chunk to its output under <ms>.\n");
+    printf("                        Default: 0 (no target)\n\n");
+
+    printf("    --run-lines <n>     Hold only <n> log entries of a chunk in memory during compression: larger chunks\n");
+    printf("                        are sorted in runs spilled to a temporary file and merged. Not supported with -f and --listen.\n");
+    printf("                        Default: 0 (the whole chunk in memory)\n\n");
+
+    printf("    --tmp-dir <dir>     Directory of the temporary file of --run-lines.\n");
+    printf("                        Default: $TMPDIR or /tmp\n\n");
+
+    printf("    --time-precision <n>\n");
+    printf("                        Digits of the fractional seconds of the time column, 0 to 9.\n");
+    printf("                        Every line must have exactly <n> of them. Use the same value to decompress.\n");
+    printf("                        Default: 0 (whole seconds)\n\n");
+
+    printf("    --max-delay <ms>    Streaming mode: flush a chunk when its first line has waited <ms> milliseconds.\n");
+    printf("                        Default: 0 (wait for a full chunk)\n\n");
+
+    printf("    --max-bytes <n>     Streaming mode: flush a chunk when its raw lines reach <n> bytes.\n");
+    printf("                        Default: 0 (no limit)\n\n");
+
+    printf("    -f, --follow <file> Follow mode: compress <file> while it is being written, until SIGINT or SIGTERM.\n");
+    printf("                        Each rotation of the file (rename or truncate) goes to a new output <prefix>.<seq>.\n\n");
+
+    printf("    -o, --output <prefix>\n");
+    printf("                        Output prefix of the follow and daemon modes.\n");
+    printf("                        Default: <file>.dlz in follow mode, dnslogzip in daemon mode\n\n");
+
+    printf("    --listen <path>     Daemon mode: accept log lines from many producers on a Unix domain socket,\n");
+    printf("                        until SIGINT or SIGTERM. Each producer goes to its own outputs <prefix>.<source>.<seq>.\n\n");
+
+    printf("    --dgram             Daemon mode: use a datagram socket instead of a stream socket. A sender is\n");
+    printf("                        identified by its full bound path, the unbound and abstract senders share\n");
+    printf("                        the source anon. Datagrams larger than 64 KB are dropped.\n\n");
+
+    printf("    --rotate-bytes <n>  Daemon mode: start a new output once the current one reaches <n> bytes.\n");
+    printf("                        Default: 0 (one output per source)\n\n");
+
+    printf("    --shm <name>        Compress the lines of a co-located producer from the POSIX shared memory\n");
+    printf("                        ring <name>, see include/dlz_ring.h, until the producer closes it.\n\n");
+
+    printf("    --stats             Print the hit rates of the address and answer parse caches of the encoder\n");
+    printf("                        to the standard error at the end. Not supported with -f and --listen.\n\n");
+
+    printf("    --format <name>     Format of the input to compress:\n");
+    printf("                            tsv     – DNSLogzip text log\n");
+    printf("                            bind    – BIND query log\n");
+    printf("                            unbound – Unbound reply log (log-replies: yes)\n");
+    printf("                            dnstap  – dnstap Frame Streams file\n");
+    printf("                            pcap    – pcap or pcapng capture of UDP port 53\n");
+    printf("                        The BIND and syslog times are read in the local time zone (TZ).\n");
+    printf("                        Default: tsv\n\n");
+
     printf("EXAMPLES:\n");
     printf("    Compress a raw DNS log file:\n");
     printf("        bin/DNSLogzip < Public.log 2>>/dev/null | gzip > Public.log.gz\n\n");
     printf("    Decompress a file:\n");
-    printf("        gzip -c -d Public.log.gz | bin/DNSLogzip -D  > Public.DNSLogzip.log\n");
+    printf("        gzip -c -d Public.log.gz | bin/DNSLogzip -D  > Public.DNSLogzip.log\n\n");
+    printf("    Compress a live log, writing a chunk at least every 5 seconds:\n");
+    printf("        bin/DNSLogzip --max-delay 5000 -f /var/log/resolver.log -o /data/resolver\n\n");
+    printf("    Compress the logs of two resolvers into one stream:\n");
+    printf("        bin/DNSLogzip resolver1.log resolver2.log > resolvers.dlz\n\n");
+    printf("    Compress a BIND query log:\n");
+    printf("        bin/DNSLogzip --format bind < query.log > query.dlz\n");
+}
+
+/* A size in bytes, with an optional K, M or G suffix. */
+static size_t parse_size(const char *s)
+{
+	size_t pos, n = std::stoull(s, &pos);
+
+	switch (s[pos]) {
+		case 'G': case 'g':
+			n <<= 10;
+			/* fall through */
+		case 'M': case 'm':
+			n <<= 10;
+			/* fall through */
+		case 'K': case 'k':
+			n <<= 10;
+	}
+
+	return n;
+}
+
+/*
+	Feed the codec from fd. With a max delay, the input is polled so that a
+	chunk is flushed once its first line has waited for nMaxDelay ms.
+*/
+static int feed_codec(dlz_codec_t *codec, int fd, int nMaxDelay)
+{
+	char rbuf[READ_BLOCK_SIZE];
+	struct pollfd pfd;
+	dlz_delay_t delay = {0, 0};
+	ssize_t n = 0;
+	int rc, timeout;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for ( ;; ) {
+		timeout = delay_wait(&delay, codec, nMaxDelay);
+		if (timeout >= 0) {
+			rc = poll(&pfd, 1, timeout);
+			if (rc < 0 && EINTR != errno) {
+				break;
+			}
+
+			if (rc <= 0) {
+				continue;
+			}
+		}
+
+		n = read(fd, rbuf, sizeof(rbuf));
+		if (n <= 0) {
+			break;
+		}
+
+		dlz_codec_feed(codec, rbuf, n);
+		delay_update(&delay, codec, nMaxDelay);
+	}
+
+	if (n < 0) {
+		std::cerr << "error: failed to read input: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void print_hit_rate(const char *sName, uint64_t uHits, uint64_t uLookups)
+{
+	std::cerr << sName << ": " << uHits << " hits of " << uLookups << " lookups";
+	if (uLookups > 0) {
+		std::cerr << " (" << std::fixed << std::setprecision(1) << 100.0 * uHits / uLookups << "%)";
+	}
+	std::cerr << std::endl;
+}
+
+/* Hit rates of the parse caches of the encoder, for --stats. */
+static void print_stats(const dlz_codec_t *codec)
+{
+	dlz_stats_t stats;
+
+	dlz_codec_stats(codec, &stats);
+	print_hit_rate("Address cache", stats.addr_hits, stats.addr_lookups);
+	print_hit_rate("Answer cache", stats.answer_hits, stats.answer_lookups);
 }
 
 int main(int argc, char *argv[])
 {
 	bool bDecompression = false;
-	int o;
-	const char *sOption = "HhDE:M:L:";
+	int o, rc, nInFd = STDIN_FILENO, nFiles, nOutFd = STDOUT_FILENO, nMaxDelay = 0;
+	const char *sOption = "HhDE:M:L:f:o:", *sFollow = NULL, *sListen = NULL, *sShm = NULL;
+	bool bDgram = false, bStats = false;
+	size_t uRotateBytes = 0;
+	std::string sPrefix;
+	const dlz_format_t *fmt = find_format("tsv");
+	const struct option lOptions[] = {
+		{"max-delay", required_argument, NULL, OPT_MAX_DELAY},
+		{"max-bytes", required_argument, NULL, OPT_MAX_BYTES},
+		{"follow",    required_argument, NULL, 'f'},
+		{"listen",    required_argument, NULL, OPT_LISTEN},
+		{"dgram",     no_argument,       NULL, OPT_DGRAM},
+		{"rotate-bytes", required_argument, NULL, OPT_ROTATE},
+		{"shm",       required_argument, NULL, OPT_SHM},
+		{"format",    required_argument, NULL, OPT_FORMAT},
+		{"time-precision", required_argument, NULL, OPT_TIME_PRECISION},
+		{"mem-budget", required_argument, NULL, OPT_MEM_BUDGET},
+		{"run-lines", required_argument, NULL, OPT_RUN_LINES},
+		{"adaptive",  required_argument, NULL, OPT_ADAPTIVE},
+		{"chunk-latency", required_argument, NULL, OPT_CHUNK_LATENCY},
+		{"tmp-dir",   required_argument, NULL, OPT_TMP_DIR},
+		{"stats",     no_argument,       NULL, OPT_STATS},
+		{"output",    required_argument, NULL, 'o'},
+		{"help",      no_argument,       NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
 
-	char rbuf[TOKEN_BUF_SIZE];
-	dlz_row_t row;
-	dlz_buf_t b;
-	DNSLogzip *reducer;
+	dlz_options_t opts;
+	dlz_codec_t *codec;
 
-	while ((o = getopt(argc, argv, sOption)) != -1) {
+	dlz_options_init(&opts);
+
+	while ((o = getopt_long(argc, argv, sOption, lOptions, NULL)) != -1) {
 		switch (o) {
 			case 'D':
 				bDecompression = true;
 				break;
 			case 'L':
-				g_uLineSortingBufSize = std::stoi(optarg);
+				opts.chunk_lines = std::stoi(optarg);
 				break;
 			case 'M':
-				g_uFuncMask = std::stoi(optarg, nullptr, 0);
+				opts.func_mask = std::stoi(optarg, nullptr, 0);
 				break;
 			case 'E':
-				g_ucBaseNum = (unsigned char)std::stoi(optarg);
+				opts.base_num = (unsigned char)std::stoi(optarg);
+				break;
+			case 'f':
+				sFollow = optarg;
+				break;
+			case 'o':
+				sPrefix = optarg;
+				break;
+			case OPT_LISTEN:
+				sListen = optarg;
+				break;
+			case OPT_DGRAM:
+				bDgram = true;
+				break;
+			case OPT_SHM:
+				sShm = optarg;
+				break;
+			case OPT_FORMAT:
+				fmt = find_format(optarg);
+				if (NULL == fmt) {
+					std::cerr << "error: unknown input format " << optarg << "!" << std::endl;
+					return 1;
+				}
+				break;
+			case OPT_ROTATE:
+				uRotateBytes = std::stoul(optarg);
+				break;
+			case OPT_TIME_PRECISION:
+				opts.time_precision = (unsigned char)std::stoi(optarg);
+				break;
+			case OPT_MEM_BUDGET:
+				if (0 != dlz_options_set_mem_budget(&opts, parse_size(optarg))) {
+					std::cerr << "error: memory budget " << optarg << " is too small!" << std::endl;
+					return 1;
+				}
+				break;
+			case OPT_ADAPTIVE:
+				opts.adaptive_min_lines = std::stoul(optarg);
+				break;
+			case OPT_CHUNK_LATENCY:
+				opts.chunk_latency_ms = std::stoul(optarg);
+				break;
+			case OPT_RUN_LINES:
+				opts.run_lines = std::stoul(optarg);
+				break;
+			case OPT_TMP_DIR:
+				opts.spill_dir = optarg;
+				break;
+			case OPT_STATS:
+				bStats = true;
+				break;
+			case OPT_MAX_DELAY:
+				nMaxDelay = std::stoi(optarg);
+				break;
+			case OPT_MAX_BYTES:
+				opts.max_chunk_bytes = std::stoul(optarg);
 				break;
 			case 'h':
 			case 'H':
@@ -82,41 +341,126 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	/* Set the fixed len. */
-	g_ucLocStrFixedLen = (log(g_uLineSortingBufSize) / log(g_ucBaseNum)) + 1;
-
 #ifndef NDEBUG	
 	std::cerr << "Decompression: " << std::boolalpha << bDecompression << "\t"
-				<< "LineBufSize: " << static_cast<int>(g_uLineSortingBufSize) << "\t"
-				<< "Base: " << static_cast<int>(g_ucBaseNum) << "\t"
-				<< "FuncMask: 0x" << std::hex << g_uFuncMask << std::dec << "\t"				
+				<< "LineBufSize: " << static_cast<int>(opts.chunk_lines) << "\t"
+				<< "Base: " << static_cast<int>(opts.base_num) << "\t"
+				<< "FuncMask: 0x" << std::hex << opts.func_mask << std::dec << "\t"				
 				<< std::endl;
 #endif
 
-	memset(&b, 0, sizeof(b));
-	b.fd = STDIN_FILENO;
-	b.start = rbuf;
-	b.end   = rbuf + TOKEN_BUF_SIZE - 1;
-	b.pos   = b.start;
-	b.last  = b.start;
+	nFiles = argc - optind;
+	if (nFiles > 0 && (NULL != sFollow || NULL != sListen || NULL != sShm)) {
+		std::cerr << "error: input files are not supported with -f, --listen and --shm!" << std::endl;
+		return 1;
+	}
+
+	if (nFiles > 1 && (bDecompression || 0 != strcmp(fmt->sName, "tsv"))) {
+		std::cerr << "error: only text logs can be merged!" << std::endl;
+		return 1;
+	}
+
+	if ((NULL != sFollow || NULL != sListen || NULL != sShm) && bDecompression) {
+		std::cerr << "error: -f, --listen and --shm only support compression!" << std::endl;
+		return 1;
+	}
+
+	/* The output of a spilled chunk comes in pieces, which may not span outputs. */
+	if (opts.run_lines > 0 && (NULL != sFollow || NULL != sListen)) {
+		std::cerr << "error: --run-lines is not supported with -f and --listen!" << std::endl;
+		return 1;
+	}
+
+	if (bStats && (bDecompression || NULL != sFollow || NULL != sListen)) {
+		std::cerr << "error: --stats only applies to the compression of the input!" << std::endl;
+		return 1;
+	}
+
+	if (0 != strcmp(fmt->sName, "tsv") && (bDecompression || NULL != sFollow || NULL != sListen || NULL != sShm)) {
+		std::cerr << "error: --format only applies to the compression of the input!" << std::endl;
+		return 1;
+	}
+
+	if (NULL != sListen) {
+		if (sPrefix.empty()) {
+			sPrefix = "dnslogzip";
+		}
+
+		return 0 == serve_socket(sListen, bDgram, sPrefix.c_str(), &opts, nMaxDelay, uRotateBytes) ? 0 : 1;
+	}
+
+	if (NULL != sFollow) {
+		if (sPrefix.empty()) {
+			sPrefix = std::string(sFollow) + ".dlz";
+		}
+
+		return 0 == follow_file(sFollow, sPrefix.c_str(), &opts, nMaxDelay) ? 0 : 1;
+	}
+
+	if (1 == nFiles && 0 != strcmp(argv[optind], "-")) {
+		nInFd = open(argv[optind], O_RDONLY);
+		if (nInFd < 0) {
+			std::cerr << "error: failed to open " << argv[optind] << ": " << strerror(errno) << std::endl;
+			return 1;
+		}
+	}
 
 	if (bDecompression) {
-		reducer = new DNSLogzipD();
+		codec = dlz_decoder_create(&opts, write_chunk, &nOutFd);
+		/* The decoder follows the chunks of the encoder. */
+		nMaxDelay = 0;
+	}
+	else {
+		codec = dlz_encoder_create(&opts, write_chunk, &nOutFd);
+	}
+
+	if (NULL == codec) {
+		if (ENOMEM == errno) {
+			std::cerr << "error: failed to allocate" << std::endl;
+		}
+		else {
+			std::cerr << "error: invalid options!" << std::endl;
+		}
+		return 1;
+	}
+
+	if (NULL != sShm) {
+		rc = consume_ring(sShm, codec, nMaxDelay);
+	}
+	else if (nFiles > 1) {
+		rc = merge_files(argv + optind, nFiles, codec);
+	}
+	else if (0 != strcmp(fmt->sName, "tsv")) {
+		rc = read_format(fmt, nInFd, codec);
 	}
 	else {
-		reducer = new DNSLogzipC();
+		rc = feed_codec(codec, nInFd, nMaxDelay);
 	}
 
-	while (READ_LINE_OK == dlz_read_line(&row, &b)) {
-		reducer->Process(&row);
+	dlz_codec_finish(codec);
+
+	if (!bDecompression) {
+		dlz_stats_t stats;
+
+		dlz_codec_stats(codec, &stats);
+		if (stats.bad_lines > 0) {
+			std::cerr << "warning: skipped " << stats.bad_lines << " malformed lines" << std::endl;
+		}
 	}
 
-	reducer->Finish();
+	if (bStats) {
+		print_stats(codec);
+	}
+
+	dlz_codec_destroy(codec);
+
+	if (STDIN_FILENO != nInFd) {
+		close(nInFd);
+	}
 
 #ifndef NDEBUG
 	std::cerr << "done." << std::endl;
 #endif
 
-	return 0;
+	return 0 == rc ? 0 : 1;
 }
-
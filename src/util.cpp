@@ -71,6 +71,38 @@ int dlz_read_line(dlz_row_t *row, dlz_buf_t *b)
 	}
 }
 
+/*
+	Split a line held in memory into columns, [start, last) must not include the LF.
+	The line is not modified. Return READ_LINE_ERROR if it has more than
+	COLS_MAX_NUM columns.
+*/
+int dlz_split_line(dlz_row_t *row, char *start, char *last)
+{
+	char	  *p;
+	dlz_str_t *word;
+
+	row->ncols = 0;
+
+	for ( ;; ) {
+		p = (char *) memchr(start, RAW_LOG_DELIMITER, last - start);
+
+		word = &row->cols[row->ncols++];
+		word->data = start;
+
+		if (NULL == p) {
+			word->len = last - start;
+			return READ_LINE_OK;
+		}
+
+		word->len = p - start;
+		start = p + 1;
+
+		if (row->ncols == COLS_MAX_NUM) {
+			return READ_LINE_ERROR;
+		}
+	}
+}
+
 char *
 dlz_inet6_ntop(u_char *p, char *text, size_t len)
 {
@@ -157,11 +189,12 @@ dzl_inet_pton(u_char *text, size_t len, in_addr_t &addr)
 {
 	const u_char	  *p;
 	char c;
-	unsigned   octet, n;
+	unsigned   octet, n, digits;
 
 	addr = 0;
 	octet = 0;
 	n = 0;
+	digits = 0;
 
 	for (p = text; p < text + len; p++) {
 
@@ -173,12 +206,15 @@ dzl_inet_pton(u_char *text, size_t len, in_addr_t &addr)
 
 		if (c >= '0' && c <= '9') {
 			octet = octet * 10 + (c - '0');
+			digits++;
 			continue;
 		}
 
-		if (c == '.') {
+		/* An octet has at least one digit. */
+		if (c == '.' && digits > 0) {
 			addr = (addr << 8) + octet;
 			octet = 0;
+			digits = 0;
 			n++;
 			continue;
 		}
@@ -186,7 +222,7 @@ dzl_inet_pton(u_char *text, size_t len, in_addr_t &addr)
 		return INVALID_ADDR;
 	}
 
-	if (n == 3) {
+	if (n == 3 && digits > 0 && octet <= 255) {
 		addr = htonl((addr << 8) + octet);
 		return VALID_ADDR;
 	}
@@ -251,8 +287,7 @@ dzl_inet6_pton(u_char *p, size_t len, u_char *addr)
 				return INVALID_ADDR;
 			}
 
-			dzl_inet_pton(digit, len4 - 1, word);
-			if (word == INADDR_NONE) {
+			if (VALID_ADDR != dzl_inet_pton(digit, len4 - 1, word)) {
 				return INVALID_ADDR;
 			}
 
@@ -0,0 +1,108 @@
+/*
+	Test producer for DNSLogzip --shm: writes the lines of a log file into a
+	shared memory ring as fast as the consumer takes them, and reports the
+	throughput.
+
+	USAGE: dlz_ring_producer <name> <file> [ring size in bytes]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#include <dlz_ring.h>
+
+#define DEFAULT_RING_SIZE (16 * 1024 * 1024)
+#define WRITE_BATCH_SIZE  (64 * 1024)
+
+int main(int argc, char *argv[])
+{
+	dlz_ring_t r;
+	struct stat st;
+	struct timespec t0, t1;
+	uint64_t size = DEFAULT_RING_SIZE, nFull = 0, nLines = 0;
+	char *data, *p, *q, *last;
+	size_t len;
+	double secs;
+	int fd, rc;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <name> <file> [ring size in bytes]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 3) {
+		size = strtoull(argv[3], NULL, 0);
+	}
+
+	fd = open(argv[2], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	if (MAP_FAILED == data) {
+		perror("mmap");
+		return 1;
+	}
+	close(fd);
+
+	if (dlz_ring_create(&r, argv[1], size) < 0) {
+		fprintf(stderr, "error: failed to create ring %s of %llu bytes\n", argv[1], (unsigned long long) size);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	p = data;
+	last = data + st.st_size;
+	while (p < last) {
+		/* Whole lines, up to a batch or half the ring. */
+		len = last - p;
+		len = len > WRITE_BATCH_SIZE ? WRITE_BATCH_SIZE : len;
+		len = len > size / 2 ? size / 2 : len;
+
+		q = memrchr(p, '\n', len);
+		if (NULL == q) {
+			q = memchr(p + len, '\n', last - p - len);
+			if (NULL == q || q + 1 - p > size) {
+				fprintf(stderr, "error: line too long or not terminated by LF\n");
+				break;
+			}
+		}
+		len = q + 1 - p;
+
+		while (-1 == (rc = dlz_ring_write(&r, p, len))) {
+			nFull++;
+			sched_yield();
+		}
+
+		if (rc < 0) {
+			fprintf(stderr, "error: %llu bytes of lines are larger than the ring\n", (unsigned long long) len);
+			break;
+		}
+
+		for (; p <= q; p++) {
+			p = memchr(p, '\n', q + 1 - p);
+			nLines++;
+		}
+	}
+
+	/* Wait for the consumer to take everything. */
+	while (__atomic_load_n(&r.hdr->tail, __ATOMIC_ACQUIRE) != r.pos) {
+		sched_yield();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	dlz_ring_close(&r);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stderr, "%llu lines, %llu bytes in %.3f s: %.0f lines/s, %.1f MB/s, ring full %llu times\n",
+			(unsigned long long) nLines, (unsigned long long) (p - data), secs,
+			nLines / secs, (p - data) / secs / 1e6, (unsigned long long) nFull);
+
+	return 0;
+}